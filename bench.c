@@ -0,0 +1,259 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Harness microbenchmarks
+ *
+ * Times the pieces of the client that sit on or around the probe path, so
+ * a change to them can be checked for cost and noise without an RDMA
+ * device: the timestamp pairs, clock calibration, the address patterns,
+ * the probe loop against the sim and local backends, and a sock_sync_data
+ * round trip over a socketpair.
+ *
+ * Prints one CSV row per benchmark to stdout:
+ *
+ *	bench,reps,ops_per_rep,mean_cycles,mean_ns,stddev_ns,min_ns,max_ns
+ *
+ * where each rep times ops_per_rep operations and the figures are per
+ * operation, so the spread across reps is the jitter.
+ *
+ * ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include <infiniband/verbs.h>
+
+#include "get_clock.h"
+#include "sockets.h"
+#include "resources.h"
+#include "stats.h"
+#include "transport.h"
+#include "pattern.h"
+
+/* a small buffer, the benchmarks time the harness rather than the cache */
+struct config_t config = {
+	.tcp_port = 19875,
+	.ib_port = 1,
+	.gid_idx = -1,
+	.iters = 1000,
+	.msg_size = 64,
+	.column_count = 16,
+	.row_count = 8192,
+	.max_clients = 1,
+	.backend = "sim",
+	.batch = 1,
+	.pf_lines = 8,
+	.block = 1000,
+	.freq_tol = 5,
+	.tsc = TSC_FENCED,
+};
+
+static double cycles_to_usec;
+
+/* where results that are otherwise unused go, so they are not optimized away */
+static volatile uint64_t sink;
+
+/* one CSV row from per-rep cycle counts of ops operations each */
+static void report(const char *name, const struct stats *s, int ops)
+{
+	double ns = 1000 / cycles_to_usec / ops;
+
+	printf("%s,%lu,%d,%.2f,%.2f,%.2f,%.2f,%.2f\n", name, s->count, ops,
+			s->mean / ops, s->mean * ns, stats_stddev(s) * ns, s->min * ns, s->max * ns);
+}
+
+
+static void bench_tsc(void)
+{
+	struct stats	s;
+	uint64_t	start;
+	int		i;
+
+	stats_init(&s);
+	for (i = 0; i < 1000000; i++) {
+		start = start_tsc();
+		stats_add(&s, stop_tsc() - start);
+	}
+	report("start_stop_tsc", &s, 1);
+
+	stats_init(&s);
+	for (i = 0; i < 1000000; i++) {
+		start = rdtscp_tsc();
+		stats_add(&s, rdtscp_tsc() - start);
+	}
+	report("rdtscp_tsc", &s, 1);
+}
+
+
+static void bench_cpu_mhz(void)
+{
+	struct stats	s;
+	uint64_t	start;
+	int		i;
+
+	stats_init(&s);
+	for (i = 0; i < 5; i++) {
+		start = start_tsc();
+		sink = get_cpu_mhz(false);
+		stats_add(&s, stop_tsc() - start);
+	}
+	report("get_cpu_mhz", &s, 1);
+}
+
+
+#define PATTERN_OPS	1024
+
+static void bench_pattern(const char *name, int mode, uint64_t count)
+{
+	struct pattern	p;
+	struct stats	s;
+	uint64_t	start, offset;
+	int		i;
+
+	if (pattern_init(&p, mode))
+		return;
+	if (count)
+		p.count = count;
+
+	stats_init(&s);
+	while (p.next + PATTERN_OPS <= p.count) {
+		start = start_tsc();
+		for (i = 0; i < PATTERN_OPS; i++) {
+			pattern_next(&p, &offset);
+			sink = offset;
+		}
+		stats_add(&s, stop_tsc() - start);
+	}
+	report(name, &s, PATTERN_OPS);
+}
+
+
+#define PROBE_OPS	64
+
+/* read, write, read of every line of the seq pattern, as the client does */
+static int bench_probe(const char *name, const char *backend)
+{
+	struct resources	res;
+	struct pattern		p;
+	struct stats		s;
+	uint64_t		start, offset, base, cycles;
+	int			i, rc = 1;
+
+	config.backend = backend;
+	resources_init(&res);
+	res.transport = transport_find(backend);
+	if (res.transport->create(&res))
+		goto bench_probe_exit;
+
+	base = res.remote_props.addr;
+	if (pattern_init(&p, 0))
+		goto bench_probe_exit;
+	stats_init(&s);
+	while (p.next + PROBE_OPS <= p.count) {
+		start = start_tsc();
+		for (i = 0; i < PROBE_OPS; i++) {
+			pattern_next(&p, &offset);
+			res.remote_props.addr = base + offset;
+			if (transport_probe(&res, IBV_WR_RDMA_READ, &cycles) ||
+					transport_probe(&res, IBV_WR_RDMA_WRITE, &cycles) ||
+					transport_probe(&res, IBV_WR_RDMA_READ, &cycles))
+				goto bench_probe_exit;
+		}
+		stats_add(&s, stop_tsc() - start);
+	}
+	report(name, &s, PROBE_OPS);
+	rc = 0;
+
+bench_probe_exit:
+	if (res.transport->destroy(&res))
+		rc = 1;
+	return rc;
+}
+
+
+#define SYNC_REPS	20000
+
+/* the other end of the socketpair, answering every sync */
+static void *sync_echo(void *arg)
+{
+	int	sock = *(int *) arg;
+	char	c = 'E', r;
+	int	i;
+
+	for (i = 0; i < SYNC_REPS; i++)
+		if (sock_sync_data(sock, 1, &c, &r))
+			break;
+	return NULL;
+}
+
+static int bench_sync(void)
+{
+	struct stats	s;
+	pthread_t	thread;
+	uint64_t	start;
+	int		sv[2], i, rc = 0;
+	char		c = 'R', r;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		perror("socketpair");
+		return 1;
+	}
+	if (pthread_create(&thread, NULL, sync_echo, &sv[1])) {
+		fprintf(stderr, "failed to start the sync echo thread\n");
+		close(sv[0]);
+		close(sv[1]);
+		return 1;
+	}
+
+	stats_init(&s);
+	for (i = 0; i < SYNC_REPS && !rc; i++) {
+		start = start_tsc();
+		rc = sock_sync_data(sv[0], 1, &c, &r);
+		stats_add(&s, stop_tsc() - start);
+	}
+
+	/* a failed sync leaves the echo thread waiting, closing our end ends it */
+	close(sv[0]);
+	pthread_join(thread, NULL);
+	close(sv[1]);
+
+	if (!rc)
+		report("sock_sync_data", &s, 1);
+	return rc;
+}
+
+
+int main(void)
+{
+	cpu_set_t	s;
+	int		rc = 0;
+
+	/* stay on one CPU, as the client does */
+	CPU_ZERO(&s);
+	CPU_SET(sched_getcpu(), &s);
+	sched_setaffinity(0, sizeof(s), &s);
+
+	cycles_to_usec = get_cpu_mhz(false);
+	if (!cycles_to_usec) {
+		fprintf(stderr, "could not calibrate the TSC\n");
+		return 1;
+	}
+
+	printf("bench,reps,ops_per_rep,mean_cycles,mean_ns,stddev_ns,min_ns,max_ns\n");
+
+	bench_tsc();
+	bench_cpu_mhz();
+	bench_pattern("pattern_seq", 0, 0);
+	bench_pattern("pattern_rand", 1, 1 << 20);
+	rc |= bench_probe("probe_sim", "sim");
+	rc |= bench_probe("probe_local", "local");
+	rc |= bench_sync();
+
+	return rc;
+}
@@ -0,0 +1,149 @@
+/* vim: set noet: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <infiniband/verbs.h>
+
+#include "calibration.h"
+#include "transport.h"
+#include "contention.h"
+#include "topology.h"
+#include "evict.h"
+
+#define CALIBRATION_PAGE	4096
+
+
+int calibration_sweep(void)
+{
+	char	*buf;
+	size_t	size, off, line = topology_line(&server_cache);
+
+	buf = evict_buffer(server_cache.llc_size, &size);
+	if (!buf)
+		return 1;
+
+	/* a memset this large may store around the cache, read every line back */
+	for (off = 0; off < size; off += line)
+		(void) *(volatile const char *) (buf + off);
+
+	free(buf);
+	return 0;
+}
+
+
+/* a step through n slots that visits each once, far from 1 so no two lines
+ * read in a row are neighbours */
+static uint64_t calibration_step(uint64_t n)
+{
+	uint64_t step = (n * 5 / 8) | 1, a, b, t;
+
+	for (;; step += 2) {
+		for (a = step, b = n; b; t = a % b, a = b, b = t)
+			;
+		if (a == 1)
+			return step % n;
+	}
+}
+
+
+/* the server sweeps between the two syncs */
+static int calibration_swept(struct resources *res)
+{
+	char temp_char;
+
+	if (transport_sync(res, 1, "S", &temp_char) || transport_sync(res, 1, "C", &temp_char)) {
+		fprintf(stderr, "sync error around the calibration sweep\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+int calibration_run(struct resources *res, uint32_t reads, struct calibration *cal)
+{
+	uint64_t	orig_addr = res->remote_props.addr, size = buffer_size();
+	uint64_t	misses, stride, step, cycles, i, j;
+	uint32_t	in_page = 1;
+	int		rc = 1;
+
+	hist_init(&cal->hist);
+	cal->reads = 0;
+
+	if (calibration_swept(res))
+		return 1;
+
+	/* as far apart as the buffer allows, pages apart each at another line of its page */
+	misses = reads < size / config.msg_size ? reads : size / config.msg_size;
+	stride = size / misses / config.msg_size * config.msg_size;
+	if (stride >= CALIBRATION_PAGE) {
+		stride &= ~(uint64_t) (CALIBRATION_PAGE - 1);
+		in_page = config.msg_size < CALIBRATION_PAGE ? CALIBRATION_PAGE / config.msg_size : 1;
+	}
+
+	/* out of order, so no stride shows for a prefetcher to follow */
+	step = calibration_step(misses);
+	for (i = 0, j = 0; i < misses; i++, j = (j + step) % misses) {
+		res->remote_props.addr = orig_addr + j * stride + (j % in_page) * config.msg_size;
+		if (transport_probe(res, IBV_WR_RDMA_READ, &cycles))
+			goto calibration_run_exit;
+		hist_add(&cal->hist, 0, cycles);
+	}
+
+	/* then one line, written and read back again and again */
+	res->remote_props.addr = orig_addr;
+	res->buf[0] += 2;
+	if (transport_probe(res, IBV_WR_RDMA_WRITE, &cycles))
+		goto calibration_run_exit;
+
+	for (i = 0; i < reads; i++) {
+		if (transport_probe(res, IBV_WR_RDMA_READ, &cycles))
+			goto calibration_run_exit;
+		hist_add(&cal->hist, 1, cycles);
+	}
+
+	hist_classify(&cal->hist, &cal->cutoff);
+	cal->reads = reads;
+	rc = 0;
+
+calibration_run_exit:
+	if (rc)
+		fprintf(stderr, "calibration probe failed\n");
+	res->remote_props.addr = orig_addr;
+
+	/* and again, so the run does not start with the line just read in */
+	return rc || calibration_swept(res);
+}
+
+
+int calibration_header(const struct calibration *cal, char *buf, size_t len, double cycles_to_usec)
+{
+	static const double	percentiles[] = CALIBRATION_PERCENTILES;
+	static const char *const names[2] = { "miss_ns", "hit_ns" };
+	double			ns_per_cycle = 1000 / cycles_to_usec;
+	char			load[128];
+	size_t			n, i;
+	int			which;
+
+	contention_describe(&server_contention, load, sizeof(load));
+	n = snprintf(buf, len, "# run mode=%d iters=%d msg_size=%u buffer=%lu seed=%lu backend=%s\n# contention %s\n",
+			config.mode, config.iters, config.msg_size, buffer_size(), config.seed, config.backend, load);
+	if (!cal->reads || n >= len)
+		return n;
+
+	n += snprintf(buf + n, len - n, "# calibration misses=%lu hits=%lu cutoff_cycles=%lu cutoff_ns=%.1f accuracy=%.4f\n",
+			cal->hist.total[0], cal->hist.total[1], cal->cutoff.threshold,
+			cal->cutoff.threshold * ns_per_cycle, cal->cutoff.accuracy);
+
+	for (which = 1; which >= 0 && n < len; which--) {
+		n += snprintf(buf + n, len - n, "# %s", names[which]);
+		for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]) && n < len; i++)
+			n += snprintf(buf + n, len - n, " p%.0f=%.1f", percentiles[i],
+					hist_percentile(&cal->hist, which, percentiles[i] / 100) * ns_per_cycle);
+		if (n < len)
+			n += snprintf(buf + n, len - n, "\n");
+	}
+
+	return n;
+}
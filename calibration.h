@@ -0,0 +1,90 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Hit/miss calibration
+ *
+ * Before the first probe the client reads lines whose state it knows, so
+ * each run carries its own reference distributions instead of thresholds
+ * picked by hand for every trace.
+ *
+ *	misses	-E lines spread evenly over the server's buffer, at least a page
+ *		apart where the buffer allows and each at a different offset
+ *		in its page, read once each right after the server swept its
+ *		LLC: it walked a buffer of its own EVICT_FACTOR times the LLC,
+ *		so none of them is resident and no prefetcher has a reason to
+ *		bring them in
+ *	hits	one line written and then read back -E times in a row
+ *
+ * The cutoff is the one hist_classify places between the two, reads at or
+ * above it are misses. It replaces the run's own threshold where the client
+ * classifies without ground truth (the heatmap), and it is written with the
+ * reference distributions ahead of the samples, to stdout or the -o file,
+ * as comment lines the sample parsers skip:
+ *
+ *	# run mode=1 iters=1000 msg_size=64 buffer=8388608 seed=1 backend=sim
+ *	# contention none
+ *	# calibration misses=1000 hits=1000 cutoff_cycles=4550 cutoff_ns=1516.7 accuracy=0.9520
+ *	# hit_ns p1=... p5=... p25=... p50=... p75=... p95=... p99=...
+ *	# miss_ns p1=... (the same percentiles)
+ *
+ * where contention is what contention_describe says of the server's
+ * workload and percentiles are the lower edge of their histogram bucket.
+ *
+ * data/generate_graphs.r derives its default filters from these lines.
+ *
+ * The server sweeps once more afterwards, so the run does not start with
+ * the hit line resident. The sim and local backends sweep by emptying their
+ * model and flushing their buffer. A daemon serving other clients at the
+ * same time sweeps their lines out too.
+ *
+ * ******************************************************************************/
+
+#ifndef CALIBRATION_H_
+#define CALIBRATION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "resources.h"
+#include "stats.h"
+
+/* reads of each kind by default, -E */
+#define CALIBRATION_READS	1000
+
+/* percentiles in the header, in percent */
+#define CALIBRATION_PERCENTILES	{ 1, 5, 25, 50, 75, 95, 99 }
+
+struct calibration {
+	uint32_t		reads;		/* of each kind, 0 when not calibrated */
+	struct histogram	hist;		/* [0] the misses, [1] the hits, as
+						 * hist_classify wants them */
+	struct classifier	cutoff;
+};
+
+/* sweep the server's LLC for the client, on the server, 0 on success */
+int calibration_sweep(void);
+
+/******************************************************************************
+ * *	Function: calibration_run
+ * *
+ * *	Input
+ * *	res	client resources, connected, nothing outstanding on the QP
+ * *	reads	reads of each kind
+ * *
+ * *	Output
+ * *	cal	the reference distributions and the cutoff between them
+ * *
+ * *	Returns
+ * *	0 on success, 1 on a failed sync or probe
+ * *
+ * *	Description
+ * *	Have the server sweep its LLC, read the misses and the hits as above
+ * *	and have it sweep again. remote_props.addr is left as it was. Nothing
+ * *	goes into the run's statistics.
+ * ******************************************************************************/
+int calibration_run(struct resources *res, uint32_t reads, struct calibration *cal);
+
+/* the run header as above, only its first two lines without calibration,
+ * the length as snprintf's */
+int calibration_header(const struct calibration *cal, char *buf, size_t len, double cycles_to_usec);
+
+#endif // CALIBRATION_H_
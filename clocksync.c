@@ -0,0 +1,265 @@
+/* vim: set noet: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include <infiniband/verbs.h>
+
+#include "clocksync.h"
+#include "completion.h"
+
+#define CLOCKSYNC_PAGE	4096
+
+/* the server's end, a thread storing its TSC into the first line of a page */
+struct clocksync_source {
+	volatile uint64_t	*tsc;
+	struct ibv_mr		*mr;
+	pthread_t		thread;
+	atomic_int		stop;
+	int			started;
+};
+
+struct clocksync_point {
+	uint64_t	sample;
+	uint64_t	client;		/* midpoint of the READ's round trip */
+	uint64_t	server;
+	uint64_t	rtt;
+};
+
+/* the client's end, in res->clock */
+struct clocksync {
+	uint64_t		addr;	/* of the server's TSC line */
+	uint32_t		rkey;
+	struct ibv_mr		*mr;
+	uint64_t		*slot;	/* what the READ lands in */
+	struct clocksync_point	*points;
+	size_t			count;
+	size_t			size;
+};
+
+
+static void *clocksync_thread(void *arg)
+{
+	struct clocksync_source *s = arg;
+
+	while (!atomic_load_explicit(&s->stop, memory_order_relaxed))
+		*s->tsc = htonll(get_cycles());
+
+	return NULL;
+}
+
+
+struct clocksync_source *clocksync_start(struct resources *res, struct doorbell_wire *wire)
+{
+	struct clocksync_source *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->tsc = aligned_alloc(CLOCKSYNC_PAGE, CLOCKSYNC_PAGE);
+	if (!s->tsc) {
+		fprintf(stderr, "failed to allocate the clock line\n");
+		goto clocksync_start_fail;
+	}
+	*s->tsc = htonll(get_cycles());
+
+	s->mr = ibv_reg_mr(res->pd, (void *) s->tsc, CLOCKSYNC_PAGE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+	if (!s->mr) {
+		fprintf(stderr, "ibv_reg_mr failed for the clock line (%s)\n", strerror(errno));
+		goto clocksync_start_fail;
+	}
+
+	if (pthread_create(&s->thread, NULL, clocksync_thread, s)) {
+		fprintf(stderr, "failed to start the clock thread\n");
+		goto clocksync_start_fail;
+	}
+	s->started = 1;
+
+	wire->addr = htonll((uintptr_t) s->tsc);
+	wire->rkey = htonl(s->mr->rkey);
+	return s;
+
+clocksync_start_fail:
+	clocksync_stop(s);
+	return NULL;
+}
+
+
+int clocksync_stop(struct clocksync_source *s)
+{
+	int rc = 0;
+
+	if (!s)
+		return 0;
+
+	if (s->started) {
+		atomic_store(&s->stop, 1);
+		pthread_join(s->thread, NULL);
+	}
+	if (s->mr && ibv_dereg_mr(s->mr)) {
+		fprintf(stderr, "failed to deregister the clock line\n");
+		rc = 1;
+	}
+
+	free((void *) s->tsc);
+	free(s);
+	return rc;
+}
+
+
+int clocksync_attach(struct resources *res, const struct doorbell_wire *wire)
+{
+	struct clocksync *c;
+
+	/* sim and local echo the sync back, their server runs on our clock */
+	if (!wire->addr)
+		return 0;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return 1;
+	res->clock = c;
+
+	c->addr = ntohll(wire->addr);
+	c->rkey = ntohl(wire->rkey);
+	c->slot = aligned_alloc(64, 64);
+	if (!c->slot) {
+		fprintf(stderr, "failed to allocate the clock slot\n");
+		return 1;
+	}
+
+	c->mr = ibv_reg_mr(res->pd, c->slot, 64, IBV_ACCESS_LOCAL_WRITE);
+	if (!c->mr) {
+		fprintf(stderr, "ibv_reg_mr failed for the clock slot (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+
+int clocksync_estimate(struct resources *res, uint64_t sample)
+{
+	struct clocksync	*c = res->clock;
+	struct clocksync_point	best = { .rtt = UINT64_MAX };
+	struct ibv_send_wr	sr, *bad_wr = NULL;
+	struct ibv_sge		sge;
+	uint64_t		posted, completed;
+	int			i;
+
+	if (!c)
+		return 0;
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t) c->slot;
+	sge.length = sizeof(uint64_t);
+	sge.lkey = c->mr->lkey;
+
+	memset(&sr, 0, sizeof(sr));
+	sr.wr_id = 0;
+	sr.sg_list = &sge;
+	sr.num_sge = 1;
+	sr.opcode = IBV_WR_RDMA_READ;
+	sr.send_flags = IBV_SEND_SIGNALED;
+	sr.wr.rdma.remote_addr = c->addr;
+	sr.wr.rdma.rkey = c->rkey;
+
+	for (i = 0; i < CLOCKSYNC_ROUNDS; i++) {
+		posted = start_tsc();
+		if (ibv_post_send(res->qp, &sr, &bad_wr)) {
+			fprintf(stderr, "failed to post the clock READ\n");
+			return 1;
+		}
+		if (cq_wait(res->cq, 1, cq_deadline(CQ_TIMEOUT_MS), TSC_FENCED, &completed))
+			return 1;
+
+		if (completed - posted < best.rtt) {
+			best.rtt = completed - posted;
+			best.client = posted + best.rtt / 2;
+			best.server = ntohll(*c->slot);
+		}
+	}
+	best.sample = sample;
+
+	if (c->count == c->size) {
+		size_t			size = c->size ? 2 * c->size : 64;
+		struct clocksync_point	*points = realloc(c->points, size * sizeof(*points));
+
+		if (!points) {
+			fprintf(stderr, "failed to keep %zu clock estimates\n", size);
+			return 1;
+		}
+		c->points = points;
+		c->size = size;
+	}
+	c->points[c->count++] = best;
+
+	return 0;
+}
+
+
+int clocksync_finish(struct resources *res, const char *path)
+{
+	struct clocksync	*c = res->clock;
+	const struct clocksync_point *first, *last;
+	uint64_t		server_khz = res->peer.tsc_khz, worst = 0, best = UINT64_MAX;
+	double			nominal, slope;
+	FILE			*f;
+	size_t			i;
+	int			rc = 0;
+
+	if (!c || !c->count)
+		return 0;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	fprintf(f, "sample,client_tsc,server_tsc,rtt_cycles\n");
+	for (i = 0; i < c->count; i++) {
+		fprintf(f, "%lu,%lu,%lu,%lu\n", c->points[i].sample, c->points[i].client, c->points[i].server, c->points[i].rtt);
+		if (c->points[i].rtt > worst)
+			worst = c->points[i].rtt;
+		if (c->points[i].rtt < best)
+			best = c->points[i].rtt;
+	}
+	if (fclose(f)) {
+		fprintf(stderr, "failed to write the clock estimates to %s\n", path);
+		rc = 1;
+	}
+
+	if (!server_khz) {
+		fprintf(stderr, "clock: %zu estimates, the server did not say its TSC rate\n", c->count);
+		return rc;
+	}
+
+	/* the line through the first and last estimate, against what the rates say it should be */
+	first = &c->points[0];
+	last = &c->points[c->count - 1];
+	nominal = (double) server_khz / cq_cycles_per_ms;
+	slope = last->client > first->client ? (double) (int64_t) (last->server - first->server) / (last->client - first->client) : nominal;
+	fprintf(stderr, "clock: %zu estimates, server TSC = %lu + %.9f * (client TSC - %lu), drift %.2f ppm, round trips %.0f to %.0f ns\n",
+			c->count, first->server, slope, first->client, (slope / nominal - 1) * 1e6,
+			best * 1e6 / cq_cycles_per_ms, worst * 1e6 / cq_cycles_per_ms);
+
+	return rc;
+}
+
+
+void clocksync_close(struct clocksync *c)
+{
+	if (!c)
+		return;
+
+	if (c->mr)
+		ibv_dereg_mr(c->mr);
+	free(c->slot);
+	free(c->points);
+	free(c);
+}
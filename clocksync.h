@@ -0,0 +1,80 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Client/server clock alignment
+ *
+ * Maps the server's TSC onto the client's, so that whatever the server
+ * stamps can be placed on the client's sample timeline. With -Y the server
+ * starts a thread that keeps storing its TSC into a registered line. The
+ * client reads that line CLOCKSYNC_ROUNDS times in a row with RDMA READs,
+ * stamping each one when it is posted and when it completes. The value was
+ * stored somewhere in between, and the read with the shortest round trip
+ * bounds it best, so only that one is kept, as the pair (midpoint of the
+ * round trip, server TSC) with its round trip as the error.
+ *
+ * The client takes an estimate before the first probe, every -b samples
+ * and after the last one, and writes them to the file as CSV
+ *
+ *	sample,client_tsc,server_tsc,rtt_cycles
+ *
+ * where sample is the number of samples recorded before the estimate and
+ * both TSCs are raw. The summary on stderr gives the line through the first
+ * and the last estimate, server TSC as a function of client TSC, and its
+ * drift: how far its slope is from the ratio of the two TSC rates the
+ * handshake reported, in ppm. The rates are measured against each side's
+ * monotonic clock, so the drift includes the error of that measurement.
+ *
+ * ******************************************************************************/
+
+#ifndef CLOCKSYNC_H_
+#define CLOCKSYNC_H_
+
+#include <stdint.h>
+
+#include "resources.h"
+#include "doorbell.h"
+
+/* READs per estimate, the one with the shortest round trip is kept */
+#define CLOCKSYNC_ROUNDS	16
+
+struct clocksync_source;
+struct clocksync;
+
+/******************************************************************************
+ * *	Function: clocksync_start
+ * *
+ * *	Input
+ * *	res	server resources of the session, connected
+ * *
+ * *	Output
+ * *	wire	address and rkey of the TSC line in network byte order, for
+ * *		the client
+ * *
+ * *	Returns
+ * *	the running clock thread, NULL on failure
+ * ******************************************************************************/
+struct clocksync_source *clocksync_start(struct resources *res, struct doorbell_wire *wire);
+
+/* stop the clock thread and release it, 0 on success */
+int clocksync_stop(struct clocksync_source *s);
+
+/* the client's end of the wire in res->clock, left NULL when wire is all 0 */
+int clocksync_attach(struct resources *res, const struct doorbell_wire *wire);
+
+/******************************************************************************
+ * *	Function: clocksync_estimate
+ * *
+ * *	Input
+ * *	res	client resources, nothing outstanding on the QP
+ * *	sample	samples recorded so far, to place the estimate in the run
+ * *
+ * *	Returns
+ * *	0 on success or without a server clock, 1 on a failed READ
+ * ******************************************************************************/
+int clocksync_estimate(struct resources *res, uint64_t sample);
+
+/* write the estimates to path as above and summarize them, 0 on success */
+int clocksync_finish(struct resources *res, const char *path);
+
+void clocksync_close(struct clocksync *c);
+
+#endif // CLOCKSYNC_H_
@@ -0,0 +1,408 @@
+/* vim: set noet: */
+#ifdef HAVE_RDMACM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <infiniband/verbs.h>
+#include <rdma/rdma_cma.h>
+
+#include "resources.h"
+#include "cm.h"
+
+/* address and route resolution timeout */
+#define CM_TIMEOUT_MS 2000
+
+/* device contexts opened by librdmacm, shared by every id */
+static struct ibv_context **cm_devices;
+
+
+int cm_open_device(struct resources *res)
+{
+	int num_devices = 0;
+	int i;
+
+	if (!cm_devices) {
+		cm_devices = rdma_get_devices(&num_devices);
+		if (!cm_devices) {
+			fprintf(stderr, "failed to get rdma_cm devices\n");
+			return 1;
+		}
+	} else
+		while (cm_devices[num_devices])
+			num_devices++;
+
+	for (i = 0; i < num_devices; i++) {
+		if (!config.dev_name) {
+			config.dev_name = strdup(ibv_get_device_name(cm_devices[i]->device));
+			debug_print("device not specified, using first one found: %s\n", config.dev_name);
+		}
+		if (!strcmp(ibv_get_device_name(cm_devices[i]->device), config.dev_name)) {
+			res->ib_ctx = cm_devices[i];
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "IB device %s wasn't found\n", config.dev_name ? config.dev_name : "");
+	cm_close_device();
+
+	return 1;
+}
+
+
+void cm_close_device(void)
+{
+	if (cm_devices)
+		rdma_free_devices(cm_devices);
+	cm_devices = NULL;
+}
+
+
+/* Wait for the next event on ch, it must be of the expected type */
+static int cm_wait_event(struct rdma_event_channel *ch, enum rdma_cm_event_type expected, struct cm_con_data_t *remote)
+{
+	struct rdma_cm_event *event;
+	int rc = 0;
+
+	if (rdma_get_cm_event(ch, &event)) {
+		fprintf(stderr, "rdma_get_cm_event failed (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	if (event->event != expected) {
+		fprintf(stderr, "got rdma_cm event %s (status %d), expected %s\n",
+				rdma_event_str(event->event), event->status, rdma_event_str(expected));
+		rc = 1;
+	} else if (remote) {
+		if (event->param.conn.private_data_len < sizeof(*remote)) {
+			fprintf(stderr, "peer sent %u bytes of private data, expected %zu\n",
+					event->param.conn.private_data_len, sizeof(*remote));
+			rc = 1;
+		} else
+			memcpy(remote, event->param.conn.private_data, sizeof(*remote));
+	}
+
+	rdma_ack_cm_event(event);
+
+	return rc;
+}
+
+
+/* Our half of the exchange, in the same byte order connect_qp uses */
+static void cm_local_data(struct resources *res, struct cm_con_data_t *local)
+{
+	memset(local, 0, sizeof(*local));
+	local->addr = htonll((uintptr_t)res->buf);
+	local->rkey = htonl(res->mr->rkey);
+	local->qp_num = htonl(res->qp->qp_num);
+}
+
+
+static void cm_remote_data(struct resources *res, const struct cm_con_data_t *wire)
+{
+	memset(&res->remote_props, 0, sizeof(res->remote_props));
+	res->remote_props.addr = ntohll(wire->addr);
+	res->remote_props.rkey = ntohl(wire->rkey);
+	res->remote_props.qp_num = ntohl(wire->qp_num);
+
+	debug_print("Remote address = 0x%"PRIx64"\n", res->remote_props.addr);
+	debug_print("Remote rkey = 0x%x\n", res->remote_props.rkey);
+	debug_print("Remote QP number = 0x%x\n", res->remote_props.qp_num);
+}
+
+
+static void cm_conn_param(struct resources *res, struct rdma_conn_param *param, const struct cm_con_data_t *local)
+{
+	memset(param, 0, sizeof(*param));
+	param->private_data = local;
+	param->private_data_len = sizeof(*local);
+	param->responder_resources = qp_rd_atomic(res, 1);
+	param->initiator_depth = qp_rd_atomic(res, 0);
+	param->retry_count = 6;
+	/* retry forever while the peer reposts its control receive */
+	param->rnr_retry_count = 7;
+}
+
+
+static int cm_client_connect(struct resources *res)
+{
+	struct rdma_event_channel	*ch;
+	struct rdma_conn_param		param;
+	struct cm_con_data_t		local, remote;
+	struct addrinfo			*resolved_addr = NULL;
+	struct addrinfo			hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM
+	};
+	char				service[6];
+	int				rc;
+
+	ch = rdma_create_event_channel();
+	if (!ch) {
+		fprintf(stderr, "failed to create rdma_cm event channel\n");
+		return 1;
+	}
+
+	if (rdma_create_id(ch, &res->cm_id, NULL, RDMA_PS_TCP)) {
+		fprintf(stderr, "rdma_create_id failed (%s)\n", strerror(errno));
+		rdma_destroy_event_channel(ch);
+		return 1;
+	}
+
+	sprintf(service, "%d", config.tcp_port);
+	rc = getaddrinfo(config.server_name, service, &hints, &resolved_addr);
+	if (rc) {
+		fprintf(stderr, "%s for %s:%d\n", gai_strerror(rc), config.server_name, config.tcp_port);
+		return 1;
+	}
+
+	rc = rdma_resolve_addr(res->cm_id, NULL, resolved_addr->ai_addr, CM_TIMEOUT_MS);
+	freeaddrinfo(resolved_addr);
+	if (rc) {
+		fprintf(stderr, "rdma_resolve_addr failed (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	if (cm_wait_event(ch, RDMA_CM_EVENT_ADDR_RESOLVED, NULL))
+		return 1;
+
+	if (rdma_resolve_route(res->cm_id, CM_TIMEOUT_MS)) {
+		fprintf(stderr, "rdma_resolve_route failed (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	if (cm_wait_event(ch, RDMA_CM_EVENT_ROUTE_RESOLVED, NULL))
+		return 1;
+
+	/* the route decides the device unless one was asked for */
+	if (!config.dev_name)
+		config.dev_name = strdup(ibv_get_device_name(res->cm_id->verbs->device));
+
+	if (resources_open_device(res))
+		return 1;
+
+	if (res->ib_ctx != res->cm_id->verbs) {
+		fprintf(stderr, "route to %s goes through %s, not %s\n", config.server_name,
+				ibv_get_device_name(res->cm_id->verbs->device), config.dev_name);
+		return 1;
+	}
+
+	if (resources_create_qp(res))
+		return 1;
+
+	/* the server's initial SEND must land in buf, so post that receive first */
+	if (post_receive(res) || ctrl_post_recv(res))
+		return 1;
+
+	cm_local_data(res, &local);
+	cm_conn_param(res, &param, &local);
+
+	if (rdma_connect(res->cm_id, &param)) {
+		fprintf(stderr, "rdma_connect failed (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	if (cm_wait_event(ch, RDMA_CM_EVENT_ESTABLISHED, &remote))
+		return 1;
+
+	cm_remote_data(res, &remote);
+
+	debug_print("rdma_cm connection to %s established\n", config.server_name);
+
+	return 0;
+}
+
+
+int cm_listen(int port, struct rdma_cm_id **listen_id)
+{
+	struct rdma_event_channel	*ch;
+	struct sockaddr_in		addr;
+
+	ch = rdma_create_event_channel();
+	if (!ch) {
+		fprintf(stderr, "failed to create rdma_cm event channel\n");
+		return 1;
+	}
+
+	if (rdma_create_id(ch, listen_id, NULL, RDMA_PS_TCP)) {
+		fprintf(stderr, "rdma_create_id failed (%s)\n", strerror(errno));
+		rdma_destroy_event_channel(ch);
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (rdma_bind_addr(*listen_id, (struct sockaddr *) &addr) || rdma_listen(*listen_id, SOMAXCONN)) {
+		fprintf(stderr, "failed to listen on port %d (%s)\n", port, strerror(errno));
+		rdma_destroy_id(*listen_id);
+		rdma_destroy_event_channel(ch);
+		*listen_id = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+int cm_get_request(struct rdma_cm_id *listen_id, struct rdma_cm_id **id, struct cm_con_data_t *remote)
+{
+	struct rdma_cm_event	*event;
+	struct rdma_cm_id	*request = NULL;
+	int			short_data = 0;
+
+	*id = NULL;
+
+	if (rdma_get_cm_event(listen_id->channel, &event)) {
+		fprintf(stderr, "rdma_get_cm_event failed (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST) {
+		request = event->id;
+		if (event->param.conn.private_data_len < sizeof(*remote)) {
+			fprintf(stderr, "client sent %u bytes of private data, expected %zu\n",
+					event->param.conn.private_data_len, sizeof(*remote));
+			short_data = 1;
+		} else
+			memcpy(remote, event->param.conn.private_data, sizeof(*remote));
+	} else
+		debug_print("ignoring rdma_cm event %s on listening id\n", rdma_event_str(event->event));
+
+	/* the event has to be acked before its id can be destroyed */
+	rdma_ack_cm_event(event);
+
+	if (short_data) {
+		rdma_reject(request, NULL, 0);
+		rdma_destroy_id(request);
+	} else
+		*id = request;
+
+	return 0;
+}
+
+
+int cm_accept(struct resources *res, struct rdma_cm_id *id, const struct cm_con_data_t *remote)
+{
+	struct rdma_event_channel	*ch;
+	struct rdma_conn_param		param;
+	struct cm_con_data_t		local;
+
+	/* give the connection its own channel so its events do not race the listener */
+	ch = rdma_create_event_channel();
+	if (!ch || rdma_migrate_id(id, ch)) {
+		fprintf(stderr, "failed to move rdma_cm id to its own channel\n");
+		if (ch)
+			rdma_destroy_event_channel(ch);
+		rdma_reject(id, NULL, 0);
+		rdma_destroy_id(id);
+		return 1;
+	}
+
+	res->cm_id = id;
+
+	if (id->verbs != res->ib_ctx) {
+		fprintf(stderr, "connection request arrived on %s, not %s\n",
+				ibv_get_device_name(id->verbs->device), config.dev_name);
+		goto cm_accept_reject;
+	}
+
+	if (resources_create_qp(res) || ctrl_post_recv(res))
+		goto cm_accept_reject;
+
+	cm_remote_data(res, remote);
+	cm_local_data(res, &local);
+	cm_conn_param(res, &param, &local);
+
+	if (rdma_accept(id, &param)) {
+		fprintf(stderr, "rdma_accept failed (%s)\n", strerror(errno));
+		goto cm_accept_reject;
+	}
+
+	if (cm_wait_event(ch, RDMA_CM_EVENT_ESTABLISHED, NULL)) {
+		cm_disconnect(res);
+		return 1;
+	}
+
+	return 0;
+
+cm_accept_reject:
+	rdma_reject(id, NULL, 0);
+	cm_disconnect(res);
+
+	return 1;
+}
+
+
+int cm_disconnect(struct resources *res)
+{
+	struct rdma_event_channel	*ch = res->cm_id->channel;
+	int				rc = 0;
+
+	/* fails harmlessly when the connection was never established */
+	rdma_disconnect(res->cm_id);
+
+	if (resources_destroy_qp(res))
+		rc = 1;
+
+	if (rdma_destroy_id(res->cm_id)) {
+		fprintf(stderr, "failed to destroy rdma_cm id\n");
+		rc = 1;
+	}
+	res->cm_id = NULL;
+
+	rdma_destroy_event_channel(ch);
+
+	return rc;
+}
+
+
+int cm_connect(struct resources *res)
+{
+	struct rdma_event_channel *ch;
+	struct rdma_cm_id	*listen_id = NULL;
+	struct rdma_cm_id	*id = NULL;
+	struct cm_con_data_t	remote;
+	int			rc;
+
+	if (config.server_name)
+		return cm_client_connect(res);
+
+	debug_print("[Server only] waiting on port %d for rdma_cm connection\n", config.tcp_port);
+	if (cm_listen(config.tcp_port, &listen_id))
+		return 1;
+
+	do {
+		rc = cm_get_request(listen_id, &id, &remote);
+	} while (!rc && !id);
+
+	if (!rc) {
+		/* serve on whichever device the client came in through */
+		if (!config.dev_name)
+			config.dev_name = strdup(ibv_get_device_name(id->verbs->device));
+
+		rc = resources_open_device(res);
+		if (rc) {
+			rdma_reject(id, NULL, 0);
+			rdma_destroy_id(id);
+		} else
+			rc = cm_accept(res, id, &remote);
+	}
+
+	ch = listen_id->channel;
+	rdma_destroy_id(listen_id);
+	rdma_destroy_event_channel(ch);
+
+	return rc;
+}
+
+#endif // HAVE_RDMACM
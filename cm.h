@@ -0,0 +1,141 @@
+/* vim: set noet: */
+/******************************************************************************
+ * rdma_cm connection setup
+ *
+ * An alternative to the TCP exchange in connect_qp. librdmacm resolves the
+ * address and route (and with it the GID on RoCE), moves the QP through its
+ * states, and carries cm_con_data_t as connection private data. Afterwards
+ * the control syncs run over the QP itself (see ctrl_sync), so no TCP socket
+ * is needed at all.
+ *
+ * Only built with `make RDMACM=1`.
+ *
+ * ******************************************************************************/
+
+#ifndef CM_H_
+#define CM_H_
+
+#ifdef HAVE_RDMACM
+
+#include <rdma/rdma_cma.h>
+
+#include "resources.h"
+
+/******************************************************************************
+ * *	Function: cm_open_device
+ * *
+ * *	Input
+ * *	res	pointer to resources structure
+ * *
+ * *	Output
+ * *	res	ib_ctx set to librdmacm's context for config.dev_name
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Every rdma_cm_id on a device shares librdmacm's context for it, so the
+ * *	PD and MR must be created on that context rather than one opened with
+ * *	ibv_open_device. Released with cm_close_device.
+ * ******************************************************************************/
+int cm_open_device(struct resources *res);
+
+void cm_close_device(void);
+
+
+/******************************************************************************
+ * *	Function: cm_connect
+ * *
+ * *	Input
+ * *	res	pointer to initialized resources structure
+ * *
+ * *	Output
+ * *	res	fully created and connected resources
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	rdma_cm counterpart of resources_create followed by connect_qp. The
+ * *	client resolves the server and connects, the server listens for a single
+ * *	client and accepts it.
+ * ******************************************************************************/
+int cm_connect(struct resources *res);
+
+
+/******************************************************************************
+ * *	Function: cm_listen
+ * *
+ * *	Input
+ * *	port	port to listen on
+ * *
+ * *	Output
+ * *	listen_id	listening id, its channel fd can be polled for requests
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Bind and listen for connection requests on all addresses.
+ * ******************************************************************************/
+int cm_listen(int port, struct rdma_cm_id **listen_id);
+
+
+/******************************************************************************
+ * *	Function: cm_get_request
+ * *
+ * *	Input
+ * *	listen_id	listening id with a pending event
+ * *
+ * *	Output
+ * *	id	id of the new connection, NULL if the event was not a request
+ * *	remote	connection data the client sent as private data
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * ******************************************************************************/
+int cm_get_request(struct rdma_cm_id *listen_id, struct rdma_cm_id **id, struct cm_con_data_t *remote);
+
+
+/******************************************************************************
+ * *	Function: cm_accept
+ * *
+ * *	Input
+ * *	res	resources with an open device and no QP
+ * *	id	connection from cm_get_request
+ * *	remote	connection data of the client
+ * *
+ * *	Output
+ * *	res	QP created and connected, remote_props filled in
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure. On failure the id has been rejected and
+ * *	destroyed.
+ * *
+ * *	Description
+ * *	Move the id to its own event channel, create the QP on it and accept
+ * *	with our buffer address and rkey as private data.
+ * ******************************************************************************/
+int cm_accept(struct resources *res, struct rdma_cm_id *id, const struct cm_con_data_t *remote);
+
+
+/******************************************************************************
+ * *	Function: cm_disconnect
+ * *
+ * *	Input
+ * *	res	pointer to resources structure with cm_id set
+ * *
+ * *	Output
+ * *	none
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Disconnect and destroy the QP, the id and its event channel.
+ * ******************************************************************************/
+int cm_disconnect(struct resources *res);
+
+#endif // HAVE_RDMACM
+
+#endif // CM_H_
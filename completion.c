@@ -0,0 +1,38 @@
+/* vim: set noet: */
+#include <time.h>
+
+#include "completion.h"
+
+/* how long cq_calibrate watches the clock, in nanoseconds */
+#define CALIBRATE_NS	1000000
+
+struct cq_counters cq_stats;
+uint64_t cq_cycles_per_ms;
+
+
+void cq_calibrate(void)
+{
+	struct timespec	start, now;
+	uint64_t	start_cycles, ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_cycles = get_cycles();
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ns = (now.tv_sec - start.tv_sec) * 1000000000ull + now.tv_nsec - start.tv_nsec;
+	} while (ns < CALIBRATE_NS);
+
+	cq_cycles_per_ms = (get_cycles() - start_cycles) * 1000000 / ns;
+	if (!cq_cycles_per_ms)
+		cq_cycles_per_ms = 1;
+}
+
+
+void cq_stats_print(FILE *f)
+{
+	if (!cq_stats.bad_status && !cq_stats.timeouts && !cq_stats.strays)
+		return;
+
+	fprintf(f, "completions: %lu, bad status %lu, timeouts %lu, unexpected wr_id %lu\n",
+			cq_stats.completions, cq_stats.bad_status, cq_stats.timeouts, cq_stats.strays);
+}
@@ -0,0 +1,139 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Completion engine
+ *
+ * The one place the verbs client and server wait on their CQ outside of
+ * the control messages. It polls up to MAX_BATCH completions at a time,
+ * hands each one to the outstanding work request named by its wr_id and
+ * gives up at a deadline given in TSC cycles. Reading the TSC is cheap
+ * enough, but the deadline is only checked every CQ_SPINS_PER_CHECK empty
+ * polls, so a timed probe pays almost nothing for it.
+ *
+ * Completions, bad statuses and timeouts are counted in cq_stats for the
+ * run's summary.
+ *
+ * ******************************************************************************/
+
+#ifndef COMPLETION_H_
+#define COMPLETION_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <infiniband/verbs.h>
+
+#include "get_clock.h"
+#include "resources.h"
+
+/* how long to wait for a completion before giving up, in milliseconds */
+#define CQ_TIMEOUT_MS		2000
+
+/* empty polls between two looks at the deadline */
+#define CQ_SPINS_PER_CHECK	256
+
+/* cq_wait timestamps nothing */
+#define TSC_NONE		-1
+
+struct cq_counters {
+	uint64_t	completions;
+	uint64_t	bad_status;	/* completions with a status other than IBV_WC_SUCCESS */
+	uint64_t	timeouts;
+	uint64_t	strays;		/* completions whose wr_id no one was waiting for */
+};
+
+extern struct cq_counters cq_stats;
+extern uint64_t cq_cycles_per_ms;
+
+/* measure cq_cycles_per_ms against the monotonic clock */
+void cq_calibrate(void);
+
+/* the TSC timeout_ms milliseconds from now */
+static inline uint64_t cq_deadline(uint64_t timeout_ms)
+{
+	if (!cq_cycles_per_ms)
+		cq_calibrate();
+	return get_cycles() + timeout_ms * cq_cycles_per_ms;
+}
+
+/******************************************************************************
+ * *	Function: cq_wait
+ * *
+ * *	Input
+ * *	cq		completion queue to poll
+ * *	n		completions to wait for, at most MAX_BATCH when stamps is set
+ * *	deadline	TSC to give up at, from cq_deadline
+ * *	tsc		TSC_FENCED or TSC_RDTSCP to stamp each completion with
+ * *			stop_tsc or rdtscp_tsc, TSC_NONE for no stamps
+ * *
+ * *	Output
+ * *	stamps		the TSC at the poll that returned the completion of
+ * *			wr_id i goes to stamps[i], NULL to take any n
+ * *			completions
+ * *
+ * *	Returns
+ * *	0 once all n completed successfully, 1 on a bad status, a failed
+ * *	poll or the deadline
+ * *
+ * *	Description
+ * *	tsc should be a constant, so each caller gets a loop with only its
+ * *	own timestamps in it. A bad status does not stop the wait, the rest
+ * *	of the work requests still complete, flushed if need be.
+ * ******************************************************************************/
+static __inline __attribute__((always_inline)) int cq_wait(struct ibv_cq *cq, int n, uint64_t deadline, const int tsc, uint64_t *stamps)
+{
+	struct ibv_wc	wc[MAX_BATCH];
+	uint64_t	now = 0;
+	unsigned int	spins = 0;
+	int		done = 0, polled, i, rc = 0;
+
+	while (done < n) {
+		polled = ibv_poll_cq(cq, n - done < MAX_BATCH ? n - done : MAX_BATCH, wc);
+		if (!polled) {
+			if (++spins % CQ_SPINS_PER_CHECK == 0 && get_cycles() > deadline) {
+				cq_stats.timeouts++;
+				fprintf(stderr, "completion wasn't found in the CQ after timeout, %d of %d outstanding\n", n - done, n);
+				return 1;
+			}
+			continue;
+		}
+
+		if (tsc == TSC_FENCED)
+			now = stop_tsc();
+		else if (tsc == TSC_RDTSCP)
+			now = rdtscp_tsc();
+
+		if (polled < 0) {
+			/* poll CQ failed */
+			fprintf(stderr, "poll CQ failed retval = %d, errno: %s\n", polled, strerror(errno));
+			return 1;
+		}
+
+		for (i = 0; i < polled; i++) {
+			cq_stats.completions++;
+
+			/* check the completion status (here we don't care about the completion opcode */
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				cq_stats.bad_status++;
+				fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", wc[i].status, wc[i].vendor_err);
+				rc = 1;
+			}
+
+			if (!stamps)
+				done++;
+			else if (wc[i].wr_id < (uint64_t) n) {
+				stamps[wc[i].wr_id] = now;
+				done++;
+			} else
+				cq_stats.strays++;
+		}
+	}
+
+	return rc;
+}
+
+/* print cq_stats to f if anything went wrong */
+void cq_stats_print(FILE *f);
+
+#endif // COMPLETION_H_
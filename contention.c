@@ -0,0 +1,323 @@
+/* vim: set noet: */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "print.h"
+#include "contention.h"
+#include "completion.h"
+#include "topology.h"
+
+/* lines touched between two looks at the clock */
+#define CONTENTION_BURST	256
+
+struct contention_params server_contention;
+
+static const char *const pattern_names[] = {
+	[CONTENTION_SEQ] = "seq", [CONTENTION_RAND] = "rand", [CONTENTION_WRITE] = "write", NULL
+};
+
+/* one thread and its working set */
+struct contender {
+	struct contention	*c;
+	char			*buf;
+	uint64_t		lines;
+	uint32_t		line;		/* bytes from one line to the next */
+	uint64_t		touched;
+	int			cpu;
+	pthread_t		thread;
+	int			started;
+};
+
+struct contention {
+	struct contention_params	params;
+	atomic_int			stop;
+	uint64_t			start;		/* TSC when the threads were started */
+	struct contender		*threads;
+};
+
+
+/* link the lines into one random cycle (Sattolo), each line holding the next one's index */
+static void contention_chain(struct contender *t, uint64_t seed)
+{
+	uint64_t	i, j, x = seed | 1, tmp;
+	uint64_t	*slot;
+
+	for (i = 0; i < t->lines; i++)
+		*(uint64_t *) (t->buf + i * t->line) = i;
+
+	for (i = t->lines - 1; i > 0; i--) {
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		j = (x * 0x2545f4914f6cdd1dull) % i;
+
+		slot = (uint64_t *) (t->buf + i * t->line);
+		tmp = *slot;
+		*slot = *(uint64_t *) (t->buf + j * t->line);
+		*(uint64_t *) (t->buf + j * t->line) = tmp;
+	}
+}
+
+
+/* touch CONTENTION_BURST lines from line i on, the line to go on from */
+static inline uint64_t contention_burst(struct contender *t, uint32_t pattern, uint64_t i)
+{
+	int n;
+
+	for (n = 0; n < CONTENTION_BURST; n++) {
+		switch (pattern) {
+			case CONTENTION_RAND:
+				i = *(volatile uint64_t *) (t->buf + i * t->line);
+				continue;
+			case CONTENTION_WRITE:
+				*(volatile uint64_t *) (t->buf + i * t->line) = i;
+				break;
+			default:
+				(void) *(volatile uint64_t *) (t->buf + i * t->line);
+		}
+		if (++i == t->lines)
+			i = 0;
+	}
+
+	return i;
+}
+
+
+static void *contention_thread(void *arg)
+{
+	struct contender		*t = arg;
+	const struct contention_params	*p = &t->c->params;
+	uint64_t			period = p->period_us * cq_cycles_per_ms / 1000;
+	uint64_t			busy = period * p->duty / 100;
+	uint64_t			start, now, i = 0;
+	struct timespec			idle;
+
+	while (!atomic_load_explicit(&t->c->stop, memory_order_relaxed)) {
+		start = get_cycles();
+		do {
+			i = contention_burst(t, p->pattern, i);
+			t->touched += CONTENTION_BURST;
+			now = get_cycles();
+		} while (now - start < busy);
+
+		if (p->duty >= 100 || now - start >= period)
+			continue;
+
+		idle.tv_sec = 0;
+		idle.tv_nsec = (period - (now - start)) * 1000000 / cq_cycles_per_ms;
+		nanosleep(&idle, NULL);
+	}
+
+	return NULL;
+}
+
+
+static int contention_parse(const char *params, uint32_t line, struct contention_params *p, cpu_set_t *cpus)
+{
+	enum { THREADS, WS, PATTERN, DUTY, PERIOD, CPUS };
+	char *const	tokens[] = {
+		[THREADS] = "threads", [WS] = "ws", [PATTERN] = "pattern",
+		[DUTY] = "duty", [PERIOD] = "period", [CPUS] = "cpus", NULL
+	};
+	char		*opts, *s, *value, *sep;
+	int		i, last = -1, rc = 1;
+
+	opts = s = strdup(params);
+	if (!opts)
+		return 1;
+
+	while (*s) {
+		int opt = getsubopt(&s, tokens, &value);
+
+		if (opt < 0 || !value) {
+			fprintf(stderr, "bad contention parameter '%s'%s\n", value ? value : "",
+					last == CPUS ? ", separate the cpus with + or :" : "");
+			goto contention_parse_exit;
+		}
+		last = opt;
+
+		switch (opt) {
+			case THREADS: p->threads = strtoul(value, NULL, 0); break;
+			case WS: p->ws = parse_size(value); break;
+			case DUTY: p->duty = strtoul(value, NULL, 0); break;
+			case PERIOD: p->period_us = strtoul(value, NULL, 0); break;
+			case CPUS:
+				/* getsubopt has split on the commas already, the list uses + or : */
+				for (sep = value; (sep = strpbrk(sep, "+:")); )
+					*sep = ',';
+				if (!cpulist_parse(value, cpus)) {
+					fprintf(stderr, "bad contention cpulist '%s'\n", value);
+					goto contention_parse_exit;
+				}
+				break;
+			case PATTERN:
+				for (i = 0; pattern_names[i] && strcmp(value, pattern_names[i]); i++)
+					;
+				if (!pattern_names[i]) {
+					fprintf(stderr, "bad contention pattern '%s', seq, rand or write\n", value);
+					goto contention_parse_exit;
+				}
+				p->pattern = i;
+				break;
+		}
+	}
+
+	if (!p->threads || p->ws < line * 2 || !p->duty || p->duty > 100 || !p->period_us || p->period_us >= 1000000) {
+		fprintf(stderr, "bad contention parameters: threads=%u ws=%lu duty=%u period=%u\n",
+				p->threads, p->ws, p->duty, p->period_us);
+		goto contention_parse_exit;
+	}
+	rc = 0;
+
+contention_parse_exit:
+	free(opts);
+	return rc;
+}
+
+
+struct contention *contention_start(const char *params)
+{
+	struct contention	*c;
+	struct cache_topology	t = server_cache;
+	cpu_set_t		cpus, allowed;
+	pthread_attr_t		attr;
+	char			desc[128];
+	uint32_t		i;
+	int			cpu = -1, here = sched_getcpu();
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	if (!t.llc_size)
+		topology_read(&t);
+	c->params.threads = 1;
+	c->params.pattern = CONTENTION_SEQ;
+	c->params.ws = t.llc_size ? t.llc_size : 20 << 20;
+	c->params.duty = 100;
+	c->params.period_us = 1000;
+
+	CPU_ZERO(&cpus);
+	if (contention_parse(params, topology_line(&t), &c->params, &cpus))
+		goto contention_start_fail;
+
+	/* by default anywhere but here, or here if there is nowhere else */
+	if (!CPU_COUNT(&cpus)) {
+		if (sched_getaffinity(0, sizeof(allowed), &allowed))
+			CPU_ZERO(&allowed);
+		cpus = allowed;
+		if (here >= 0 && CPU_COUNT(&cpus) > 1)
+			CPU_CLR(here, &cpus);
+		if (!CPU_COUNT(&cpus)) {
+			fprintf(stderr, "contention: no CPU to run on\n");
+			goto contention_start_fail;
+		}
+		if (here >= 0 && CPU_ISSET(here, &cpus))
+			fprintf(stderr, "contention: no other CPU, the threads share cpu %d\n", here);
+	}
+
+	c->threads = calloc(c->params.threads, sizeof(*c->threads));
+	if (!c->threads)
+		goto contention_start_fail;
+
+	/* the threads time their duty cycle with the TSC */
+	if (!cq_cycles_per_ms)
+		cq_calibrate();
+
+	for (i = 0; i < c->params.threads; i++) {
+		struct contender *th = &c->threads[i];
+
+		th->c = c;
+		th->line = topology_line(&t);
+		th->lines = c->params.ws / th->line;
+		th->buf = aligned_alloc(4096, (c->params.ws + 4095) & ~(uint64_t) 4095);
+		if (!th->buf) {
+			fprintf(stderr, "failed to allocate a %lu byte contention working set\n", c->params.ws);
+			goto contention_start_fail;
+		}
+		memset(th->buf, 0, c->params.ws);
+		if (c->params.pattern == CONTENTION_RAND)
+			contention_chain(th, i + 1);
+
+		/* the next CPU of the set, round and round */
+		do
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		while (!CPU_ISSET(cpu, &cpus));
+		th->cpu = cpu;
+	}
+
+	c->start = get_cycles();
+	for (i = 0; i < c->params.threads; i++) {
+		struct contender	*th = &c->threads[i];
+		cpu_set_t		one;
+
+		CPU_ZERO(&one);
+		CPU_SET(th->cpu, &one);
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr, sizeof(one), &one);
+		th->started = !pthread_create(&th->thread, &attr, contention_thread, th);
+		pthread_attr_destroy(&attr);
+		if (!th->started) {
+			fprintf(stderr, "failed to start contention thread %u on cpu %d\n", i, th->cpu);
+			goto contention_start_fail;
+		}
+	}
+
+	server_contention = c->params;
+	contention_describe(&c->params, desc, sizeof(desc));
+	fprintf(stderr, "contention: %s\n", desc);
+
+	return c;
+
+contention_start_fail:
+	contention_stop(c);
+	return NULL;
+}
+
+
+void contention_stop(struct contention *c)
+{
+	uint64_t	touched = 0, elapsed;
+	uint32_t	i;
+	int		ran = 0;
+
+	if (!c)
+		return;
+
+	atomic_store(&c->stop, 1);
+	for (i = 0; c->threads && i < c->params.threads; i++) {
+		if (c->threads[i].started) {
+			pthread_join(c->threads[i].thread, NULL);
+			touched += c->threads[i].touched;
+			ran = 1;
+		}
+		free(c->threads[i].buf);
+	}
+
+	elapsed = get_cycles() - c->start;
+	if (ran && elapsed)
+		fprintf(stderr, "contention: %lu lines touched, %.1f M lines/s\n",
+				touched, touched * (cq_cycles_per_ms / 1000.0) / elapsed);
+
+	free(c->threads);
+	free(c);
+}
+
+
+void contention_describe(const struct contention_params *p, char *buf, size_t len)
+{
+	if (!p->threads) {
+		snprintf(buf, len, "none");
+		return;
+	}
+
+	snprintf(buf, len, "threads=%u ws=%lu pattern=%s duty=%u period=%u",
+			p->threads, p->ws, p->pattern <= CONTENTION_WRITE ? pattern_names[p->pattern] : "?",
+			p->duty, p->period_us);
+}
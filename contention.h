@@ -0,0 +1,77 @@
+/* vim: set noet: */
+/******************************************************************************
+ * LLC contention workload
+ *
+ * Left alone, the server does nothing while the client probes, which is not
+ * how a production server looks. With -x the server runs pinned threads
+ * that keep touching working sets of their own, so hit/miss discrimination
+ * can be measured under a known amount of LLC pressure. The local backend
+ * takes -x too, this machine being its server.
+ *
+ * Parameters are given as a getsubopt() string, e.g.
+ * "threads=4,ws=32M,pattern=rand,duty=50,period=1000,cpus=2-5":
+ *
+ *	threads	threads to run (default 1)
+ *	ws	working set of each thread in bytes, K/M/G suffixes allowed
+ *		(default the LLC)
+ *	pattern	seq reads every line in order, rand chases a random cycle
+ *		through the lines so every load waits on the one before and the
+ *		prefetchers cannot help, write stores to every line in order
+ *		(default seq)
+ *	duty	percent of each period the threads touch lines, they sleep for
+ *		the rest (default 100)
+ *	period	length of a busy and idle cycle in microseconds (default 1000)
+ *	cpus	cpulist to pin the threads to, one CPU each in turn, with +
+ *		or : where a cpulist has commas, as in cpus=0-3+8 (default
+ *		the CPUs this process may run on, except the one it is on)
+ *
+ * What the server runs goes to the client in the handshake (HS_LOAD), so
+ * the level of contention is part of every run's metadata.
+ *
+ * ******************************************************************************/
+
+#ifndef CONTENTION_H_
+#define CONTENTION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CONTENTION_SEQ		0
+#define CONTENTION_RAND		1
+#define CONTENTION_WRITE	2
+
+struct contention_params {
+	uint32_t	threads;	/* 0 when there is no contention */
+	uint32_t	pattern;	/* CONTENTION_* */
+	uint64_t	ws;		/* bytes per thread */
+	uint32_t	duty;		/* percent */
+	uint32_t	period_us;
+};
+
+/* what runs on the server, started by contention_start or received from
+ * the server, all 0 until then */
+extern struct contention_params server_contention;
+
+struct contention;
+
+/******************************************************************************
+ * *	Function: contention_start
+ * *
+ * *	Input
+ * *	params	parameter string as above
+ * *
+ * *	Output
+ * *	server_contention	what was started
+ * *
+ * *	Returns
+ * *	the running threads, NULL on a bad parameter or failure to start
+ * ******************************************************************************/
+struct contention *contention_start(const char *params);
+
+/* stop the threads, say how many lines they touched and release them */
+void contention_stop(struct contention *c);
+
+/* describe p in a line for the run's metadata, "none" without threads */
+void contention_describe(const struct contention_params *p, char *buf, size_t len);
+
+#endif // CONTENTION_H_
@@ -8,8 +8,8 @@ library(reshape2)
 Options:
    --lxlim=<ns>      Left limit of x-axis on histogram [default: 0]
    --rxlim=<ns>      Right limit of x-axis on histogram [default: 10000]
-   --lthres=<ns>     Data to filter out if less than [default: 0]
-   --rthres=<ns>     Data to filter out if greater than [default: 100000]
+   --lthres=<ns>     Data to filter out if less than (default: half the calibrated hits' p1, else 0)
+   --rthres=<ns>     Data to filter out if greater than (default: twice the calibrated misses' p99, else 100000)
    --positivediff    Filter negative diffs
    --difflthres=<q>  Data to filter out if diff is less than quantile(q) (0 <= q <= 1) [default: 0]
    --diffrthres=<q>  Data to filter out if diff is greater than quantile(q) (0 <= q <= 1) [default: 1]
@@ -21,8 +21,6 @@ Options:
 opts <- docopt(doc)
 opts$lxlim <- as.numeric(opts$lxlim)
 opts$rxlim <- as.numeric(opts$rxlim)
-opts$lthres <- as.numeric(opts$lthres)
-opts$rthres <- as.numeric(opts$rthres)
 opts$diffrthres <- as.numeric(opts$diffrthres)
 opts$difflthres <- as.numeric(opts$difflthres)
 opts$samplebar <- as.numeric(opts$samplebar)
@@ -33,7 +31,28 @@ second.read.col <- 4
 
 datatype <- "nanoseconds"
 
-data <- read.csv(opts$filename)
+# the run header (see calibration.h), comment lines of key=value pairs
+header.value <- function(line, key) {
+    m <- regmatches(line, regexec(paste0("[ ]", key, "=([^ ]+)"), line))[[1]]
+    if (length(m) == 2) as.numeric(m[2]) else NA
+}
+header <- grep("^#", readLines(opts$filename, n=16), value=TRUE)
+calibration <- grep("^# calibration ", header, value=TRUE)
+hits <- grep("^# hit_ns ", header, value=TRUE)
+misses <- grep("^# miss_ns ", header, value=TRUE)
+cutoff <- if (length(calibration)) header.value(calibration, "cutoff_ns") else NA
+
+# without thresholds, keep what is within reach of the calibrated distributions
+if (is.null(opts$lthres)) {
+    opts$lthres <- if (length(hits)) header.value(hits, "p1") / 2 else 0
+}
+if (is.null(opts$rthres)) {
+    opts$rthres <- if (length(misses)) header.value(misses, "p99") * 2 else 100000
+}
+opts$lthres <- as.numeric(opts$lthres)
+opts$rthres <- as.numeric(opts$rthres)
+
+data <- read.csv(opts$filename, comment.char="#")
 
 df.orig <- data.frame(first_read=data[,first.read.col], second_read=data[,second.read.col])
 df.orig$id <- seq_len(nrow(df.orig))
@@ -53,12 +72,22 @@ df <- subset(df, diff <= rq)
 
 print(paste("Filtered", nrow(df.orig) - nrow(df), "rows."), sep=" ")
 
+# reads at or above the calibrated cutoff are misses
+if (!is.na(cutoff)) {
+    print(paste("Calibrated cutoff ", cutoff, " ns: ", round(100 * mean(df$first_read >= cutoff), 2), "% of first reads missed, ",
+                round(100 * mean(df$second_read < cutoff), 2), "% of second reads hit.", sep=""))
+}
+
 histogram = ggplot(melt(df[,c("first_read", "second_read")]), aes(x = value, fill = variable)) +
     geom_density(alpha=0.5) +
     xlim(opts$lxlim, opts$rxlim) +
     labs(title=opts$filename, x=datatype, fill="read type", caption=paste(names(opts[1:7]), opts[1:7], sep = "=", collapse=" ")) +
     theme(plot.caption=element_text(size=4))
 
+if (!is.na(cutoff)) {
+    histogram <- histogram + geom_vline(xintercept=cutoff, linetype="dotted")
+}
+
 if (opts$displaymean) {
     histogram + geom_vline(xintercept=mean(df$first_read), linetype="dashed", color="firebrick1") +
         geom_vline(xintercept=mean(df$second_read), linetype="dashed", color="cyan4")
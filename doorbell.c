@@ -0,0 +1,187 @@
+/* vim: set noet: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include <infiniband/verbs.h>
+
+#include "doorbell.h"
+#include "completion.h"
+
+#define DOORBELL_PAGE	4096
+
+/* the client's end, in the resources of the helper it rings */
+struct doorbell_link {
+	uint64_t		addr;		/* of the server's doorbell */
+	uint32_t		rkey;
+	uint64_t		seq;
+	struct ibv_mr		*mr;
+	struct doorbell_page	*slot;		/* what is written to and read back from the doorbell */
+};
+
+
+int doorbell_open(struct doorbell *b, struct resources *res, struct doorbell_wire *wire)
+{
+	memset(b, 0, sizeof(*b));
+
+	b->page = aligned_alloc(DOORBELL_PAGE, DOORBELL_PAGE);
+	if (!b->page) {
+		fprintf(stderr, "failed to allocate a doorbell\n");
+		return 1;
+	}
+	memset((void *) b->page, 0, DOORBELL_PAGE);
+
+	b->mr = ibv_reg_mr(res->pd, (void *) b->page, DOORBELL_PAGE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+	if (!b->mr) {
+		fprintf(stderr, "ibv_reg_mr failed for a doorbell (%s)\n", strerror(errno));
+		doorbell_close(b);
+		return 1;
+	}
+
+	wire->addr = htonll((uintptr_t) b->page);
+	wire->rkey = htonl(b->mr->rkey);
+	return 0;
+}
+
+
+int doorbell_poll(struct doorbell *b, uint64_t *arg)
+{
+	uint64_t request = ntohll(b->page->request);
+
+	if (request == b->last)
+		return 0;
+
+	/* the client wrote the argument in the same WRITE, before the number */
+	*arg = ntohll(b->page->arg);
+	b->last = request;
+	return 1;
+}
+
+
+void doorbell_answer(struct doorbell *b, uint64_t answer)
+{
+	b->page->answer = htonll(answer);
+	atomic_thread_fence(memory_order_release);
+	b->page->done = htonll(b->last);
+}
+
+
+int doorbell_close(struct doorbell *b)
+{
+	int rc = 0;
+
+	if (b->mr && ibv_dereg_mr(b->mr)) {
+		fprintf(stderr, "failed to deregister a doorbell\n");
+		rc = 1;
+	}
+	free((void *) b->page);
+	memset(b, 0, sizeof(*b));
+
+	return rc;
+}
+
+
+int doorbell_attach(struct resources *res, const struct doorbell_wire *wire, struct doorbell_link **link)
+{
+	struct doorbell_link *l;
+
+	*link = NULL;
+
+	/* sim and local echo the sync back, they have no server to ring */
+	if (!wire->addr)
+		return 0;
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return 1;
+	*link = l;
+
+	l->addr = ntohll(wire->addr);
+	l->rkey = ntohl(wire->rkey);
+	l->slot = aligned_alloc(64, sizeof(*l->slot));
+	if (!l->slot) {
+		fprintf(stderr, "failed to allocate a doorbell slot\n");
+		return 1;
+	}
+	memset(l->slot, 0, sizeof(*l->slot));
+
+	l->mr = ibv_reg_mr(res->pd, l->slot, sizeof(*l->slot), IBV_ACCESS_LOCAL_WRITE);
+	if (!l->mr) {
+		fprintf(stderr, "ibv_reg_mr failed for a doorbell slot (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* one signaled WRITE or READ between the slot and the doorbell, waited for */
+static int doorbell_op(struct resources *res, struct doorbell_link *l, int opcode, size_t at, size_t len, uint64_t deadline)
+{
+	struct ibv_send_wr	sr, *bad_wr = NULL;
+	struct ibv_sge		sge;
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t) l->slot + at;
+	sge.length = len;
+	sge.lkey = l->mr->lkey;
+
+	memset(&sr, 0, sizeof(sr));
+	sr.wr_id = 0;
+	sr.sg_list = &sge;
+	sr.num_sge = 1;
+	sr.opcode = opcode;
+	sr.send_flags = IBV_SEND_SIGNALED;
+	sr.wr.rdma.remote_addr = l->addr + at;
+	sr.wr.rdma.rkey = l->rkey;
+
+	if (ibv_post_send(res->qp, &sr, &bad_wr)) {
+		fprintf(stderr, "failed to post the doorbell %s\n", opcode == IBV_WR_RDMA_WRITE ? "WRITE" : "READ");
+		return 1;
+	}
+
+	return cq_wait(res->cq, 1, deadline, TSC_NONE, NULL);
+}
+
+
+int doorbell_ring(struct resources *res, struct doorbell_link *l, uint64_t arg, uint64_t *answer)
+{
+	uint64_t deadline = cq_deadline(CQ_TIMEOUT_MS);
+
+	l->seq++;
+	l->slot->arg = htonll(arg);
+	l->slot->request = htonll(l->seq);
+	if (doorbell_op(res, l, IBV_WR_RDMA_WRITE, 0, 2 * sizeof(uint64_t), deadline))
+		return 1;
+
+	/* every READ completes, so the deadline is the loop's to check */
+	do {
+		if (doorbell_op(res, l, IBV_WR_RDMA_READ, offsetof(struct doorbell_page, done), 2 * sizeof(uint64_t), deadline))
+			return 1;
+		if (get_cycles() > deadline) {
+			cq_stats.timeouts++;
+			fprintf(stderr, "the server's helper did not answer request %lu before the timeout\n", l->seq);
+			return 1;
+		}
+	} while (ntohll(l->slot->done) != l->seq);
+
+	if (answer)
+		*answer = ntohll(l->slot->answer);
+	return 0;
+}
+
+
+void doorbell_detach(struct doorbell_link *l)
+{
+	if (!l)
+		return;
+
+	if (l->mr)
+		ibv_dereg_mr(l->mr);
+	free(l->slot);
+	free(l);
+}
@@ -0,0 +1,108 @@
+/* vim: set noet: */
+/******************************************************************************
+ * RDMA doorbells
+ *
+ * How the client asks a helper thread on the server for something once per
+ * probe, without the TCP round trips of a sync. The server registers one
+ * page for remote access, the doorbell, and sends the client its address
+ * and rkey. The client RDMA writes an argument and a new sequence number to
+ * the doorbell's first line. The helper spins on that number, does its work,
+ * writes its answer and then the number to the second line, and the client
+ * reads that line back until the number is there.
+ *
+ * The eviction helper (evict.h) and the residency oracle (oracle.h) each
+ * have one. Ringing waits for the answer, so a bell has at most one request
+ * in flight and the client's QP nothing else while it rings.
+ *
+ * ******************************************************************************/
+
+#ifndef DOORBELL_H_
+#define DOORBELL_H_
+
+#include <stdint.h>
+
+#include "resources.h"
+
+/* the registered page, the client writes the first line and reads the second */
+struct doorbell_page {
+	uint64_t	arg;		/* what the helper is asked about */
+	uint64_t	request;	/* sequence number, written last */
+	char		pad[48];
+	uint64_t	done;		/* last sequence number served */
+	uint64_t	answer;		/* the helper's answer to it, written first */
+} __attribute__((packed, aligned(64)));
+
+/* where the doorbell is, as the server tells the client */
+struct doorbell_wire {
+	uint64_t	addr;
+	uint32_t	rkey;
+} __attribute__((packed));
+
+/* the server's end, owned by the helper thread */
+struct doorbell {
+	volatile struct doorbell_page	*page;
+	struct ibv_mr			*mr;
+	uint64_t			last;	/* sequence number of the last request seen */
+};
+
+struct doorbell_link;
+
+/******************************************************************************
+ * *	Function: doorbell_open
+ * *
+ * *	Input
+ * *	res	server resources of the session, connected
+ * *
+ * *	Output
+ * *	b	the server's end, zeroed on failure
+ * *	wire	its address and rkey in network byte order, for the client
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * ******************************************************************************/
+int doorbell_open(struct doorbell *b, struct resources *res, struct doorbell_wire *wire);
+
+/* 1 and the request's argument if the client rang since the last answer, 0 if not */
+int doorbell_poll(struct doorbell *b, uint64_t *arg);
+
+/* answer the last request polled */
+void doorbell_answer(struct doorbell *b, uint64_t answer);
+
+/* release the server's end, 0 on success */
+int doorbell_close(struct doorbell *b);
+
+/******************************************************************************
+ * *	Function: doorbell_attach
+ * *
+ * *	Input
+ * *	res	client resources, connected
+ * *	wire	what the server sent, all 0 from a backend without a server
+ * *
+ * *	Output
+ * *	link	the client's end, left NULL when wire is all 0
+ * *
+ * *	Returns
+ * *	0 on success, 1 if the client's end could not be set up
+ * ******************************************************************************/
+int doorbell_attach(struct resources *res, const struct doorbell_wire *wire, struct doorbell_link **link);
+
+/******************************************************************************
+ * *	Function: doorbell_ring
+ * *
+ * *	Input
+ * *	res	client resources the link was attached on
+ * *	l	the client's end
+ * *	arg	what to ask the helper about
+ * *
+ * *	Output
+ * *	answer	the helper's answer, may be NULL
+ * *
+ * *	Returns
+ * *	0 on success, 1 on a failed RDMA operation or no answer within
+ * *	CQ_TIMEOUT_MS, counted in cq_stats
+ * ******************************************************************************/
+int doorbell_ring(struct resources *res, struct doorbell_link *l, uint64_t arg, uint64_t *answer);
+
+void doorbell_detach(struct doorbell_link *l);
+
+#endif // DOORBELL_H_
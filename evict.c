@@ -0,0 +1,135 @@
+/* vim: set noet: */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <emmintrin.h>
+
+#include "evict.h"
+#include "topology.h"
+
+/* the LLC assumed when the topology is unknown, as topology_size_buffer does */
+#define EVICT_DEFAULT_LLC	(20 << 20)
+
+struct evictor {
+	struct resources	*res;
+	struct doorbell		bell;
+	char			*buf;
+	size_t			size;
+	pthread_t		thread;
+	atomic_int		stop;
+	int			started;
+	uint64_t		served;
+};
+
+
+void evict_walk(const char *buf, size_t size, uintptr_t target)
+{
+	size_t	off;
+	int	pass;
+
+	for (pass = 0; pass < EVICT_PASSES; pass++)
+		for (off = target & (EVICT_STRIDE - 1) & ~(uintptr_t) 63; off < size; off += EVICT_STRIDE)
+			(void) *(volatile const char *) (buf + off);
+}
+
+
+char *evict_buffer(uint64_t llc_size, size_t *size)
+{
+	char *buf;
+
+	*size = (EVICT_FACTOR * (llc_size ? llc_size : EVICT_DEFAULT_LLC) + EVICT_STRIDE - 1) & ~(size_t) (EVICT_STRIDE - 1);
+	buf = aligned_alloc(EVICT_STRIDE, *size);
+	if (!buf) {
+		fprintf(stderr, "failed to allocate a %zu byte eviction buffer\n", *size);
+		return NULL;
+	}
+
+	/* not zero, so every page is a page of its own rather than the zero page */
+	memset(buf, 1, *size);
+	return buf;
+}
+
+
+static void *evictor_thread(void *arg)
+{
+	struct evictor	*e = arg;
+	uint64_t	offset;
+
+	while (!atomic_load_explicit(&e->stop, memory_order_relaxed)) {
+		if (!doorbell_poll(&e->bell, &offset)) {
+			_mm_pause();
+			continue;
+		}
+
+		if (offset < e->res->size)
+			evict_walk(e->buf, e->size, (uintptr_t) (e->res->buf + offset));
+		e->served++;
+		doorbell_answer(&e->bell, 0);
+	}
+
+	return NULL;
+}
+
+
+struct evictor *evictor_start(struct resources *res, struct doorbell_wire *wire)
+{
+	struct evictor *e;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+	e->res = res;
+
+	e->buf = evict_buffer(server_cache.llc_size, &e->size);
+	if (!e->buf || doorbell_open(&e->bell, res, wire))
+		goto evictor_start_fail;
+
+	if (pthread_create(&e->thread, NULL, evictor_thread, e)) {
+		fprintf(stderr, "failed to start the eviction helper\n");
+		goto evictor_start_fail;
+	}
+	e->started = 1;
+
+	debug_print("[Server] eviction helper walking %zu bytes, doorbell at %p\n", e->size, (void *) e->bell.page);
+
+	return e;
+
+evictor_start_fail:
+	evictor_stop(e);
+	return NULL;
+}
+
+
+int evictor_stop(struct evictor *e)
+{
+	int rc = 0;
+
+	if (!e)
+		return 0;
+
+	if (e->started) {
+		atomic_store(&e->stop, 1);
+		pthread_join(e->thread, NULL);
+		debug_print("[Server] eviction helper served %lu requests\n", e->served);
+	}
+	if (doorbell_close(&e->bell))
+		rc = 1;
+
+	free(e->buf);
+	free(e);
+	return rc;
+}
+
+
+int evict_remote(struct resources *res, uint64_t addr)
+{
+	if (!res->evict) {
+		fprintf(stderr, "the server did not start an eviction helper\n");
+		return 1;
+	}
+
+	return doorbell_ring(res, res->evict, addr - res->remote_mrs.base, NULL);
+}
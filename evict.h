@@ -0,0 +1,81 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Eviction helper
+ *
+ * A third way to reset a line between probes, next to the server's clflush
+ * (mode 2) and a client-side sweep of the whole buffer. In mode 5 the server
+ * starts a helper thread with a buffer of its own, EVICT_FACTOR times its
+ * LLC, and a doorbell (doorbell.h). To evict a line the client rings the
+ * doorbell with the line's offset, and the helper reads every line of its
+ * buffer that shares the target's offset within a page before it answers.
+ * A reset costs a local walk of 1/EVICT_STRIDE of the eviction buffer and a
+ * few round trips, rather than millions of them.
+ *
+ * Physical address bits above the page offset are unknown to the helper, so
+ * it cannot build an exact eviction set. Instead it relies on the page
+ * allocator spreading its pages over the sets, so every set that can hold
+ * the target sees about EVICT_FACTOR times its ways of the walked lines.
+ *
+ * The sim and local backends evict without a server: the model drops the
+ * line, the local backend walks a buffer of its own the same way.
+ *
+ * ******************************************************************************/
+
+#ifndef EVICT_H_
+#define EVICT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "resources.h"
+#include "doorbell.h"
+
+/* lines this far apart share the target's offset within a page */
+#define EVICT_STRIDE	4096
+
+/* times the helper walks its lines per request */
+#define EVICT_PASSES	2
+
+struct evictor;
+
+/******************************************************************************
+ * *	Function: evict_walk
+ * *
+ * *	Input
+ * *	buf	eviction buffer, page aligned and faulted in
+ * *	size	bytes in buf
+ * *	target	address of the line to evict
+ * *
+ * *	Returns
+ * *	none
+ * *
+ * *	Description
+ * *	Read every line of buf at the target's offset within a page,
+ * *	EVICT_PASSES times.
+ * ******************************************************************************/
+void evict_walk(const char *buf, size_t size, uintptr_t target);
+
+/* allocate and fault in an eviction buffer for an LLC of llc_size bytes, NULL on failure */
+char *evict_buffer(uint64_t llc_size, size_t *size);
+
+/******************************************************************************
+ * *	Function: evictor_start
+ * *
+ * *	Input
+ * *	res	server resources of the session, connected
+ * *
+ * *	Output
+ * *	wire	doorbell address and rkey in network byte order, for the client
+ * *
+ * *	Returns
+ * *	the running helper, NULL on failure
+ * ******************************************************************************/
+struct evictor *evictor_start(struct resources *res, struct doorbell_wire *wire);
+
+/* stop the helper and release it, 0 on success */
+int evictor_stop(struct evictor *e);
+
+/* ring the server's doorbell for the line at remote address addr and wait until it is evicted */
+int evict_remote(struct resources *res, uint64_t addr);
+
+#endif // EVICT_H_
@@ -95,6 +95,23 @@ uint64_t stop_tsc()
 	return t;
 }
 
+/* rdtscp alone, for either end: it waits for earlier instructions but not
+ * for later ones, so it costs less than start_tsc/stop_tsc and serializes less */
+	static __inline __attribute__((always_inline))
+uint64_t rdtscp_tsc()
+{
+	uint64_t t;
+	__asm__ __volatile__(
+			"rdtscp\n\t"
+			"shl $32, %%rdx\n\t"
+			"or %%rdx, %0"
+			: "=a"(t)
+			:
+			: "rcx", "rdx", "memory", "cc");
+
+	return t;
+}
+
 #elif defined(__PPC__) || defined(__PPC64__)
 /* Note: only PPC CPUs which have mftb instruction are supported. */
 /* PPC64 has mftb */
@@ -0,0 +1,300 @@
+/* vim: set noet: */
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "handshake.h"
+#include "completion.h"
+#include "topology.h"
+#include "contention.h"
+
+struct hs_header {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	length;		/* bytes of records after the header */
+} __attribute__((packed));
+
+struct hs_record {
+	uint16_t	type;
+	uint16_t	length;		/* bytes of value after the record header */
+} __attribute__((packed));
+
+/* a frame being written, or read back */
+struct hs_frame {
+	char		buf[CTRL_MSG_SIZE];
+	uint16_t	used;
+	int		overflow;
+};
+
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint32_t local_caps(void)
+{
+	unsigned int	a, b, c, d;
+	uint32_t	caps = 0;
+
+	if (__get_cpuid(0x80000001, &a, &b, &c, &d) && (d & (1 << 27)))
+		caps |= HS_CAP_RDTSCP;
+	if (__get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1 << 8)))
+		caps |= HS_CAP_INVARIANT_TSC;
+
+	return caps;
+}
+#else
+static uint32_t local_caps(void)
+{
+	return 0;
+}
+#endif
+
+
+/* append a record of n 64 bit values */
+static void hs_put(struct hs_frame *f, uint16_t type, const uint64_t *v, int n)
+{
+	struct hs_record	r = { htons(type), htons(n * sizeof(uint64_t)) };
+	int			i;
+
+	if (f->used + sizeof(r) + n * sizeof(uint64_t) > sizeof(f->buf)) {
+		f->overflow = 1;
+		return;
+	}
+
+	memcpy(f->buf + f->used, &r, sizeof(r));
+	f->used += sizeof(r);
+	for (i = 0; i < n; i++) {
+		uint64_t be = htonll(v[i]);
+
+		memcpy(f->buf + f->used, &be, sizeof(be));
+		f->used += sizeof(be);
+	}
+}
+
+
+/* the first n values of the record of type, 0 if the frame has no such record */
+static int hs_get(const struct hs_frame *f, uint16_t type, uint64_t *v, int n)
+{
+	struct hs_record	r;
+	uint16_t		at = sizeof(struct hs_header), len;
+	int			i;
+
+	while (at + sizeof(r) <= f->used) {
+		memcpy(&r, f->buf + at, sizeof(r));
+		at += sizeof(r);
+		len = ntohs(r.length);
+		if (at + len > f->used)
+			break;
+
+		/* a longer record is a newer peer's, the values we know come first */
+		if (ntohs(r.type) == type && len >= n * sizeof(uint64_t)) {
+			for (i = 0; i < n; i++) {
+				memcpy(&v[i], f->buf + at + i * sizeof(uint64_t), sizeof(uint64_t));
+				v[i] = ntohll(v[i]);
+			}
+			return 1;
+		}
+		at += len;
+	}
+
+	return 0;
+}
+
+
+/* the server's buffer as the client needs it */
+static void hs_take_server(struct resources *res, const struct hs_frame *f)
+{
+	uint64_t	regions[3], cache[4], shape[3], load[5];
+	char		desc[128];
+
+	/* without a table the rkey that came with the connection data covers it */
+	res->remote_mrs.count = 1;
+	if (hs_get(f, HS_REGIONS, regions, 3)) {
+		res->remote_mrs.chunk = regions[0];
+		res->remote_mrs.count = regions[1];
+		res->remote_mrs.flags = regions[2];
+	}
+	res->remote_mrs.base = res->remote_props.addr;
+	debug_print("Remote buffer in %u MR(s) of %lu bytes, flags 0x%x\n",
+			res->remote_mrs.count, res->remote_mrs.chunk, res->remote_mrs.flags);
+
+	if (hs_get(f, HS_CACHE, cache, 4)) {
+		server_cache.llc_size = cache[0];
+		server_cache.line_size = cache[1];
+		server_cache.ways = cache[2];
+		server_cache.slices = cache[3];
+		debug_print("Server LLC %lu bytes, %u ways, %u slices, %u byte lines\n",
+				server_cache.llc_size, server_cache.ways, server_cache.slices, server_cache.line_size);
+	}
+
+	/* the run is only as quiet as the server was, say so up front */
+	if (hs_get(f, HS_LOAD, load, 5)) {
+		server_contention.threads = load[0];
+		server_contention.ws = load[1];
+		server_contention.pattern = load[2];
+		server_contention.duty = load[3];
+		server_contention.period_us = load[4];
+		contention_describe(&server_contention, desc, sizeof(desc));
+		fprintf(stderr, "server contention: %s\n", desc);
+	}
+
+	if (!hs_get(f, HS_SHAPE, shape, 3))
+		return;
+
+	/* the buffer is the server's, its shape is whatever the server made it */
+	if ((config.row_count && config.row_count != shape[0]) || (config.column_count && config.column_count != shape[1]))
+		fprintf(stderr, "server buffer is %lu rows of %lu columns, not %lu of %lu, using the server's\n",
+				shape[0], shape[1], config.row_count, config.column_count);
+	config.row_count = shape[0];
+	config.column_count = shape[1];
+
+	if (shape[2] != config.msg_size)
+		fprintf(stderr, "server msg_size is %lu, client msg_size is %u\n", shape[2], config.msg_size);
+}
+
+
+int handshake(struct resources *res)
+{
+	struct hs_frame		local, remote;
+	struct hs_header	h;
+	uint64_t		v[5];
+	int			server = !config.server_name;
+
+	if (!cq_cycles_per_ms)
+		cq_calibrate();
+
+	memset(&local, 0, sizeof(local));
+	memset(&remote, 0, sizeof(remote));
+	local.used = sizeof(h);
+
+	v[0] = local_caps() | (server ? HS_CAP_ORACLE | HS_CAP_CLOCK | HS_CAP_SWEEP : 0);
+	hs_put(&local, HS_CAPS, v, 1);
+	v[0] = res->max_inline;
+	hs_put(&local, HS_INLINE, v, 1);
+	v[0] = qp_rd_atomic(res, 1);
+	hs_put(&local, HS_RD_ATOMIC, v, 1);
+	/* cycles per millisecond is kHz */
+	v[0] = cq_cycles_per_ms;
+	hs_put(&local, HS_TSC, v, 1);
+
+	if (server) {
+		v[0] = res->mrs ? res->mr_chunk : res->size;
+		v[1] = res->mrs ? res->num_mrs : 1;
+		v[2] = config.odp ? MR_TABLE_ODP : 0;
+		hs_put(&local, HS_REGIONS, v, 3);
+
+		v[0] = server_cache.llc_size;
+		v[1] = server_cache.line_size;
+		v[2] = server_cache.ways;
+		v[3] = server_cache.slices;
+		hs_put(&local, HS_CACHE, v, 4);
+
+		v[0] = config.row_count;
+		v[1] = config.column_count;
+		v[2] = config.msg_size;
+		hs_put(&local, HS_SHAPE, v, 3);
+
+		if (server_contention.threads) {
+			v[0] = server_contention.threads;
+			v[1] = server_contention.ws;
+			v[2] = server_contention.pattern;
+			v[3] = server_contention.duty;
+			v[4] = server_contention.period_us;
+			hs_put(&local, HS_LOAD, v, 5);
+		}
+	} else {
+		v[0] = config.mode;
+		v[1] = config.iters;
+		hs_put(&local, HS_MODE, v, 2);
+		if (config.oracle) {
+			v[0] = 1;
+			hs_put(&local, HS_ORACLE, v, 1);
+		}
+		if (config.clock) {
+			v[0] = 1;
+			hs_put(&local, HS_CLOCK, v, 1);
+		}
+		if (config.calibration) {
+			v[0] = 1;
+			hs_put(&local, HS_SWEEP, v, 1);
+		}
+	}
+
+	if (local.overflow) {
+		fprintf(stderr, "handshake does not fit in %d bytes\n", CTRL_MSG_SIZE);
+		return 1;
+	}
+
+	h.magic = htonl(HS_MAGIC);
+	h.version = htons(HS_VERSION);
+	h.length = htons(local.used - sizeof(h));
+	memcpy(local.buf, &h, sizeof(h));
+
+	/* every frame is CTRL_MSG_SIZE bytes, whatever is in it */
+	if (ctrl_sync(res, CTRL_MSG_SIZE, local.buf, remote.buf)) {
+		fprintf(stderr, "failed to exchange the handshake\n");
+		return 1;
+	}
+
+	memcpy(&h, remote.buf, sizeof(h));
+	if (ntohl(h.magic) != HS_MAGIC) {
+		fprintf(stderr, "peer sent no handshake, is it an older build?\n");
+		return 1;
+	}
+	remote.used = sizeof(h) + ntohs(h.length);
+	if (remote.used > sizeof(remote.buf))
+		remote.used = sizeof(remote.buf);
+
+	memset(&res->peer, 0, sizeof(res->peer));
+	res->peer.version = ntohs(h.version) < HS_VERSION ? ntohs(h.version) : HS_VERSION;
+	if (hs_get(&remote, HS_CAPS, v, 1))
+		res->peer.caps = v[0];
+	if (hs_get(&remote, HS_INLINE, v, 1))
+		res->peer.max_inline = v[0];
+	if (hs_get(&remote, HS_RD_ATOMIC, v, 1))
+		res->peer.max_rd_atomic = v[0];
+	if (hs_get(&remote, HS_TSC, v, 1))
+		res->peer.tsc_khz = v[0];
+	if (server && hs_get(&remote, HS_ORACLE, v, 1))
+		res->peer.wants_oracle = !!v[0];
+	if (server && hs_get(&remote, HS_CLOCK, v, 1))
+		res->peer.wants_clock = !!v[0];
+	if (server && hs_get(&remote, HS_SWEEP, v, 1))
+		res->peer.wants_sweep = !!v[0];
+	if (server && hs_get(&remote, HS_MODE, v, 2)) {
+		res->peer.mode = v[0];
+		res->peer.iters = v[1];
+	}
+
+	debug_print("Handshake version %u, peer caps 0x%x, inline %u, %u READs outstanding, TSC %lu kHz\n",
+			res->peer.version, res->peer.caps, res->peer.max_inline, res->peer.max_rd_atomic, res->peer.tsc_khz);
+
+	if (server)
+		return 0;
+
+	hs_take_server(res, &remote);
+	if (config.oracle && !(res->peer.caps & HS_CAP_ORACLE)) {
+		fprintf(stderr, "server cannot label reads, is it an older build?\n");
+		return 1;
+	}
+	if (config.clock && !(res->peer.caps & HS_CAP_CLOCK)) {
+		fprintf(stderr, "server cannot publish its TSC, is it an older build?\n");
+		return 1;
+	}
+	/* a clock line through two estimates only holds while both TSCs keep their rate */
+	if (config.clock && !(res->peer.caps & local_caps() & HS_CAP_INVARIANT_TSC))
+		fprintf(stderr, "the %s TSC is not invariant, the clock estimates drift with its frequency\n",
+				res->peer.caps & HS_CAP_INVARIANT_TSC ? "client's" :
+				local_caps() & HS_CAP_INVARIANT_TSC ? "server's" : "client's nor the server's");
+	if (config.tsc == TSC_RDTSCP && !(local_caps() & HS_CAP_RDTSCP)) {
+		fprintf(stderr, "this CPU has no rdtscp, use -t fenced\n");
+		return 1;
+	}
+	if (config.calibration && !(res->peer.caps & HS_CAP_SWEEP)) {
+		fprintf(stderr, "server cannot sweep its LLC for the calibration, is it an older build? -E 0 runs without\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Control-plane handshake
+ *
+ * Once the two sides can ctrl_sync, each sends one CTRL_MSG_SIZE frame: a
+ * header with a magic number, its handshake version and the length of what
+ * follows, then type-length-value records, all in network byte order:
+ *
+ *	HS_CAPS		HS_CAP_* bits of this side
+ *	HS_INLINE	largest inline send the QP takes, WRITE probes go inline
+ *			when msg_size fits both sides'
+ *	HS_RD_ATOMIC	RDMA READs this side lets its peer have outstanding
+ *	HS_TSC		TSC rate in kHz
+ *	HS_REGIONS	server: bytes per MR, MR count and MR_TABLE_* flags
+ *	HS_CACHE	server: LLC size, line size, ways and slices (topology.h)
+ *	HS_SHAPE	server: row_count, column_count and msg_size of its buffer
+ *	HS_ORACLE	client: 1 to have the server run a residency oracle
+ *	HS_CLOCK	client: 1 to have the server publish its TSC
+ *	HS_SWEEP	client: 1 to have the server sweep its LLC before the
+ *			calibration (calibration.h)
+ *	HS_MODE		client: the mode it runs and its iterations, which the
+ *			server follows
+ *	HS_LOAD		server: threads, ws, pattern, duty and period of its
+ *			contention workload (contention.h), absent without one
+ *
+ * A side skips records it does not know, so new metadata is a new type
+ * rather than a new layout, and both sides go on at the lower of the two
+ * versions. What the peer said lands in res->peer, the server's buffer
+ * layout in res->remote_mrs, server_cache and config as before.
+ *
+ * ******************************************************************************/
+
+#ifndef HANDSHAKE_H_
+#define HANDSHAKE_H_
+
+#include "resources.h"
+
+#define HS_MAGIC	0x52434852	/* "RCHR" */
+#define HS_VERSION	1
+
+/* record types */
+#define HS_CAPS		1
+#define HS_INLINE	2
+#define HS_RD_ATOMIC	3
+#define HS_TSC		4
+#define HS_REGIONS	5
+#define HS_CACHE	6
+#define HS_SHAPE	7
+#define HS_ORACLE	8
+#define HS_LOAD		9
+#define HS_CLOCK	10
+#define HS_SWEEP	11
+#define HS_MODE		12
+
+/* capabilities */
+#define HS_CAP_RDTSCP		0x1	/* the CPU has rdtscp, -t rdtscp needs it on the client */
+#define HS_CAP_INVARIANT_TSC	0x2	/* the TSC ticks at a constant rate in every P/C-state, -Y warns without it */
+#define HS_CAP_ORACLE		0x4	/* the server can run a residency oracle (oracle.h) */
+#define HS_CAP_CLOCK		0x8	/* the server can publish its TSC (clocksync.h) */
+#define HS_CAP_SWEEP		0x10	/* the server can sweep its LLC (calibration.h) */
+
+/******************************************************************************
+ * *	Function: handshake
+ * *
+ * *	Input
+ * *	res	resources that can ctrl_sync, remote_props already set
+ * *
+ * *	Output
+ * *	res	peer filled in, client: remote_mrs without the rkeys
+ * *	client: server_cache, server_contention, config.row_count and
+ * *	config.column_count
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure or a peer without the handshake
+ * *
+ * *	Description
+ * *	Over TCP connect_qp runs this before the QP goes to RTR, so the READs
+ * *	a client keeps outstanding stay within what the server grants. Over
+ * *	rdma_cm the connection parameters settle that, and this runs once the
+ * *	connection is established.
+ * *
+ * *	The client takes the server's buffer shape as is, with a warning when
+ * *	its own -r or -c said otherwise, and warns when the two sides disagree
+ * *	on msg_size. A client with -G or -Y fails against a server that
+ * *	cannot run the oracle or publish its TSC.
+ * ******************************************************************************/
+int handshake(struct resources *res);
+
+#endif // HANDSHAKE_H_
@@ -0,0 +1,120 @@
+/* vim: set noet: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heatmap.h"
+
+/* a page's worth of cells per row of the export */
+#define HEAT_PAGE_SIZE	4096
+
+
+struct heatmap *heatmap_open(uint64_t base, uint64_t size, uint32_t line_size)
+{
+	struct heatmap *h;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+
+	h->base = base;
+	h->line_size = line_size;
+	while ((1u << h->shift) < line_size)
+		h->shift++;
+	h->lines = (size + line_size - 1) >> h->shift;
+
+	h->cells = calloc(h->lines, sizeof(*h->cells));
+	if (!h->cells) {
+		fprintf(stderr, "failed to allocate a heatmap of %lu lines\n", h->lines);
+		free(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+
+/* say how many lines were probed and which page hit least often on the second read */
+static void heatmap_summary(const struct heatmap *h, uint32_t row_lines, uint64_t rows)
+{
+	uint64_t	row, line, probed = 0, classified = 0, hits = 0;
+	uint64_t	worst = 0, worst_classified = 0, worst_hits = 0;
+
+	for (row = 0; row < rows; row++) {
+		uint64_t c = 0, k = 0;
+
+		for (line = row * row_lines; line < (row + 1) * row_lines && line < h->lines; line++) {
+			probed += h->cells[line].count > 0;
+			c += h->cells[line].classified;
+			k += h->cells[line].hits[1];
+		}
+		classified += c;
+		hits += k;
+
+		/* compare rates as k/c < worst_hits/worst_classified, without dividing */
+		if (c && (!worst_classified || k * worst_classified < worst_hits * c)) {
+			worst = row;
+			worst_classified = c;
+			worst_hits = k;
+		}
+	}
+
+	fprintf(stderr, "heatmap: %lu of %lu lines probed", probed, h->lines);
+	if (classified)
+		fprintf(stderr, ", second reads hit %.1f%%, least on page %lu at %.1f%% of %lu",
+				100.0 * hits / classified, worst, 100.0 * worst_hits / worst_classified, worst_classified);
+	if (h->strays)
+		fprintf(stderr, ", %lu samples outside the buffer", h->strays);
+	fprintf(stderr, "\n");
+}
+
+
+int heatmap_write(const struct heatmap *h, const char *path)
+{
+	struct heatmap_header	hdr;
+	struct heat_cell	pad;
+	FILE			*f;
+	uint64_t		padding, i;
+	int			rc = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HEAT_MAGIC, sizeof(hdr.magic));
+	hdr.line_size = h->line_size;
+	hdr.row_lines = h->line_size < HEAT_PAGE_SIZE ? HEAT_PAGE_SIZE / h->line_size : 1;
+	hdr.rows = (h->lines + hdr.row_lines - 1) / hdr.row_lines;
+	hdr.lines = h->lines;
+	hdr.threshold = h->threshold;
+
+	heatmap_summary(h, hdr.row_lines, hdr.rows);
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+
+	memset(&pad, 0, sizeof(pad));
+	padding = hdr.rows * hdr.row_lines - h->lines;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fwrite(h->cells, sizeof(*h->cells), h->lines, f) != h->lines)
+		rc = 1;
+	for (i = 0; i < padding && !rc; i++)
+		if (fwrite(&pad, sizeof(pad), 1, f) != 1)
+			rc = 1;
+
+	if (fclose(f))
+		rc = 1;
+	if (rc)
+		fprintf(stderr, "failed to write the heatmap to %s\n", path);
+
+	return rc;
+}
+
+
+void heatmap_close(struct heatmap *h)
+{
+	if (!h)
+		return;
+
+	free(h->cells);
+	free(h);
+}
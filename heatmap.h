@@ -0,0 +1,117 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Per-line heatmap
+ *
+ * Probe counts, hits and latency sums of both reads for every cache line of
+ * the server's buffer, indexed by the line's offset in it. Memory is one
+ * 32 byte cell per line of the buffer however long the run is, and the map
+ * shows whether anomalies gather on particular pages or sets, which the
+ * flat stream of samples cannot.
+ *
+ * A read counts as a hit by the backend's ground truth when it has a label.
+ * Otherwise it is classified against the calibrated cutoff (calibration.h)
+ * or, without calibration, the threshold between the run's first and
+ * second reads, which the client refreshes every HEAT_RECLASSIFY samples.
+ * Samples taken before the first threshold are counted but not classified.
+ *
+ * heatmap_write exports the map as a 2D array of pages by lines within a
+ * page, all fields in host byte order:
+ *
+ *	struct heatmap_header
+ *	rows * row_lines struct heat_cell, row major, lines past the end
+ *	of the buffer zeroed
+ *
+ * Sets are line % sets of the server's LLC (see topology.h), so per-set
+ * maps can be folded from it offline.
+ *
+ * ******************************************************************************/
+
+#ifndef HEATMAP_H_
+#define HEATMAP_H_
+
+#include <stdint.h>
+
+#define HEAT_MAGIC		"RCHEAT1"
+#define HEAT_RECLASSIFY		4096
+
+struct heat_cell {
+	uint32_t	count;		/* probes of the line */
+	uint32_t	classified;	/* of those, probes with a hit or miss verdict */
+	uint32_t	hits[2];	/* first and second reads that hit */
+	uint64_t	sum[2];		/* cycles of the first and second reads */
+};
+
+struct heatmap_header {
+	char		magic[8];	/* HEAT_MAGIC */
+	uint32_t	line_size;	/* bytes per cell */
+	uint32_t	row_lines;	/* cells per row, a page's worth */
+	uint64_t	rows;
+	uint64_t	lines;		/* cells that are part of the buffer */
+	uint64_t	threshold;	/* the last classification threshold in cycles, 0 if none */
+} __attribute__((packed));
+
+struct heatmap {
+	uint64_t		base;		/* remote address of the buffer's first line */
+	uint32_t		line_size;
+	uint32_t		shift;		/* log2(line_size) */
+	uint64_t		lines;
+	uint64_t		threshold;	/* cycles, reads at or above it are misses, 0 until known */
+	uint64_t		strays;		/* samples outside the buffer */
+	struct heat_cell	*cells;
+};
+
+/******************************************************************************
+ * *	Function: heatmap_open
+ * *
+ * *	Input
+ * *	base		remote address of the start of the buffer
+ * *	size		bytes in the buffer
+ * *	line_size	bytes per cell, a power of 2
+ * *
+ * *	Returns
+ * *	an empty map, NULL if it could not be allocated
+ * ******************************************************************************/
+struct heatmap *heatmap_open(uint64_t base, uint64_t size, uint32_t line_size);
+
+/* account one pair of reads of the line at addr, hit1/hit2 ground truth or -1 */
+static inline void heatmap_add(struct heatmap *h, uint64_t addr, uint64_t read1, uint64_t read2, int hit1, int hit2)
+{
+	struct heat_cell	*c;
+	uint64_t		line = (addr - h->base) >> h->shift;
+
+	if (addr < h->base || line >= h->lines) {
+		h->strays++;
+		return;
+	}
+
+	c = &h->cells[line];
+	c->count++;
+	c->sum[0] += read1;
+	c->sum[1] += read2;
+
+	/* each read by its label, or by the threshold when it has none */
+	if ((hit1 >= 0 || h->threshold) && (hit2 >= 0 || h->threshold)) {
+		c->classified++;
+		c->hits[0] += hit1 >= 0 ? hit1 > 0 : read1 < h->threshold;
+		c->hits[1] += hit2 >= 0 ? hit2 > 0 : read2 < h->threshold;
+	}
+}
+
+/******************************************************************************
+ * *	Function: heatmap_write
+ * *
+ * *	Input
+ * *	h	map of the run
+ * *	path	file to export it to
+ * *
+ * *	Returns
+ * *	0 on success, 1 if path could not be written
+ * *
+ * *	Description
+ * *	Write the map as above and summarize it on stderr.
+ * ******************************************************************************/
+int heatmap_write(const struct heatmap *h, const char *path);
+
+void heatmap_close(struct heatmap *h);
+
+#endif // HEATMAP_H_
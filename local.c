@@ -0,0 +1,210 @@
+/* vim: set noet: */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+
+#include <infiniband/verbs.h>
+
+#include "get_clock.h"
+#include "resources.h"
+#include "transport.h"
+#include "topology.h"
+#include "evict.h"
+
+#define LOCAL_LINE_SIZE 64
+
+struct local {
+	char	*region;
+	size_t	size;
+	char	*warm[MAX_BATCH];	/* last lines written, reads of any other line start cold */
+	int	next_warm;
+	char	*evict_buf;		/* walked to evict a line in mode 5, see evict.h */
+	size_t	evict_size;
+};
+
+
+static int local_is_warm(struct local *local, char *p)
+{
+	int i;
+
+	for (i = 0; i < MAX_BATCH; i++)
+		if (local->warm[i] == p)
+			return 1;
+
+	return 0;
+}
+
+
+static void local_flush(char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i += LOCAL_LINE_SIZE)
+		_mm_clflush(p + i);
+	_mm_mfence();
+}
+
+
+static int local_create(struct resources *res)
+{
+	struct local	*local;
+	size_t		size;
+
+	/* this machine is the server */
+	topology_read(&server_cache);
+	topology_size_buffer(&server_cache);
+	size = buffer_size();
+
+	local = calloc(1, sizeof(*local));
+	if (!local) {
+		fprintf(stderr, "failed to allocate local backend\n");
+		return 1;
+	}
+	res->local = local;
+
+	/* round up to whole pages for aligned_alloc and fault them all in now,
+	 * so no probe pays for a page fault */
+	local->size = (size + 4095) & ~(size_t) 4095;
+	local->region = aligned_alloc(4096, local->size);
+	if (!local->region) {
+		fprintf(stderr, "failed to malloc %zu bytes to local buffer\n", local->size);
+		return 1;
+	}
+	memset(local->region, 0, local->size);
+
+	if (config.mode == 5) {
+		local->evict_buf = evict_buffer(server_cache.llc_size, &local->evict_size);
+		if (!local->evict_buf)
+			return 1;
+	}
+
+	res->buf = calloc(config.batch, config.msg_size);
+	if (!res->buf) {
+		fprintf(stderr, "failed to malloc %u bytes to memory buffer\n", config.msg_size * config.batch);
+		return 1;
+	}
+	res->size = config.msg_size * config.batch;
+
+	/* the client addresses the local buffer as if it were the server's MR */
+	memset(&res->remote_props, 0, sizeof(res->remote_props));
+	res->remote_props.addr = (uintptr_t) local->region;
+
+	return 0;
+}
+
+
+/* there is no server to wait for */
+static int local_poll_completion(struct resources *res)
+{
+	(void) res;
+	return 0;
+}
+
+
+/* A READ loads every line of the message, a WRITE stores the client buffer
+ * into it. A READ of anything but the lines last written (one batch worth)
+ * is flushed first, so the first read of read_write_read times a load after
+ * clflush and the second a load after a touch. */
+static int local_probe(struct resources *res, int opcode, uint64_t *cycle_count)
+{
+	struct local	*local = res->local;
+	char		*p = (char *) res->remote_props.addr;
+	uint64_t	start_cycle_count, end_cycle_count;
+	uint32_t	i;
+
+	if (p < local->region || p + config.msg_size > local->region + local->size) {
+		fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", IBV_WC_REM_ACCESS_ERR, 0);
+		return 1;
+	}
+
+	if (opcode == IBV_WR_RDMA_WRITE) {
+		start_cycle_count = start_tsc();
+		memcpy(p, res->buf, config.msg_size);
+		end_cycle_count = stop_tsc();
+		local->warm[local->next_warm] = p;
+		local->next_warm = (local->next_warm + 1) % MAX_BATCH;
+	} else {
+		/* in mode 5 local_evict has done the flush's job */
+		if (!local_is_warm(local, p) && !local->evict_buf)
+			local_flush(p, config.msg_size);
+
+		start_cycle_count = start_tsc();
+		for (i = 0; i < config.msg_size; i += LOCAL_LINE_SIZE)
+			(void) *(volatile char *) (p + i);
+		end_cycle_count = stop_tsc();
+
+		memcpy(res->buf, p, config.msg_size);
+	}
+
+	*cycle_count = end_cycle_count - start_cycle_count;
+
+	return 0;
+}
+
+
+/* There is no peer to sync with, echo the data back. In clflush mode this is
+ * where the server would flush its first line, so do that too, and before
+ * the calibration where it would sweep its LLC, all of the buffer. */
+static int local_sync(struct resources *res, int xfer_size, char *local_data, char *remote_data)
+{
+	if (config.mode == 2 && xfer_size == 1 && local_data[0] == 'A') {
+		local_flush(res->local->region, LOCAL_LINE_SIZE);
+		memset(res->local->warm, 0, sizeof(res->local->warm));
+	}
+	if (xfer_size == 1 && local_data[0] == 'S') {
+		local_flush(res->local->region, res->local->size);
+		memset(res->local->warm, 0, sizeof(res->local->warm));
+	}
+
+	memmove(remote_data, local_data, xfer_size);
+
+	return 0;
+}
+
+
+/* walk the eviction buffer like the server's helper does, on this CPU */
+static int local_evict(struct resources *res, uint64_t addr)
+{
+	struct local *local = res->local;
+
+	if (!local->evict_buf) {
+		fprintf(stderr, "the local backend only evicts in mode 5\n");
+		return 1;
+	}
+
+	evict_walk(local->evict_buf, local->evict_size, addr);
+	memset(local->warm, 0, sizeof(local->warm));
+
+	return 0;
+}
+
+
+static int local_destroy(struct resources *res)
+{
+	if (res->local) {
+		free(res->local->evict_buf);
+		free(res->local->region);
+		free(res->local);
+		res->local = NULL;
+	}
+
+	free(res->buf);
+	res->buf = NULL;
+
+	return 0;
+}
+
+
+const struct transport local_transport = {
+	.name = "local",
+	.create = local_create,
+	.poll_completion = local_poll_completion,
+	.probe = local_probe,
+	.probe_batch = NULL,
+	.sync = local_sync,
+	.evict = local_evict,
+	.last_hit = NULL,
+	.destroy = local_destroy,
+};
@@ -0,0 +1,186 @@
+/* vim: set noet: */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "print.h"
+#include "lownoise.h"
+#include "topology.h"
+
+/* stack the probing path may grow into, faulted in before memory is locked */
+#define STACK_PREFAULT	(256 * 1024)
+
+/* CPUs the interrupts of dev_name's PCI function are routed to */
+static void device_irq_cpus(const char *dev_name, cpu_set_t *set)
+{
+	char		path[512];
+	DIR		*dir;
+	struct dirent	*e;
+
+	snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/msi_irqs", dev_name);
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "low-noise: no interrupts found for %s, not avoiding any CPU\n", dev_name);
+		return;
+	}
+
+	while ((e = readdir(dir))) {
+		if (e->d_name[0] == '.')
+			continue;
+
+		/* where the interrupt lands, or where it may land on older kernels */
+		snprintf(path, sizeof(path), "/proc/irq/%s/effective_affinity_list", e->d_name);
+		if (!cpulist_read(path, set)) {
+			snprintf(path, sizeof(path), "/proc/irq/%s/smp_affinity_list", e->d_name);
+			cpulist_read(path, set);
+		}
+	}
+	closedir(dir);
+}
+
+
+/* the current CPU if it is in set, else the lowest one in set, -1 if set is empty */
+static int pick_cpu(cpu_set_t *set)
+{
+	int cpu = sched_getcpu();
+
+	if (cpu >= 0 && CPU_ISSET(cpu, set))
+		return cpu;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, set))
+			return cpu;
+	return -1;
+}
+
+
+/* a minus b */
+static void cpu_andnot(cpu_set_t *a, const cpu_set_t *b)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, b))
+			CPU_CLR(cpu, a);
+}
+
+
+static int pin_to(int cpu)
+{
+	cpu_set_t s;
+
+	CPU_ZERO(&s);
+	CPU_SET(cpu, &s);
+	return sched_setaffinity(0, sizeof(s), &s);
+}
+
+
+/* move to a quiet CPU, 0 on success */
+static int move_cpu(struct lownoise *ln, const char *dev_name)
+{
+	cpu_set_t	quiet, irq, allowed;
+	int		cpu;
+
+	CPU_ZERO(&quiet);
+	CPU_ZERO(&irq);
+	cpulist_read("/sys/devices/system/cpu/isolated", &quiet);
+	cpulist_read("/sys/devices/system/cpu/nohz_full", &quiet);
+	if (dev_name)
+		device_irq_cpus(dev_name, &irq);
+
+	/* isolated CPUs are usually outside of the default affinity, so all of them are tried */
+	cpu_andnot(&quiet, &irq);
+	while ((cpu = pick_cpu(&quiet)) >= 0) {
+		if (!pin_to(cpu)) {
+			fprintf(stderr, "low-noise: probing on isolated cpu %d\n", cpu);
+			return 0;
+		}
+		CPU_CLR(cpu, &quiet);
+	}
+
+	/* any CPU we may run on that takes no device interrupts */
+	fprintf(stderr, "low-noise: no isolcpus or nohz_full CPU available, probing on a shared one\n");
+	allowed = ln->affinity;
+	cpu_andnot(&allowed, &irq);
+	cpu = pick_cpu(&allowed);
+	if (cpu < 0) {
+		fprintf(stderr, "low-noise: every allowed CPU takes interrupts of %s\n", dev_name);
+		return 1;
+	}
+	if (pin_to(cpu))
+		return 1;
+
+	fprintf(stderr, "low-noise: probing on cpu %d\n", cpu);
+	return 0;
+}
+
+
+/* touch the stack the probes will use so they do not fault it in */
+static void __attribute__((noinline)) prefault_stack(void)
+{
+	volatile char stack[STACK_PREFAULT];
+
+	memset((char *) stack, 0, sizeof(stack));
+}
+
+
+void lownoise_enter(struct lownoise *ln, const char *dev_name)
+{
+	struct sched_param	fifo;
+	int32_t			latency = 0;
+
+	memset(ln, 0, sizeof(*ln));
+	ln->dma_fd = -1;
+
+	if (!sched_getaffinity(0, sizeof(ln->affinity), &ln->affinity))
+		ln->pinned = !move_cpu(ln, dev_name);
+
+	/* high, but below the kernel's own FIFO threads such as the watchdog */
+	ln->policy = sched_getscheduler(0);
+	sched_getparam(0, &ln->param);
+	fifo.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+	if (sched_setscheduler(0, SCHED_FIFO, &fifo))
+		fprintf(stderr, "low-noise: could not switch to SCHED_FIFO (%s)\n", strerror(errno));
+	else
+		ln->fifo = 1;
+
+	/* the request holds as long as the file stays open */
+	ln->dma_fd = open("/dev/cpu_dma_latency", O_WRONLY);
+	if (ln->dma_fd >= 0 && write(ln->dma_fd, &latency, sizeof(latency)) != sizeof(latency)) {
+		close(ln->dma_fd);
+		ln->dma_fd = -1;
+	}
+	if (ln->dma_fd < 0)
+		fprintf(stderr, "low-noise: could not hold cpu_dma_latency at 0 (%s)\n", strerror(errno));
+
+	prefault_stack();
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		fprintf(stderr, "low-noise: could not lock memory (%s)\n", strerror(errno));
+	else
+		ln->locked = 1;
+
+	debug_print("low-noise: pinned=%d fifo=%d dma_latency=%d locked=%d\n",
+			ln->pinned, ln->fifo, ln->dma_fd >= 0, ln->locked);
+}
+
+
+void lownoise_leave(struct lownoise *ln)
+{
+	if (ln->locked)
+		munlockall();
+	if (ln->dma_fd >= 0)
+		close(ln->dma_fd);
+	if (ln->fifo)
+		sched_setscheduler(0, ln->policy, &ln->param);
+	if (ln->pinned)
+		sched_setaffinity(0, sizeof(ln->affinity), &ln->affinity);
+
+	ln->locked = ln->fifo = ln->pinned = 0;
+	ln->dma_fd = -1;
+}
@@ -0,0 +1,59 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Low-noise profile
+ *
+ * Quiets the client's probing thread for the length of a run:
+ *
+ *	- moves it to a CPU listed in isolcpus or nohz_full, keeping away from
+ *	  the CPUs that take the RDMA device's interrupts
+ *	- runs it SCHED_FIFO
+ *	- holds /dev/cpu_dma_latency at 0 so the package stays out of deep
+ *	  C-states
+ *	- prefaults its stack and locks all of its memory, including the
+ *	  sample buffers and statistics
+ *
+ * Each step that is not permitted is skipped with a warning. The
+ * cpu_dma_latency request is dropped by the kernel when its file is closed,
+ * so it ends with the process even if lownoise_leave never runs. The other
+ * steps only affect the process itself.
+ *
+ * ******************************************************************************/
+
+#ifndef LOWNOISE_H_
+#define LOWNOISE_H_
+
+#include <sched.h>
+
+struct lownoise {
+	int			dma_fd;		/* /dev/cpu_dma_latency, -1 when not held */
+	int			fifo;		/* the scheduler was changed */
+	int			policy;		/* scheduler before, to go back to */
+	struct sched_param	param;
+	int			pinned;		/* the affinity was changed */
+	cpu_set_t		affinity;	/* affinity before */
+	int			locked;		/* memory is locked */
+};
+
+/******************************************************************************
+ * *	Function: lownoise_enter
+ * *
+ * *	Input
+ * *	dev_name	RDMA device whose interrupts to avoid, NULL for none
+ * *
+ * *	Output
+ * *	ln		what was changed, for lownoise_leave
+ * *
+ * *	Returns
+ * *	none
+ * *
+ * *	Description
+ * *	Apply the profile to the calling thread. Call it after the large
+ * *	allocations of the run, since only memory mapped by then is
+ * *	prefaulted. What was applied goes to stderr.
+ * ******************************************************************************/
+void lownoise_enter(struct lownoise *ln, const char *dev_name);
+
+/* undo whatever lownoise_enter changed */
+void lownoise_leave(struct lownoise *ln);
+
+#endif // LOWNOISE_H_
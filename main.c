@@ -19,37 +19,58 @@
 #include "get_clock.h"
 #include "sockets.h"
 #include "resources.h"
+#include "stats.h"
+#include "transport.h"
+#include "server.h"
+#include "pattern.h"
+#include "sweep.h"
+#include "telemetry.h"
+#include "lownoise.h"
+#include "trace.h"
+#include "completion.h"
+#include "topology.h"
+#include "heatmap.h"
+#include "evict.h"
+#include "oracle.h"
+#include "contention.h"
+#include "clocksync.h"
+#include "calibration.h"
 #include "print.h"
 
-/* poll CQ timeout in millisec (2 seconds) */
-#define MAX_POLL_CQ_TIMEOUT 2000
+/* latency summaries reported to the server at the end of the run */
+static struct stats read1_stats, read2_stats;
 
-#define CACHE_SIZE 64
-#define CACHE_LINES (8192 * 1024 / CACHE_SIZE)
-#define BM_BITS_PER_WORD (sizeof(uint64_t) * CHAR_BIT)
-#define BM_WORDS (CACHE_LINES / BM_BITS_PER_WORD)
+/* latency distribution of the run, printed with -H */
+static struct histogram hist;
 
-uint64_t bm[BM_WORDS] = {0};
-#define WORD_OFFSET(b) ((b) / BM_BITS_PER_WORD)
-#define BIT_OFFSET(b)  ((b) % BM_BITS_PER_WORD)
+/* reads the backend labelled, [0] misses and [1] hits by its ground truth */
+static struct histogram truth;
 
-void bm_set(unsigned int addr) {
-	bm[WORD_OFFSET(addr)] |= 1ull << BIT_OFFSET(addr);
-}
-void bm_clear(unsigned int addr) {
-	bm[WORD_OFFSET(addr)] &= ~(1ull << BIT_OFFSET(addr));
-}
+/* read latencies by position in the batch, [0] first reads, [1] second reads */
+static struct stats position_stats[2][MAX_BATCH];
 
-bool bm_read(unsigned int addr) {
-	return (bm[WORD_OFFSET(addr)] & (1ull << BIT_OFFSET(addr))) != 0;
-}
+/* pages of an on-demand server buffer the client has probed, and the latency
+ * of those first probes, which may include a page fault */
+static uint64_t *odp_touched;
+static long odp_page_size;
+static struct stats odp_stats[2];
 
-unsigned int rand_line() {
-	unsigned int r;
-	while (bm_read(r = rand() % CACHE_LINES));
-	bm_set(r);
-	return r;
-}
+/* samples labelled by the residency oracle so far, which labels the first
+ * read of even ones and the second of odd ones (see oracle.h) */
+static uint64_t oracle_turn;
+
+/* samples written out so far, and the CPU telemetry taken every config.block of them */
+static uint64_t samples_recorded;
+static struct telemetry *telemetry;
+
+/* writer of the samples when they go to a file rather than stdout */
+static struct trace *trace;
+
+/* per-line accumulator of the samples, NULL without --heatmap */
+static struct heatmap *heatmap;
+
+/* reads of known hits and misses taken before the run, reads is 0 without */
+static struct calibration calibration;
 
 /* default config */
 struct config_t config = {
@@ -61,200 +82,37 @@ struct config_t config = {
 	1000, /* iters */
 	0, /* mode */
 	64, /* msg_size, size of a cache line */
-	4, /* column count, resulting size of row is four cache lines
-			pray the prefetcher fetches no more than 2 cache lines
-			ahead. */
-	524288 /* row count, each pass is ~33MB so everything should be
-			  evicted from Intel's 20 MB LLC on the next pass. */
+	0, /* column count, 0 to span PF_GUARD_LINES of the server's cache
+			lines per row, see topology.h */
+	0, /* row count, 0 for a buffer EVICT_FACTOR times the server's
+			LLC so a pass evicts everything the last one left. */
+	0, /* daemon */
+	1, /* max clients */
+	0, /* rdma_cm */
+	"verbs", /* backend */
+	NULL, /* sim params */
+	0, /* histogram */
+	1, /* batch */
+	0, /* odp */
+	0, /* reg_chunk */
+	8, /* pf_lines */
+	65536, /* ddio_max */
+	NULL, /* telemetry */
+	1000, /* block */
+	5, /* freq_tol, percent */
+	0, /* low_noise */
+	NULL, /* output */
+	TSC_FENCED, /* tsc */
+	NULL, /* heatmap */
+	1, /* seed */
+	NULL, /* record */
+	NULL, /* replay */
+	0, /* oracle */
+	NULL, /* contention */
+	NULL, /* clock */
+	CALIBRATION_READS /* calibration */
 };
 
-/* poll_completion */
-/******************************************************************************
- * *	Function: poll_completion
- * *
- * *	Input
- * *	res	pointer to resources structure
- * *
- * *	Output
- * *	none
- * *
- * *	Returns
- * *	0 on success, 1 on failure
- * *
- * *	Description
- * *	Poll the completion queue for a single event. This function will continue to
- * *	poll the queue until MAX_POLL_CQ_TIMEOUT milliseconds have passed.
- * *
- * ******************************************************************************/
-
-static int poll_completion(struct resources *res)
-{
-	struct ibv_wc	wc;
-	unsigned long	start_time_msec;
-	unsigned long	cur_time_msec;
-	struct timeval	cur_time;
-	int		poll_result;
-	int		rc = 0;
-
-	/* poll the completion for a while before giving up of doing it .. */
-	gettimeofday(&cur_time, NULL);
-	start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-
-	do {
-		poll_result = ibv_poll_cq(res->cq, 1, &wc);
-		gettimeofday(&cur_time, NULL);
-		cur_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-	} while ((poll_result == 0) && ((cur_time_msec - start_time_msec) < MAX_POLL_CQ_TIMEOUT));
-
-	if (poll_result < 0) {
-		/* poll CQ failed */
-		fprintf(stderr, "poll CQ failed retval = %d, errno: %s\n", poll_result, strerror(errno));
-		rc = 1;
-	} else if (poll_result == 0) {
-		/* the CQ is empty */
-		fprintf(stderr, "completion wasn't found in the CQ after timeout. errno: %s\n", strerror(errno));
-		rc = 1;
-	} else {
-		/* CQE found */
-		debug_print("completion was found in CQ with status 0x%x\n", wc.status);
-
-		/* check the completion status (here we don't care about the completion opcode */
-		if (wc.status != IBV_WC_SUCCESS) {
-			fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", wc.status, wc.vendor_err);
-			rc = 1;
-		}
-	}
-
-	return rc;
-}
-
-
-
-/******************************************************************************
- * *	Function: post_send
- * *
- * *	Input
- * *	res	 pointer to resources structure
- * *	opcode   IBV_WR_SEND, IBV_WR_RDMA_READ or IBV_WR_RDMA_WRITE
- * *
- * *	Output
- * *	none
- * *
- * *	Returns
- * *	0 on success, error code on failure
- * *
- * *	Description
- * *	This function will create and post a send work request
- * ******************************************************************************/
-
-static int post_send(struct resources *res, int opcode)
-{
-	struct ibv_send_wr	sr;
-	struct ibv_sge		sge;
-	struct ibv_send_wr	*bad_wr = NULL;
-	int			rc;
-
-	/* prepare the scatter/gather entry */
-	memset(&sge, 0, sizeof(sge));
-	sge.addr = (uintptr_t)res->buf;
-	sge.length = config.msg_size;
-	sge.lkey = res->mr->lkey;
-
-	/* prepare the send work request */
-	memset(&sr, 0, sizeof(sr));
-	sr.next = NULL;
-	sr.wr_id = 0;
-	sr.sg_list = &sge;
-	sr.num_sge = 1;
-	sr.opcode = opcode;
-	sr.send_flags = IBV_SEND_SIGNALED;
-
-	if(opcode != IBV_WR_SEND) {
-		sr.wr.rdma.remote_addr = res->remote_props.addr;
-		sr.wr.rdma.rkey = res->remote_props.rkey;
-	}
-
-	/* there is a Receive Request in the responder side, so we won't get any into RNR flow */
-	rc = ibv_post_send(res->qp, &sr, &bad_wr);
-	if (rc)
-		fprintf(stderr, "failed to post SR\n");
-
-	return rc;
-}
-
-
-/* Time the difference between an post_send and a poll_cq */
-static int post_send_poll_complete(struct resources *res, int opcode, uint64_t* cycle_count)
-{
-	// From post_send
-	struct ibv_send_wr	sr;
-	struct ibv_sge		sge;
-	struct ibv_send_wr	*bad_wr = NULL;
-	int			rc;
-
-	// From poll_complete
-	struct ibv_wc	wc;
-	int		poll_result;
-
-	// Timing variables
-	uint64_t start_cycle_count;
-	uint64_t end_cycle_count;
-
-	/* prepare the scatter/gather entry */
-	memset(&sge, 0, sizeof(sge));
-	sge.addr = (uintptr_t)res->buf;
-	sge.length = config.msg_size;
-	sge.lkey = res->mr->lkey;
-
-	/* prepare the send work request */
-	memset(&sr, 0, sizeof(sr));
-	sr.next = NULL;
-	sr.wr_id = 0;
-	sr.sg_list = &sge;
-	sr.num_sge = 1;
-	sr.opcode = opcode;
-	sr.send_flags = IBV_SEND_SIGNALED;
-
-	if(opcode != IBV_WR_SEND) {
-		sr.wr.rdma.remote_addr = res->remote_props.addr;
-		sr.wr.rdma.rkey = res->remote_props.rkey;
-	}
-
-	/* there is a Receive Request in the responder side, so we won't get any into RNR flow */
-	start_cycle_count = start_tsc();
-
-	rc = ibv_post_send(res->qp, &sr, &bad_wr);
-	if (rc)
-		fprintf(stderr, "failed to post SR\n");
-	do {
-		poll_result = ibv_poll_cq(res->cq, 1, &wc);
-	} while (poll_result == 0);
-
-	end_cycle_count = stop_tsc();
-
-	if (poll_result < 0) {
-		/* poll CQ failed */
-		fprintf(stderr, "poll CQ failed retval = %d, errno: %s\n", poll_result, strerror(errno));
-		rc = 1;
-	} else if (poll_result == 0) {
-		/* the CQ is empty */
-		fprintf(stderr, "completion wasn't found in the CQ after timeout. errno: %s\n", strerror(errno));
-		rc = 1;
-	} else {
-		/* CQE found */
-		*cycle_count = end_cycle_count - start_cycle_count;
-
-		/* check the completion status (here we don't care about the completion opcode */
-		if (wc.status != IBV_WC_SUCCESS) {
-			fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", wc.status, wc.vendor_err);
-			rc = 1;
-		}
-	}
-
-	return rc;
-}
-
-
 /******************************************************************************
  * *	Function: print_config
  * *
@@ -269,8 +127,17 @@ static void print_config(void)
 	if (config.server_name)
 		debug_print("[client only] IP	: %s\n", config.server_name);
 	debug_print(" TCP port	: %u\n", config.tcp_port);
+	debug_print(" Backend	: %s\n", config.backend);
+	if (config.rdma_cm)
+		debug_print(" Connection	: rdma_cm\n");
+	if (config.daemon)
+		debug_print("[server only] Daemon	: up to %d client(s)\n", config.max_clients);
 	if (config.gid_idx >= 0)
 		debug_print(" GID index	: %u\n", config.gid_idx);
+	if (config.server_name)
+		debug_print("[client only] Seed	: %lu\n", config.seed);
+	if (config.replay)
+		debug_print("[client only] Replay	: %s\n", config.replay);
 	debug_print(" ------------------------------------------------\n\n");
 }
 
@@ -305,15 +172,123 @@ static void usage(const char *argv0)
 	fprintf(stdout, " -n, --iterations <iterations>  "
 			"Number of iterations to perform in the test "
 			"(default 1000)\n");
-	fprintf(stdout, " -m, --mode <mode>  set to 0 for seq or 1 for rand or 2 for clflush (default 0)\n");
+	fprintf(stdout, " -m, --mode <mode>  set to 0 for seq, 1 for rand, 2 for clflush, 3 for the prefetch sweep, 4 for the DDIO capacity sweep or 5 for clflush's line evicted by a server helper thread (default 0), the server follows the client\n");
 	fprintf(stdout, " -s, --msg-size <bytes>  size of client buffer (default 64)\n");
-	fprintf(stdout, " -c, --column-count <num>  number of columns (default 128)\n");
-	fprintf(stdout, " -r, --row-count <num>  number of rows (default 8192)\n");
+	fprintf(stdout, " -c, --column-count <num>  number of columns (default: from the server's LLC)\n");
+	fprintf(stdout, " -r, --row-count <num>  number of rows (default: from the server's LLC)\n");
+	fprintf(stdout, " -D, --daemon  [server] keep the registered buffer and serve clients until SIGINT/SIGTERM\n");
+	fprintf(stdout, " -N, --clients <num>  [server] number of clients the daemon serves concurrently (default 1)\n");
+	fprintf(stdout, " -R, --rdma-cm  connect with librdmacm instead of the TCP exchange, both sides must use it\n");
+	fprintf(stdout, " -B, --backend <name>  [client] verbs, sim to probe an in-process model of the server, or local to time loads of a local buffer after clflush and after a touch (default verbs)\n");
+	fprintf(stdout, " -S, --sim-params <k=v,...>  [client] simulated server parameters: llc, ways, ddio, hit, miss, sd, ralloc, seed\n");
+	fprintf(stdout, " -H, --histogram  [client] print the latency histogram and the best hit/miss threshold to stderr\n");
+	fprintf(stdout, " -K, --batch <num>  [client] lines probed per post in modes 0, 1 and 4, up to %d (default 1)\n", MAX_BATCH);
+	fprintf(stdout, " -O, --odp  [server] register the buffer on demand and prefetch it instead of pinning it\n");
+	fprintf(stdout, " -P, --pf-lines <num>  [client] neighbours on either side mode 3 reads, up to %d (default 8)\n", MAX_PF_LINES);
+	fprintf(stdout, " -W, --ddio-max <lines>  [client] largest working set mode 4 tries, -n is the passes per size there (default 65536)\n");
+	fprintf(stdout, " -T, --telemetry <file>  [client] sample CPU frequency and package C-states every block and write them to <file>\n");
+	fprintf(stdout, " -b, --block <samples>  [client] samples per telemetry block and between two clock estimates (default 1000)\n");
+	fprintf(stdout, " -F, --freq-tol <percent>  [client] flag blocks whose frequency is this far from the run's median (default 5)\n");
+	fprintf(stdout, " -L, --low-noise  [client] probe from an isolated CPU away from the device's interrupts, SCHED_FIFO, without deep C-states and with memory locked\n");
+	fprintf(stdout, " -o, --output <file>  [client] write the samples to <file> from a thread on another CPU instead of to stdout\n");
+	fprintf(stdout, " -M, --heatmap <file>  [client] keep hits and latencies of every line of the server's buffer and write them to <file> as a binary map (see heatmap.h)\n");
+	fprintf(stdout, " -e, --seed <num>  [client] seed of the rand pattern (default 1)\n");
+	fprintf(stdout, " -a, --record <file>  [client] record the seed and every probed offset of modes 0-2 and 5 to <file>\n");
+	fprintf(stdout, " -A, --replay <file>  [client] probe the offsets recorded in <file> in the same order, in the mode they were recorded in\n");
+	fprintf(stdout, " -Y, --clock <file>  [client] estimate the server's TSC against ours before, every -b samples during and after the run and write the estimates to <file> (see clocksync.h)\n");
+	fprintf(stdout, " -G, --oracle  [client] have the server time each read line itself and label the read a hit or miss (see oracle.h), not with -K\n");
+	fprintf(stdout, " -E, --calibration <reads>  [client] reads of known misses and of known hits before the run, their distributions and cutoff head the samples (see calibration.h), 0 for none (default %d)\n", CALIBRATION_READS);
+	fprintf(stdout, " -t, --tsc <source>  [client] timestamps around each verbs probe, fenced (lfence/rdtsc to rdtscp/lfence) or rdtscp (default fenced)\n");
+	fprintf(stdout, " -C, --reg-chunk <bytes>  [server] register the buffer as MRs of this size, a multiple of the page and message size\n");
+	fprintf(stdout, " -x, --contention <k=v,...>  [server, local backend] run pinned threads that load the LLC: threads, ws, pattern (seq, rand, write), duty, period, cpus (see contention.h)\n");
+}
+
+/* Whether addr is the first probe of its page on an on-demand server buffer */
+static int odp_first_touch(const struct resources *res, uint64_t addr)
+{
+	uint64_t page;
+
+	if (!odp_touched)
+		return 0;
+
+	page = (addr - res->remote_mrs.base) / odp_page_size;
+	if (odp_touched[page / 64] & (1ull << (page % 64)))
+		return 0;
+
+	odp_touched[page / 64] |= 1ull << (page % 64);
+	return 1;
+}
+
+/* backends that know the cache state append it as ground truth, -1 for a read without */
+static void sink_stdout(uint64_t read1_cycles, uint64_t read2_cycles, int hit1, int hit2, double cycles_to_usec)
+{
+	if (hit1 >= 0 || hit2 >= 0)
+		data_print("%lu,%lu,%f,%f,%d,%d\n", read1_cycles, read2_cycles, (read1_cycles * 1000) / cycles_to_usec, (read2_cycles * 1000) / cycles_to_usec, hit1, hit2);
+	else
+		data_print("%lu,%lu,%f,%f\n", read1_cycles, read2_cycles, (read1_cycles * 1000) / cycles_to_usec, (read2_cycles * 1000) / cycles_to_usec);
+}
+
+static void sink_trace(uint64_t read1_cycles, uint64_t read2_cycles, int hit1, int hit2, double cycles_to_usec)
+{
+	(void) cycles_to_usec;
+	trace_add(trace, read1_cycles, read2_cycles, hit1, hit2);
+}
+
+/* where record_sample puts each row, picked once before the first probe */
+static void (*sink)(uint64_t read1_cycles, uint64_t read2_cycles, int hit1, int hit2, double cycles_to_usec) = sink_stdout;
+
+/* Add one line's pair of reads to the statistics and print it. position is
+ * its place in the batch, -1 when not batching. Every config.block samples
+ * the telemetry closes a block and the server's clock is estimated, 1 if
+ * that failed. */
+static int record_sample(struct resources *res, uint64_t addr, int position, uint64_t read1_cycles, uint64_t read2_cycles, int hit1, int hit2, double cycles_to_usec)
+{
+	/* the NIC may have had to fault the page in, keep it out of the samples */
+	if (odp_first_touch(res, addr)) {
+		stats_add(&odp_stats[0], read1_cycles);
+		stats_add(&odp_stats[1], read2_cycles);
+		return 0;
+	}
+
+	stats_add(&read1_stats, read1_cycles);
+	stats_add(&read2_stats, read2_cycles);
+	if (position >= 0) {
+		stats_add(&position_stats[0][position], read1_cycles);
+		stats_add(&position_stats[1][position], read2_cycles);
+	}
+	hist_add(&hist, 0, read1_cycles);
+	hist_add(&hist, 1, read2_cycles);
+	if (hit1 >= 0)
+		hist_add(&truth, hit1 > 0, read1_cycles);
+	if (hit2 >= 0)
+		hist_add(&truth, hit2 > 0, read2_cycles);
+
+	sink(read1_cycles, read2_cycles, hit1, hit2, cycles_to_usec);
+
+	if (heatmap) {
+		/* backends without ground truth are classified against the calibration or the run so far */
+		if ((hit1 < 0 || hit2 < 0) && !calibration.reads && (read1_stats.count % HEAT_RECLASSIFY) == 0) {
+			struct classifier c;
+
+			hist_classify(&hist, &c);
+			heatmap->threshold = c.threshold;
+		}
+		heatmap_add(heatmap, addr, read1_cycles, read2_cycles, hit1, hit2);
+	}
+
+	if (++samples_recorded % config.block)
+		return 0;
+	if (telemetry)
+		telemetry_block(telemetry, samples_recorded - config.block, config.block);
+
+	return clocksync_estimate(res, samples_recorded);
 }
 
 static int read_write_read(struct resources *res, uint64_t target_addr, double cycles_to_usec) {
 	uint64_t write_cyclces, orig_addr, read1_cycles, read2_cycles;
 	int64_t delta;
+	int hit1 = -1, hit2 = -1;
+	int label1 = !res->oracle || oracle_turn % 2 == 0, label2 = !res->oracle || oracle_turn % 2;
 
 	/* Store the original addr so we can change back to it after we're done. */
 	orig_addr = res->remote_props.addr;
@@ -321,17 +296,19 @@ static int read_write_read(struct resources *res, uint64_t target_addr, double c
 
 	/* First read the contents of the server's buffer.
 	 * This should be a cache miss. */
-	if (post_send_poll_complete(res, IBV_WR_RDMA_READ, &read1_cycles)) {
+	if (transport_probe(res, IBV_WR_RDMA_READ, &read1_cycles)) {
 		fprintf(stderr, "failed to post SR 2\n");
 		return 1;
 	}
+	if (label1)
+		hit1 = transport_last_hit(res);
 	debug_print("[READ]  Contents of server's buffer: '%hhu', it took %lu cycles\n", res->buf[0], read1_cycles);
 
 	/* Now we replace what's in the client's buffer to write to the server's buffer.
 	 * This should pull this target_addr memory into cache. */
 	res->buf[0] = res->buf[0] + 2;
 	debug_print("[WRITE] Now replacing it with: '%hhu',", res->buf[0]);
-	if (post_send_poll_complete(res, IBV_WR_RDMA_WRITE, &write_cyclces)) {
+	if (transport_probe(res, IBV_WR_RDMA_WRITE, &write_cyclces)) {
 		fprintf(stderr, "failed to post SR 3\n");
 		return 1;
 	}
@@ -339,13 +316,17 @@ static int read_write_read(struct resources *res, uint64_t target_addr, double c
 
 	/* Then we read contents of server's buffer again.
 	 * This should be a cache hit. */
-	if (post_send_poll_complete(res, IBV_WR_RDMA_READ, &read2_cycles)) {
+	if (transport_probe(res, IBV_WR_RDMA_READ, &read2_cycles)) {
 		fprintf(stderr, "failed to post SR 2\n");
 		return 1;
 	}
+	if (label2)
+		hit2 = transport_last_hit(res);
+	if (res->oracle)
+		oracle_turn++;
 	delta = read1_cycles - read2_cycles;
-
-	data_print("%lu,%lu,%f,%f\n", read1_cycles, read2_cycles, (read1_cycles * 1000) / cycles_to_usec, (read2_cycles * 1000) / cycles_to_usec);
+	if (record_sample(res, target_addr, -1, read1_cycles, read2_cycles, hit1, hit2, cycles_to_usec))
+		return 1;
 	debug_print("[READ]  Contents of server's buffer: '%hhu', it took %lu cycles\n", res->buf[0], read2_cycles);
 	debug_print("[DIFF]  %5ld cycles = %06.1f nsec\n", delta, delta / cycles_to_usec);
 
@@ -355,6 +336,89 @@ static int read_write_read(struct resources *res, uint64_t target_addr, double c
 	return 0;
 }
 
+/* read_write_read on n lines at once, each phase posted as one chain */
+static int read_write_read_batch(struct resources *res, const uint64_t *addrs, int n, double cycles_to_usec) {
+	uint64_t read1_cycles[MAX_BATCH], write_cycles[MAX_BATCH], read2_cycles[MAX_BATCH];
+	int hit1[MAX_BATCH], hit2[MAX_BATCH];
+	int i;
+
+	if (transport_probe_batch(res, IBV_WR_RDMA_READ, addrs, n, read1_cycles, hit1)) {
+		fprintf(stderr, "failed to post READ batch\n");
+		return 1;
+	}
+
+	/* change every slot so the WRITEs really modify the lines */
+	for (i = 0; i < n; i++)
+		res->buf[i * config.msg_size] += 2;
+
+	if (transport_probe_batch(res, IBV_WR_RDMA_WRITE, addrs, n, write_cycles, hit2)) {
+		fprintf(stderr, "failed to post WRITE batch\n");
+		return 1;
+	}
+
+	if (transport_probe_batch(res, IBV_WR_RDMA_READ, addrs, n, read2_cycles, hit2)) {
+		fprintf(stderr, "failed to post READ batch\n");
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (record_sample(res, addrs[i], i, read1_cycles[i], read2_cycles[i], hit1[i], hit2[i], cycles_to_usec))
+			return 1;
+		debug_print("[BATCH] %d: read1 %lu, write %lu, read2 %lu cycles\n", i, read1_cycles[i], write_cycles[i], read2_cycles[i]);
+	}
+
+	return 0;
+}
+
+/* Mean latency of each position in the batch and how far it has moved from
+ * the first, which waits on nothing but its own round trip. */
+static void print_batch_positions(FILE *f, double cycles_to_usec)
+{
+	double ns_per_cycle = 1000 / cycles_to_usec;
+	double base1 = position_stats[0][0].mean, base2 = position_stats[1][0].mean;
+	int i;
+
+	fprintf(f, "%8s %9s %20s %20s\n", "position", "samples", "read1 ns (shift)", "read2 ns (shift)");
+	for (i = 0; i < config.batch && position_stats[0][i].count; i++)
+		fprintf(f, "%8d %9lu %9.1f (%+8.1f) %9.1f (%+8.1f)\n", i, position_stats[0][i].count,
+				position_stats[0][i].mean * ns_per_cycle, (position_stats[0][i].mean - base1) * ns_per_cycle,
+				position_stats[1][i].mean * ns_per_cycle, (position_stats[1][i].mean - base2) * ns_per_cycle);
+}
+
+/* How the threshold between first and second reads does against the
+ * backend's labels, and the best any single threshold could do. */
+static void print_truth(FILE *f, double cycles_to_usec)
+{
+	double			ns_per_cycle = 1000 / cycles_to_usec;
+	struct classifier	run, scored, best;
+
+	hist_classify(&hist, &run);
+	hist_score(&truth, run.threshold, &scored);
+	hist_classify(&truth, &best);
+
+	fprintf(f, "ground truth: %lu misses %lu hits, threshold=%.1f ns accuracy=%.2f%% miss=%.2f%% hit=%.2f%%, best threshold=%.1f ns accuracy=%.2f%%\n",
+			truth.total[0], truth.total[1], scored.threshold * ns_per_cycle,
+			scored.accuracy * 100, scored.miss_rate * 100, scored.hit_rate * 100,
+			best.threshold * ns_per_cycle, best.accuracy * 100);
+
+	if (calibration.reads) {
+		hist_score(&truth, calibration.cutoff.threshold, &scored);
+		fprintf(f, "ground truth: calibrated threshold=%.1f ns accuracy=%.2f%% miss=%.2f%% hit=%.2f%%\n",
+				scored.threshold * ns_per_cycle, scored.accuracy * 100, scored.miss_rate * 100, scored.hit_rate * 100);
+	}
+}
+
+/* What the reads of known misses and hits took and the cutoff between them. */
+static void print_calibration(FILE *f, double cycles_to_usec)
+{
+	double ns_per_cycle = 1000 / cycles_to_usec;
+
+	fprintf(f, "calibration: %lu misses median=%.1f ns, %lu hits median=%.1f ns, cutoff=%.1f ns accuracy=%.2f%%\n",
+			calibration.hist.total[0], hist_percentile(&calibration.hist, 0, 0.5) * ns_per_cycle,
+			calibration.hist.total[1], hist_percentile(&calibration.hist, 1, 0.5) * ns_per_cycle,
+			calibration.cutoff.threshold * ns_per_cycle, calibration.cutoff.accuracy * 100);
+}
+
 /******************************************************************************
  * *	Function: main
  *  *
@@ -375,10 +439,15 @@ static int read_write_read(struct resources *res, uint64_t target_addr, double c
 int main(int argc, char *argv[])
 {
 	struct resources	res;
+	struct session_report	report;
+	struct classifier	classifier;
+	struct pattern		pattern = { .map = NULL };
+	struct lownoise		lownoise = { .dma_fd = -1 };
+	struct contention	*contention = NULL;
 	int			rc = 1;
-	char		temp_char;
-	int		i, j;
-	uint64_t start_addr, target_addr;
+	char		temp_char, header[1024];
+	int		i, n;
+	uint64_t start_addr, offset, addrs[MAX_BATCH];
 
 	/* parse the command line parameters */
 	while (1) {
@@ -394,10 +463,35 @@ int main(int argc, char *argv[])
 			{.name = "msg-size",	.has_arg = 1,  .val = 's'},
 			{.name = "column-count",	.has_arg = 1,	.val = 'c'},
 			{.name = "row-count",		.has_arg = 1,	.val = 'r'},
+			{.name = "daemon",		.has_arg = 0,	.val = 'D'},
+			{.name = "clients",		.has_arg = 1,	.val = 'N'},
+			{.name = "rdma-cm",		.has_arg = 0,	.val = 'R'},
+			{.name = "backend",		.has_arg = 1,	.val = 'B'},
+			{.name = "sim-params",	.has_arg = 1,	.val = 'S'},
+			{.name = "histogram",	.has_arg = 0,	.val = 'H'},
+			{.name = "batch",		.has_arg = 1,	.val = 'K'},
+			{.name = "odp",		.has_arg = 0,	.val = 'O'},
+			{.name = "reg-chunk",	.has_arg = 1,	.val = 'C'},
+			{.name = "pf-lines",	.has_arg = 1,	.val = 'P'},
+			{.name = "ddio-max",	.has_arg = 1,	.val = 'W'},
+			{.name = "telemetry",	.has_arg = 1,	.val = 'T'},
+			{.name = "block",		.has_arg = 1,	.val = 'b'},
+			{.name = "freq-tol",	.has_arg = 1,	.val = 'F'},
+			{.name = "low-noise",	.has_arg = 0,	.val = 'L'},
+			{.name = "output",	.has_arg = 1,	.val = 'o'},
+			{.name = "tsc",		.has_arg = 1,	.val = 't'},
+			{.name = "heatmap",	.has_arg = 1,	.val = 'M'},
+			{.name = "seed",	.has_arg = 1,	.val = 'e'},
+			{.name = "record",	.has_arg = 1,	.val = 'a'},
+			{.name = "replay",	.has_arg = 1,	.val = 'A'},
+			{.name = "oracle",	.has_arg = 0,	.val = 'G'},
+			{.name = "contention",	.has_arg = 1,	.val = 'x'},
+			{.name = "clock",	.has_arg = 1,	.val = 'Y'},
+			{.name = "calibration",	.has_arg = 1,	.val = 'E'},
 			{.name = NULL,		.has_arg = 0,  .val = '\0'}
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:g:n:m:s:c:r:", long_options, NULL);
+		c = getopt_long(argc, argv, "p:d:i:g:n:m:s:c:r:DN:RB:S:HK:OC:P:W:T:b:F:Lo:t:M:e:a:A:Gx:Y:E:", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -436,36 +530,172 @@ int main(int argc, char *argv[])
 
 			case 'm':
 				config.mode = strtoul(optarg, NULL, 0);
-				if (config.mode < 0 || config.mode > 2) {
+				if (config.mode < 0 || config.mode > 5) {
 					usage(argv[0]);
 					return 1;
 				}
 				break;
 
 			case 's':
-				config.msg_size = strtoul(optarg, NULL, 0);
-				if (config.msg_size < 0) {
+				config.msg_size = strtoull(optarg, NULL, 0);
+				if (!config.msg_size) {
 					usage(argv[0]);
 					return 1;
 				}
 				break;
 
 			case 'c':
-				config.column_count = strtoul(optarg, NULL, 0);
-				if (config.column_count < 0) {
+				config.column_count = strtoull(optarg, NULL, 0);
+				if (!config.column_count) {
 					usage(argv[0]);
 					return 1;
 				}
 				break;
 
 			case 'r':
-				config.row_count = strtoul(optarg, NULL, 0);
-				if (config.row_count < 0) {
+				config.row_count = strtoull(optarg, NULL, 0);
+				if (!config.row_count) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'D':
+				config.daemon = 1;
+				break;
+
+			case 'N':
+				config.max_clients = strtoul(optarg, NULL, 0);
+				if (config.max_clients < 1) {
 					usage(argv[0]);
 					return 1;
 				}
 				break;
 
+			case 'R':
+#ifdef HAVE_RDMACM
+				config.rdma_cm = 1;
+				break;
+#else
+				fprintf(stderr, "built without librdmacm, rebuild with make RDMACM=1\n");
+				return 1;
+#endif
+
+			case 'B':
+				config.backend = optarg;
+				if (!transport_find(config.backend)) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'S':
+				config.sim_params = optarg;
+				break;
+
+			case 'H':
+				config.histogram = 1;
+				break;
+
+			case 'K':
+				config.batch = strtoul(optarg, NULL, 0);
+				if (config.batch < 1 || config.batch > MAX_BATCH) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'O':
+				config.odp = 1;
+				break;
+
+			case 'C':
+				config.reg_chunk = strtoull(optarg, NULL, 0);
+				break;
+
+			case 'P':
+				config.pf_lines = strtoul(optarg, NULL, 0);
+				if (config.pf_lines < 1 || config.pf_lines > MAX_PF_LINES) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'W':
+				config.ddio_max = strtoull(optarg, NULL, 0);
+				break;
+
+			case 'T':
+				config.telemetry = optarg;
+				break;
+
+			case 'b':
+				config.block = strtoul(optarg, NULL, 0);
+				if (config.block < 1) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'F':
+				config.freq_tol = strtod(optarg, NULL);
+				if (config.freq_tol <= 0) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'L':
+				config.low_noise = 1;
+				break;
+
+			case 'o':
+				config.output = optarg;
+				break;
+
+			case 't':
+				if (!strcmp(optarg, "fenced"))
+					config.tsc = TSC_FENCED;
+				else if (!strcmp(optarg, "rdtscp"))
+					config.tsc = TSC_RDTSCP;
+				else {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'M':
+				config.heatmap = optarg;
+				break;
+
+			case 'e':
+				config.seed = strtoull(optarg, NULL, 0);
+				break;
+
+			case 'a':
+				config.record = optarg;
+				break;
+
+			case 'A':
+				config.replay = optarg;
+				break;
+
+			case 'G':
+				config.oracle = 1;
+				break;
+
+			case 'x':
+				config.contention = optarg;
+				break;
+
+			case 'Y':
+				config.clock = optarg;
+				break;
+
+			case 'E':
+				config.calibration = strtoul(optarg, NULL, 0);
+				break;
+
 			default:
 				usage(argv[0]);
 				return 1;
@@ -480,8 +710,71 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* the in-process backends are their own server */
+	if (strcmp(config.backend, verbs_transport.name) && !config.server_name)
+		config.server_name = (char *) config.backend;
+
+	if (config.daemon && config.server_name) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* a replay runs in the mode it was recorded in, which the server is told when connecting */
+	if (config.replay) {
+		if (!config.server_name || config.record) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (pattern_replay(&pattern, config.replay, &config.seed))
+			return 1;
+		config.mode = pattern.mode;
+		if (config.mode == 1 || config.mode == 2 || config.mode == 5)
+			config.iters = pattern.count;
+	}
+
+	/* only the client walks a pattern, and the sweeps have none */
+	if (config.record && (!config.server_name || config.mode == 3 || config.mode == 4)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* a batch is only served on the client, and only modes 0, 1 and 4 walk many lines,
+	 * the oracle labels one read at a time */
+	if (config.batch > 1 && (!config.server_name || config.mode == 2 || config.mode == 3 || config.mode == 5 || config.oracle)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* registration options are the server's, and no probe may straddle two chunks */
+	if ((config.odp || config.reg_chunk) && config.server_name) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (config.reg_chunk % sysconf(_SC_PAGESIZE) || config.reg_chunk % config.msg_size) {
+		fprintf(stderr, "--reg-chunk must be a multiple of the page size and of --msg-size\n");
+		return 1;
+	}
+
+	/* the low-noise profile picks its own CPU, and only the client has samples */
+	if ((config.low_noise || config.output || config.heatmap || config.oracle || config.clock) && !config.server_name) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* the server's LLC is loaded, the local backend's server is this machine */
+	if (config.contention && config.server_name && strcmp(config.backend, local_transport.name)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (config.contention) {
+		/* started before the client pins itself, so the threads keep off its CPU */
+		contention = contention_start(config.contention);
+		if (!contention)
+			return 1;
+	}
+
 	/* set cpu affinity for client */
-	if (config.server_name) {
+	if (config.server_name && !config.low_noise) {
 		cpu_set_t s;
 		CPU_ZERO(&s);
 		CPU_SET(sched_getcpu(), &s);
@@ -493,126 +786,291 @@ int main(int argc, char *argv[])
 
 	/* init all of the resources, so cleanup will be easy */
 	resources_init(&res);
+	res.transport = transport_find(config.backend);
 
-	/* create resources before using them */
-	if (resources_create(&res)) {
-		fprintf(stderr, "failed to create resources\n");
-		goto main_exit;
+	/* the server owns the buffer, it is sized from the server's LLC */
+	if (!config.server_name) {
+		topology_read(&server_cache);
+		topology_size_buffer(&server_cache);
 	}
 
-	/* connect the QPs */
-	if (connect_qp(&res)) {
-		fprintf(stderr, "failed to connect QPs\n");
+	if (config.daemon) {
+		rc = server_daemon(&res);
 		goto main_exit;
 	}
 
-	/* let the server post the sr */
-	if (!config.server_name)
-		if (post_send(&res, IBV_WR_SEND)) {
-			fprintf(stderr, "failed to post sr\n");
-			goto main_exit;
+	if (res.transport->create(&res))
+		goto main_exit;
+
+	/* the server side only answers the client's syncs */
+	if (!config.server_name) {
+		rc = server_session(&res, &report);
+		if (!rc && report.samples) {
+			fprintf(stderr, "[Server] ");
+			session_report_print(stderr, &report);
 		}
+		goto main_exit;
+	}
 
-	/* in both sides we expect to get a completion */
-	if (poll_completion(&res)) {
+	/* expect the server's SEND */
+	if (res.transport->poll_completion(&res)) {
 		fprintf(stderr, "poll completion failed\n");
 		goto main_exit;
 	}
 
 	/* after polling the completion we have the message in the client buffer too */
-	if (config.server_name)
-		debug_print("[Client only] Message is: '%hhu'\n", res.buf[0]);
+	debug_print("[Client only] Message is: '%hhu'\n", res.buf[0]);
 
 	/* Sync so we are sure server side has data ready before client tries to read it */
-	if (sock_sync_data(res.sock, 1, "R", &temp_char)) {  /* just send a dummy char back and forth */
+	if (transport_sync(&res, 1, "R", &temp_char)) {  /* just send a dummy char back and forth */
 		fprintf(stderr, "sync error before RDMA ops\n");
 		rc = 1;
 		goto main_exit;
 	}
 
-	if (config.server_name)
-		debug_print("Beginning tests...\n----------------------------\n\n");
+	/* the server's oracle is up, the server says where its doorbell is */
+	if (config.oracle) {
+		struct doorbell_wire none = { 0 }, wire;
+
+		if (transport_sync(&res, sizeof(wire), (char *) &none, (char *) &wire) || doorbell_attach(&res, &wire, &res.oracle)) {
+			fprintf(stderr, "failed to reach the residency oracle\n");
+			rc = 1;
+			goto main_exit;
+		}
+		if (!res.oracle && !res.transport->last_hit)
+			fprintf(stderr, "the %s backend has no residency oracle, reads are not labelled\n", res.transport->name);
+	}
+
+	/* and where its TSC is */
+	if (config.clock) {
+		struct doorbell_wire none = { 0 }, wire;
+
+		if (transport_sync(&res, sizeof(wire), (char *) &none, (char *) &wire) || clocksync_attach(&res, &wire)) {
+			fprintf(stderr, "failed to reach the server's clock\n");
+			rc = 1;
+			goto main_exit;
+		}
+		if (!res.clock)
+			fprintf(stderr, "the %s backend runs on this machine's clock, there is nothing to align\n", res.transport->name);
+	}
+
+	/* in mode 5 the server's eviction helper is up, the server says where its doorbell is */
+	if (config.mode == 5) {
+		struct doorbell_wire none = { 0 }, wire;
+
+		if (transport_sync(&res, sizeof(wire), (char *) &none, (char *) &wire) || doorbell_attach(&res, &wire, &res.evict)) {
+			fprintf(stderr, "failed to reach the eviction helper\n");
+			rc = 1;
+			goto main_exit;
+		}
+	}
+
+	debug_print("Beginning tests...\n----------------------------\n\n");
+
+	/* everything large is allocated by now, the clock is measured on the CPU we end up on */
+	if (config.low_noise)
+		lownoise_enter(&lownoise, config.dev_name);
 
 	double cycles_to_usec = get_cpu_mhz(false);
 
+	stats_init(&read1_stats);
+	stats_init(&read2_stats);
+	hist_init(&hist);
+	hist_init(&truth);
+	stats_init(&odp_stats[0]);
+	stats_init(&odp_stats[1]);
+
+	/* known misses and hits first, the samples go out under what they took */
+	if (config.calibration) {
+		if (calibration_run(&res, config.calibration, &calibration)) {
+			rc = 1;
+			goto main_exit;
+		}
+		print_calibration(stderr, cycles_to_usec);
+	}
+	calibration_header(&calibration, header, sizeof(header), cycles_to_usec);
+
+	if (config.output) {
+		trace = trace_open(config.output, header, cycles_to_usec);
+		if (!trace) {
+			rc = 1;
+			goto main_exit;
+		}
+		sink = sink_trace;
+	} else
+		data_print("%s", header);
+
+	if (res.remote_mrs.flags & MR_TABLE_ODP) {
+		size_t size = buffer_size();
+
+		odp_page_size = sysconf(_SC_PAGESIZE);
+		odp_touched = calloc((size / odp_page_size + 64) / 64, sizeof(uint64_t));
+		if (!odp_touched) {
+			fprintf(stderr, "failed to allocate the page map of the on-demand server buffer\n");
+			rc = 1;
+			goto main_exit;
+		}
+	}
+	for (i = 0; i < MAX_BATCH; i++) {
+		stats_init(&position_stats[0][i]);
+		stats_init(&position_stats[1][i]);
+	}
+
 	/*  Now the client performs an RDMA read and then write on server.
 	 *  Note that the server has no idea these events have occured */
-	if (config.server_name) {
-		start_addr = res.remote_props.addr;
-
-		switch (config.mode) {
-			case 0: /* seq */
-				for (i = 0; i < config.column_count; ++i) {
-					for (j = 0; j < config.row_count; ++j) {
-						/* index into the row we want */
-						target_addr = start_addr + j * (config.column_count * config.msg_size);
-						/* index into the column we want */
-						target_addr += i * config.msg_size;
-
-						if (read_write_read(&res, target_addr, cycles_to_usec)) {
-							rc = 1;
-							goto main_exit;
-						}
-					}
-				}
-				break;
+	start_addr = res.remote_props.addr;
 
-			case 1: /* rand */
-				for (i = 0; i < config.iters; ++i) {
-					if (read_write_read(&res, start_addr + rand_line(), cycles_to_usec)) {
-						rc = 1;
-						goto main_exit;
-					}
+	if (config.heatmap) {
+		heatmap = heatmap_open(start_addr, buffer_size(), topology_line(&server_cache));
+		if (!heatmap) {
+			rc = 1;
+			goto main_exit;
+		}
+		heatmap->threshold = calibration.cutoff.threshold;
+	}
 
-					if (i == CACHE_LINES) {
-						memset(bm, 0, sizeof(bm));
-					}
-				}
-				break;
+	pattern_seed(config.seed);
 
-			case 2: /* single byte */
-				for (i = 0; i < config.iters; ++i) {
-					if (read_write_read(&res, start_addr, cycles_to_usec)) {
-						rc = 1;
-						goto main_exit;
-					}
-
-					if (sock_sync_data(res.sock, 1, "A", &temp_char)) {  /* just send a dummy char back and forth */
-						fprintf(stderr, "sync error after RDMA ops\n");
-						rc = 1;
-						goto main_exit;
-					}
-
-					if (sock_sync_data(res.sock, 1, "B", &temp_char)) {  /* just send a dummy char back and forth */
-						fprintf(stderr, "sync error after RDMA ops\n");
-						rc = 1;
-						goto main_exit;
-					}
-				}
-				break;
+	if (clocksync_estimate(&res, 0)) {
+		rc = 1;
+		goto main_exit;
+	}
+
+	if (config.mode == 3) {
+		struct sweep_stats out = { &read1_stats, &read2_stats, &hist };
+
+		if (prefetch_sweep(&res, &out, cycles_to_usec)) {
+			rc = 1;
+			goto main_exit;
+		}
+	}
+
+	if (config.mode == 4) {
+		struct sweep_stats out = { &read1_stats, &read2_stats, &hist };
+
+		if (ddio_sweep(&res, &out, cycles_to_usec)) {
+			rc = 1;
+			goto main_exit;
+		}
+	}
+
+	if (config.replay ? !pattern_fits(&pattern, buffer_size()) : pattern_init(&pattern, config.mode)) {
+		rc = 1;
+		goto main_exit;
+	}
+	if (config.record && pattern_record(&pattern, config.record, config.seed)) {
+		rc = 1;
+		goto main_exit;
+	}
+
+	/* after the calibration and the sweeps, so block 0 is the first config.block samples */
+	if (config.telemetry) {
+		telemetry = telemetry_open(sched_getcpu(), cycles_to_usec, pattern.count / config.block + 1);
+		if (!telemetry) {
+			fprintf(stderr, "failed to allocate telemetry\n");
+			rc = 1;
+			goto main_exit;
+		}
+	}
+	while (config.batch > 1) {
+		for (n = 0; n < config.batch && pattern_next(&pattern, &offset); n++)
+			addrs[n] = start_addr + offset;
+		if (!n)
+			break;
+
+		if (read_write_read_batch(&res, addrs, n, cycles_to_usec)) {
+			rc = 1;
+			goto main_exit;
 		}
 	}
-	else if (config.mode == 2) {
-		for (i = 0; i < config.iters; ++i) {
-			if (sock_sync_data(res.sock, 1, "A", &temp_char)) {  /* just send a dummy char back and forth */
-				fprintf(stderr, "sync error after RDMA ops\n");
-				rc = 1;
-				goto main_exit;
-			}
 
-			_mm_clflush(res.buf);
-			_mm_mfence();
+	while (pattern_next(&pattern, &offset)) {
+		if (read_write_read(&res, start_addr + offset, cycles_to_usec)) {
+			rc = 1;
+			goto main_exit;
+		}
 
-			if (sock_sync_data(res.sock, 1, "B", &temp_char)) {  /* just send a dummy char back and forth */
-				fprintf(stderr, "sync error after RDMA ops\n");
+		/* the helper evicts the line on the server, no sync needed */
+		if (config.mode == 5) {
+			if (transport_evict(&res, start_addr + offset)) {
 				rc = 1;
 				goto main_exit;
 			}
+			continue;
+		}
+
+		if (config.mode != 2)
+			continue;
+
+		if (transport_sync(&res, 1, "A", &temp_char)) {  /* just send a dummy char back and forth */
+			fprintf(stderr, "sync error after RDMA ops\n");
+			rc = 1;
+			goto main_exit;
+		}
+
+		if (transport_sync(&res, 1, "B", &temp_char)) {  /* just send a dummy char back and forth */
+			fprintf(stderr, "sync error after RDMA ops\n");
+			rc = 1;
+			goto main_exit;
+		}
+	}
+
+	if (pattern_close(&pattern) || clocksync_estimate(&res, samples_recorded)) {
+		rc = 1;
+		goto main_exit;
+	}
+
+	/* every sample is on disk before the summaries */
+	rc = trace_close(trace);
+	trace = NULL;
+	sink = sink_stdout;
+	if (rc)
+		goto main_exit;
+
+	if (config.histogram) {
+		hist_classify(&hist, &classifier);
+		hist_print(stderr, &hist, &classifier, cycles_to_usec);
+	}
+
+	if (truth.total[0] || truth.total[1])
+		print_truth(stderr, cycles_to_usec);
+
+	if (position_stats[0][0].count)
+		print_batch_positions(stderr, cycles_to_usec);
+
+	if (telemetry) {
+		/* the last block is usually short */
+		if (samples_recorded % config.block)
+			telemetry_block(telemetry, samples_recorded - samples_recorded % config.block, samples_recorded % config.block);
+		if (telemetry_finish(telemetry, config.telemetry, config.freq_tol / 100)) {
+			rc = 1;
+			goto main_exit;
 		}
 	}
 
+	if (heatmap && heatmap_write(heatmap, config.heatmap)) {
+		rc = 1;
+		goto main_exit;
+	}
+
+	if (config.clock && clocksync_finish(&res, config.clock)) {
+		rc = 1;
+		goto main_exit;
+	}
+
+	if (odp_stats[0].count)
+		fprintf(stderr, "%lu first touches of on-demand server pages left out: read1=%.1f read2=%.1f ns\n",
+				odp_stats[0].count, odp_stats[0].mean * 1000 / cycles_to_usec, odp_stats[1].mean * 1000 / cycles_to_usec);
+
+	/* hand our statistics to the server */
+	session_report_fill(&report, &read1_stats, &read2_stats, cycles_to_usec);
+	if (session_report_exchange(&res, &report, &report)) {
+		rc = 1;
+		goto main_exit;
+	}
+
 	/* Sync so server will know that client is done mucking with its memory */
-	if (sock_sync_data(res.sock, 1, "W", &temp_char)) {  /* just send a dummy char back and forth */
+	if (transport_sync(&res, 1, "W", &temp_char)) {  /* just send a dummy char back and forth */
 		fprintf(stderr, "sync error after RDMA ops\n");
 		rc = 1;
 		goto main_exit;
@@ -621,7 +1079,10 @@ int main(int argc, char *argv[])
 	rc = 0;
 
 main_exit:
-	if (resources_destroy(&res)) {
+	/* timeouts and bad completions end the run, say how many there were */
+	cq_stats_print(stderr);
+
+	if (res.transport && res.transport->destroy(&res)) {
 		fprintf(stderr, "failed to destroy resources\n");
 		rc = 1;
 	}
@@ -629,6 +1090,14 @@ main_exit:
 	if(config.dev_name)
 		free((char *) config.dev_name);
 
+	free(odp_touched);
+	telemetry_close(telemetry);
+	trace_close(trace);
+	heatmap_close(heatmap);
+	pattern_close(&pattern);
+	lownoise_leave(&lownoise);
+	contention_stop(contention);
+
 	debug_print("\ntest result is %d\n", rc);
 
 	return rc;
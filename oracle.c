@@ -0,0 +1,183 @@
+/* vim: set noet: */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <emmintrin.h>
+
+#include "oracle.h"
+#include "get_clock.h"
+
+struct oracle {
+	struct resources	*res;
+	struct doorbell		bell;
+	pthread_t		thread;
+	atomic_int		stop;
+	int			started;
+	uint64_t		threshold;	/* cycles, loads below it are hits */
+	uint64_t		labels[2];	/* misses and hits answered */
+};
+
+
+static inline uint64_t oracle_time(const char *p)
+{
+	uint64_t start = start_tsc();
+
+	(void) *(volatile const char *) p;
+	return stop_tsc() - start;
+}
+
+
+static int cycles_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* Halfway between the median flushed and median LLC load of a line of our
+ * own. For the latter the line is touched and then pushed out of this
+ * core's L1 and L2 by a walk of ORACLE_PRIVATE_WALK, as the lines the NIC
+ * writes are in the LLC but never in the helper's private caches. The line
+ * has a page to itself and its far half is read before each timed load, so
+ * neither load pays for a TLB miss the walk left behind. */
+static int oracle_calibrate(struct oracle *o)
+{
+	uint64_t	*cold, *warm;
+	char		*line, *walk = NULL;
+	size_t		off;
+	int		i, rc = 1;
+
+	cold = calloc(ORACLE_CALIBRATION, sizeof(*cold));
+	warm = calloc(ORACLE_CALIBRATION, sizeof(*warm));
+	line = aligned_alloc(4096, 4096);
+	walk = aligned_alloc(64, ORACLE_PRIVATE_WALK);
+	if (!cold || !warm || !line || !walk)
+		goto oracle_calibrate_exit;
+	memset(line, 1, 4096);
+	memset(walk, 1, ORACLE_PRIVATE_WALK);
+
+	for (i = 0; i < ORACLE_CALIBRATION; i++) {
+		_mm_clflush(line);
+		_mm_mfence();
+		(void) *(volatile const char *) (line + 2048);
+		_mm_mfence();
+		cold[i] = oracle_time(line);
+
+		for (off = 0; off < ORACLE_PRIVATE_WALK; off += 64)
+			(void) *(volatile const char *) (walk + off);
+		(void) *(volatile const char *) (line + 2048);
+		_mm_mfence();
+		warm[i] = oracle_time(line);
+	}
+
+	qsort(cold, ORACLE_CALIBRATION, sizeof(*cold), cycles_cmp);
+	qsort(warm, ORACLE_CALIBRATION, sizeof(*warm), cycles_cmp);
+	o->threshold = (cold[ORACLE_CALIBRATION / 2] + warm[ORACLE_CALIBRATION / 2]) / 2;
+	debug_print("[Server] oracle: flushed loads %lu cycles, from the LLC %lu, threshold %lu\n",
+			cold[ORACLE_CALIBRATION / 2], warm[ORACLE_CALIBRATION / 2], o->threshold);
+	rc = 0;
+
+oracle_calibrate_exit:
+	free(walk);
+	free(line);
+	free(warm);
+	free(cold);
+	return rc;
+}
+
+
+static void *oracle_thread(void *arg)
+{
+	struct oracle	*o = arg;
+	uint64_t	offset, cycles;
+	int		hit;
+
+	while (!atomic_load_explicit(&o->stop, memory_order_relaxed)) {
+		if (!doorbell_poll(&o->bell, &offset)) {
+			_mm_pause();
+			continue;
+		}
+
+		if (offset >= o->res->size) {
+			doorbell_answer(&o->bell, ORACLE_NONE);
+			continue;
+		}
+
+		cycles = oracle_time(o->res->buf + offset);
+		hit = cycles < o->threshold;
+		o->labels[hit]++;
+		doorbell_answer(&o->bell, cycles | (hit ? ORACLE_HIT : 0));
+	}
+
+	return NULL;
+}
+
+
+struct oracle *oracle_start(struct resources *res, struct doorbell_wire *wire)
+{
+	struct oracle *o;
+
+	o = calloc(1, sizeof(*o));
+	if (!o)
+		return NULL;
+	o->res = res;
+
+	/* before the client has the doorbell, so the first request finds the threshold */
+	if (oracle_calibrate(o)) {
+		fprintf(stderr, "failed to calibrate the residency oracle\n");
+		goto oracle_start_fail;
+	}
+	if (doorbell_open(&o->bell, res, wire))
+		goto oracle_start_fail;
+
+	if (pthread_create(&o->thread, NULL, oracle_thread, o)) {
+		fprintf(stderr, "failed to start the residency oracle\n");
+		goto oracle_start_fail;
+	}
+	o->started = 1;
+
+	return o;
+
+oracle_start_fail:
+	oracle_stop(o);
+	return NULL;
+}
+
+
+int oracle_stop(struct oracle *o)
+{
+	int rc = 0;
+
+	if (!o)
+		return 0;
+
+	if (o->started) {
+		atomic_store(&o->stop, 1);
+		pthread_join(o->thread, NULL);
+		debug_print("[Server] oracle labelled %lu hits and %lu misses\n", o->labels[1], o->labels[0]);
+	}
+	if (doorbell_close(&o->bell))
+		rc = 1;
+
+	free(o);
+	return rc;
+}
+
+
+int oracle_last_hit(struct resources *res)
+{
+	uint64_t answer;
+
+	if (!res->oracle)
+		return -1;
+
+	/* a failed ring has said so, the sample goes unlabelled */
+	if (doorbell_ring(res, res->oracle, res->remote_props.addr - res->remote_mrs.base, &answer) || answer == ORACLE_NONE)
+		return -1;
+
+	return !!(answer & ORACLE_HIT);
+}
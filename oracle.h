@@ -0,0 +1,75 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Residency oracle
+ *
+ * Ground truth for the verbs backend, which otherwise has none: nothing
+ * says whether a slow read really was a miss. With -G the server starts a
+ * helper thread with a doorbell (doorbell.h), and the client rings it
+ * right after a read with the line's offset. The helper times one load of
+ * the line itself and answers with the cycles it took and whether that is
+ * below its threshold, a hit.
+ *
+ * The threshold is placed when the helper starts, halfway between the
+ * median load of a line just flushed and the median load of the same line
+ * once it was read and pushed out of the helper's L1 and L2, each timed
+ * ORACLE_CALIBRATION times on the helper's CPU. Lines the NIC wrote are in
+ * the LLC at best, never in the helper's private caches.
+ *
+ * The label is the line's state after the read. NIC reads are served from
+ * the LLC when the line is there and from memory without allocating in the
+ * LLC when it is not, so that is also its state before the read. The
+ * helper's own load brings the line in though, so a label taken after the
+ * first read would make the second read's label a hit by construction. The
+ * client has one read of each sample labelled, the first and the second in
+ * turn, and the other one's label is -1.
+ *
+ * On the client the labels are the verbs backend's last_hit, so they go
+ * wherever the sim backend's ground truth goes: the hit1 and hit2 columns
+ * of the samples, the heatmap and the sweeps.
+ *
+ * ******************************************************************************/
+
+#ifndef ORACLE_H_
+#define ORACLE_H_
+
+#include <stdint.h>
+
+#include "resources.h"
+#include "doorbell.h"
+
+/* loads of each kind timed to place the threshold */
+#define ORACLE_CALIBRATION	1024
+
+/* the walk that pushes the calibration line out to the LLC, more than any
+ * core's L1 and L2 and little enough for the line to stay in the LLC */
+#define ORACLE_PRIVATE_WALK	(4 << 20)
+
+/* in an answer, the line was resident, the rest is the load's cycles */
+#define ORACLE_HIT		(1ull << 63)
+
+/* the answer for an offset outside the server's buffer */
+#define ORACLE_NONE		(~0ull)
+
+struct oracle;
+
+/******************************************************************************
+ * *	Function: oracle_start
+ * *
+ * *	Input
+ * *	res	server resources of the session, connected
+ * *
+ * *	Output
+ * *	wire	doorbell address and rkey in network byte order, for the client
+ * *
+ * *	Returns
+ * *	the running oracle, NULL on failure
+ * ******************************************************************************/
+struct oracle *oracle_start(struct resources *res, struct doorbell_wire *wire);
+
+/* stop the oracle and release it, 0 on success */
+int oracle_stop(struct oracle *o);
+
+/* the verbs backend's last_hit: the oracle's label of the line just probed, -1 without an oracle */
+int oracle_last_hit(struct resources *res);
+
+#endif // ORACLE_H_
@@ -0,0 +1,309 @@
+/* vim: set noet: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "resources.h"
+#include "pattern.h"
+#include "topology.h"
+
+#define BM_BITS_PER_WORD (sizeof(uint64_t) * CHAR_BIT)
+
+#define TRACE_MAGIC	"RCADDR1"
+
+/* head of a recorded address sequence, the offsets follow from TRACE_DATA on */
+struct pattern_file {
+	char		magic[8];	/* TRACE_MAGIC */
+	uint64_t	seed;
+	uint64_t	count;		/* offsets in the file */
+	uint64_t	row_count;
+	uint64_t	column_count;
+	uint32_t	mode;
+	uint32_t	msg_size;
+	uint32_t	line_size;
+	uint32_t	reserved[3];
+} __attribute__((packed));
+
+#define TRACE_DATA		64
+#define TRACE_FILE_SIZE(count)	(TRACE_DATA + (count) * sizeof(uint64_t))
+
+_Static_assert(sizeof(struct pattern_file) <= TRACE_DATA, "trace header overlaps the offsets");
+
+/* the generator rand mode draws from, xorshift64* like the simulator's */
+static uint64_t rng = 1;
+
+/* lines rand_line has handed out since the last reset, grown to the buffer's lines by pattern_init */
+static uint64_t *bm;
+static uint64_t bm_words;
+static uint64_t bm_used;
+#define WORD_OFFSET(b) ((b) / BM_BITS_PER_WORD)
+#define BIT_OFFSET(b)  ((b) % BM_BITS_PER_WORD)
+
+static void bm_set(uint64_t addr) {
+	bm[WORD_OFFSET(addr)] |= 1ull << BIT_OFFSET(addr);
+}
+
+static bool bm_read(uint64_t addr) {
+	return (bm[WORD_OFFSET(addr)] & (1ull << BIT_OFFSET(addr))) != 0;
+}
+
+/* a number below n */
+static uint64_t rand_below(uint64_t n) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (rng * 0x2545f4914f6cdd1dull) % n;
+}
+
+
+void pattern_seed(uint64_t seed)
+{
+	/* xorshift never leaves 0 */
+	rng = seed ? seed : 1;
+}
+
+/* a line out of the first `lines` that has not been used since the last reset */
+static uint64_t rand_line(uint64_t lines) {
+	uint64_t r;
+
+	/* start over once every line has been used, the search below would never end */
+	if (bm_used == lines) {
+		memset(bm, 0, bm_words * sizeof(*bm));
+		bm_used = 0;
+	}
+
+	while (bm_read(r = rand_below(lines)));
+	bm_set(r);
+	bm_used++;
+	return r;
+}
+
+
+int pattern_init(struct pattern *p, int mode)
+{
+	uint64_t	words;
+	uint64_t	*grown;
+
+	memset(p, 0, sizeof(*p));
+	p->mode = mode;
+	if (mode == 0)
+		p->count = (uint64_t) config.row_count * config.column_count;
+	else if (mode <= 2 || mode == 5)
+		p->count = config.iters;
+	else
+		p->count = 0;
+
+	/* rand picks from every line of the buffer, at the server's line size */
+	p->line_size = topology_line(&server_cache);
+	p->lines = buffer_size() / p->line_size;
+	if (!p->lines)
+		p->lines = 1;
+
+	words = (p->lines + BM_BITS_PER_WORD - 1) / BM_BITS_PER_WORD;
+	if (words > bm_words) {
+		grown = realloc(bm, words * sizeof(*bm));
+		if (!grown) {
+			fprintf(stderr, "failed to allocate the line map of %lu lines\n", p->lines);
+			return 1;
+		}
+		bm = grown;
+		bm_words = words;
+	}
+	memset(bm, 0, bm_words * sizeof(*bm));
+	bm_used = 0;
+
+	return 0;
+}
+
+
+int pattern_next(struct pattern *p, uint64_t *offset)
+{
+	uint64_t row, column;
+
+	if (p->next == p->count)
+		return 0;
+
+	if (p->replay) {
+		*offset = p->replay[p->next++];
+		return 1;
+	}
+
+	switch (p->mode) {
+		case 0: /* seq */
+			column = p->next / config.row_count;
+			row = p->next % config.row_count;
+			/* index into the row we want, then into the column */
+			*offset = row * (config.column_count * config.msg_size) + column * config.msg_size;
+			break;
+
+		case 1: /* rand */
+			*offset = rand_line(p->lines) * p->line_size;
+			break;
+
+		default: /* single line */
+			*offset = 0;
+			break;
+	}
+
+	if (p->record)
+		p->record[p->next] = *offset;
+
+	p->next++;
+	return 1;
+}
+
+
+/* map a trace file of count offsets, writable when it is being recorded */
+static struct pattern_file *pattern_map(struct pattern *p, int fd, uint64_t count, int writable)
+{
+	void *map;
+
+	p->map_size = TRACE_FILE_SIZE(count);
+	/* populated up front, so no probe takes a page fault on the trace */
+	map = mmap(NULL, p->map_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	madvise(map, p->map_size, MADV_SEQUENTIAL);
+
+	p->map = map;
+	return map;
+}
+
+
+int pattern_record(struct pattern *p, const char *path, uint64_t seed)
+{
+	struct pattern_file	*f;
+	int			fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	if (ftruncate(fd, TRACE_FILE_SIZE(p->count)) || !(f = pattern_map(p, fd, p->count, 1))) {
+		fprintf(stderr, "failed to set up %s for %lu offsets\n", path, p->count);
+		close(fd);
+		return 1;
+	}
+	p->fd = fd;
+
+	memcpy(f->magic, TRACE_MAGIC, sizeof(f->magic));
+	f->seed = seed;
+	f->mode = p->mode;
+	f->msg_size = config.msg_size;
+	f->line_size = p->line_size;
+	f->row_count = config.row_count;
+	f->column_count = config.column_count;
+	p->record = (uint64_t *) ((char *) f + TRACE_DATA);
+
+	return 0;
+}
+
+
+int pattern_replay(struct pattern *p, const char *path, uint64_t *seed)
+{
+	struct pattern_file	head;
+	struct stat		st;
+	uint64_t		count;
+	int			fd;
+
+	memset(p, 0, sizeof(*p));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	if (read(fd, &head, sizeof(head)) != sizeof(head) || memcmp(head.magic, TRACE_MAGIC, sizeof(head.magic)) || fstat(fd, &st)) {
+		fprintf(stderr, "%s is not a recorded address sequence\n", path);
+		close(fd);
+		return 1;
+	}
+
+	count = head.count;
+	if (!count || (uint64_t) st.st_size < TRACE_FILE_SIZE(count)) {
+		fprintf(stderr, "%s holds %lu offsets but is only %ld bytes\n", path, count, (long) st.st_size);
+		close(fd);
+		return 1;
+	}
+
+	/* only the modes pattern_record takes, the sweeps have no sequence */
+	if (head.mode != 0 && head.mode != 1 && head.mode != 2 && head.mode != 5) {
+		fprintf(stderr, "%s was recorded in mode %u, which has no address sequence\n", path, head.mode);
+		close(fd);
+		return 1;
+	}
+
+	if (!pattern_map(p, fd, count, 0)) {
+		close(fd);
+		return 1;
+	}
+	p->fd = fd;
+
+	p->mode = head.mode;
+	p->count = count;
+	p->line_size = head.line_size;
+	p->replay = (const uint64_t *) ((char *) p->map + TRACE_DATA);
+	*seed = head.seed;
+
+	if (head.msg_size != config.msg_size)
+		fprintf(stderr, "%s was recorded with msg_size %u, replaying with %u\n", path, head.msg_size, config.msg_size);
+
+	return 0;
+}
+
+
+int pattern_fits(const struct pattern *p, uint64_t size)
+{
+	uint64_t i;
+
+	for (i = 0; p->replay && i < p->count; i++)
+		if (p->replay[i] + config.msg_size > size) {
+			fprintf(stderr, "replayed offset %lu (sample %lu) is past the %lu byte buffer\n", p->replay[i], i, size);
+			return 0;
+		}
+
+	return 1;
+}
+
+
+int pattern_close(struct pattern *p)
+{
+	struct pattern_file	*f = p->map;
+	int			rc = 0;
+
+	if (!p->map)
+		return 0;
+
+	/* a run that stopped early keeps only what it probed */
+	if (p->record) {
+		p->count = p->next;
+		f->count = p->count;
+	}
+
+	if (p->record && msync(p->map, p->map_size, MS_SYNC)) {
+		perror("msync");
+		rc = 1;
+	}
+	munmap(p->map, p->map_size);
+	if (p->record && ftruncate(p->fd, TRACE_FILE_SIZE(p->count))) {
+		perror("ftruncate");
+		rc = 1;
+	}
+	close(p->fd);
+
+	p->map = NULL;
+	p->record = NULL;
+	p->replay = NULL;
+	return rc;
+}
@@ -0,0 +1,127 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Address patterns
+ *
+ * The order in which the client visits lines of the server's buffer, given
+ * as byte offsets from its start:
+ *
+ *	0, seq		every msg_size column of every row, column by column,
+ *			so consecutive probes are a row apart
+ *	1, rand		iters distinct random lines of the whole buffer, at the
+ *			server's cache line size, starting over once every line
+ *			has been used
+ *	2, clflush	the first line, iters times
+ *	5, evict	the first line, iters times, as clflush
+ *
+ * The sweeps (see sweep.h) pick their own lines, their pattern is empty.
+ *
+ * rand draws from its own generator, seeded with pattern_seed. Any of the
+ * three can be recorded as it is walked, seed and offsets, into a file that
+ * pattern_replay later maps and walks again in the same order, on this host
+ * or another, without generating anything on the way.
+ *
+ * The remote modes and the local backend walk the same patterns.
+ *
+ * ******************************************************************************/
+
+#ifndef PATTERN_H_
+#define PATTERN_H_
+
+#include <stdint.h>
+
+/* line size rand falls back to when the server's is unknown */
+#define CACHE_SIZE 64
+
+struct pattern {
+	int		mode;
+	uint64_t	next;	/* index of the next offset */
+	uint64_t	count;	/* number of offsets in the pattern, may be changed before the first pattern_next */
+	uint64_t	lines;	/* lines rand picks from */
+	uint32_t	line_size;
+
+	/* recording or replaying a trace file */
+	uint64_t	*record;	/* where pattern_next stores each offset, NULL when not recording */
+	const uint64_t	*replay;	/* the offsets pattern_next hands out, NULL when not replaying */
+	void		*map;
+	size_t		map_size;
+	int		fd;
+};
+
+/* seed the generator of rand, once before the first pattern_init */
+void pattern_seed(uint64_t seed);
+
+/******************************************************************************
+ * *	Function: pattern_init
+ * *
+ * *	Input
+ * *	mode	0 for seq, 1 for rand, 2 for clflush or 5 for evict, anything
+ * *		else is empty
+ * *
+ * *	Output
+ * *	p	pattern positioned at its first offset, sized from config
+ * *
+ * *	Returns
+ * *	0 on success, 1 if the map of the lines rand has used could not be
+ * *	allocated
+ * ******************************************************************************/
+int pattern_init(struct pattern *p, int mode);
+
+/******************************************************************************
+ * *	Function: pattern_next
+ * *
+ * *	Input
+ * *	p	pattern from pattern_init
+ * *
+ * *	Output
+ * *	offset	byte offset of the next line to probe
+ * *
+ * *	Returns
+ * *	1 if offset was set, 0 when the pattern is exhausted
+ * ******************************************************************************/
+int pattern_next(struct pattern *p, uint64_t *offset);
+
+/******************************************************************************
+ * *	Function: pattern_record
+ * *
+ * *	Input
+ * *	p	pattern from pattern_init, not yet walked
+ * *	path	file to record it to
+ * *	seed	seed rand was given, kept in the file for reference
+ * *
+ * *	Returns
+ * *	0 on success, 1 if path could not be created and mapped
+ * *
+ * *	Description
+ * *	The file is sized for every offset and mapped up front, pattern_next
+ * *	only stores into it. pattern_close cuts it to the offsets walked.
+ * ******************************************************************************/
+int pattern_record(struct pattern *p, const char *path, uint64_t seed);
+
+/******************************************************************************
+ * *	Function: pattern_replay
+ * *
+ * *	Input
+ * *	path	file from pattern_record
+ * *
+ * *	Output
+ * *	p	pattern walking the recorded offsets, with the recorded mode
+ * *	seed	seed of the recorded run
+ * *
+ * *	Returns
+ * *	0 on success, 1 if path is not a readable recording or was recorded
+ * *	in a mode without an address sequence
+ * *
+ * *	Description
+ * *	Used instead of pattern_init. The mode is known before connecting, so
+ * *	the server can be told; whether the offsets fit the server's buffer
+ * *	is only known after, see pattern_fits.
+ * ******************************************************************************/
+int pattern_replay(struct pattern *p, const char *path, uint64_t *seed);
+
+/* 1 if every replayed line lies within a buffer of size bytes */
+int pattern_fits(const struct pattern *p, uint64_t size);
+
+/* finish a recording and unmap the file, 0 on success */
+int pattern_close(struct pattern *p);
+
+#endif // PATTERN_H_
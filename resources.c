@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <arpa/inet.h>
@@ -11,24 +14,20 @@
 
 #include "resources.h"
 #include "sockets.h"
+#include "cm.h"
+#include "completion.h"
+#include "handshake.h"
+#include "doorbell.h"
+#include "clocksync.h"
 
-/******************************************************************************
- * *	Function: post_receive
- * *
- * *	Input
- * *	res	pointer to resources structure
- * *
- *  *	Output
- *  *	none
- *  *
- *  *	Returns
- *  *	0 on success, error code on failure
- *  *
- *  *	Description
- *  *
- *  ******************************************************************************/
-
-static int post_receive(struct resources *res)
+/* work request ids of the control messages, probes use 0 */
+#define CTRL_RECV_WRID	0xc0
+#define CTRL_SEND_WRID	0xc1
+
+/* largest piece of the buffer a single ibv_advise_mr sge covers */
+#define PREFETCH_SIZE	(1u << 30)
+
+int post_receive(struct resources *res)
 {
 	struct ibv_recv_wr	rr;
 	struct ibv_sge		sge;
@@ -59,6 +58,118 @@ static int post_receive(struct resources *res)
 }
 
 
+int ctrl_post_recv(struct resources *res)
+{
+	struct ibv_recv_wr	rr;
+	struct ibv_sge		sge;
+	struct ibv_recv_wr	*bad_wr;
+	int			rc;
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t)res->ctrl_buf;
+	sge.length = CTRL_MSG_SIZE;
+	sge.lkey = res->ctrl_mr->lkey;
+
+	memset(&rr, 0, sizeof(rr));
+	rr.wr_id = CTRL_RECV_WRID;
+	rr.sg_list = &sge;
+	rr.num_sge = 1;
+
+	rc = ibv_post_recv(res->qp, &rr, &bad_wr);
+	if (rc)
+		fprintf(stderr, "failed to post control RR\n");
+
+	return rc;
+}
+
+
+/* Wait for the next completion, sleeping on the completion channel */
+static int ctrl_wait_completion(struct resources *res, struct ibv_wc *wc)
+{
+	struct ibv_cq	*ev_cq;
+	void		*ev_ctx;
+	int		n;
+
+	while (1) {
+		n = ibv_poll_cq(res->cq, 1, wc);
+		if (n)
+			return n < 0 ? n : 0;
+
+		if (ibv_req_notify_cq(res->cq, 0))
+			return -1;
+
+		/* a completion may have slipped in before the notification was armed */
+		n = ibv_poll_cq(res->cq, 1, wc);
+		if (n)
+			return n < 0 ? n : 0;
+
+		if (ibv_get_cq_event(res->comp_channel, &ev_cq, &ev_ctx))
+			return -1;
+		ibv_ack_cq_events(ev_cq, 1);
+	}
+}
+
+
+int ctrl_sync(struct resources *res, int xfer_size, char *local_data, char *remote_data)
+{
+	struct ibv_send_wr	sr;
+	struct ibv_sge		sge;
+	struct ibv_send_wr	*bad_wr = NULL;
+	struct ibv_wc		wc;
+	int			sent = 0, received = 0;
+
+	if (res->sock >= 0)
+		return sock_sync_data(res->sock, xfer_size, local_data, remote_data);
+
+	if (xfer_size > CTRL_MSG_SIZE) {
+		fprintf(stderr, "control message of %d bytes exceeds %d\n", xfer_size, CTRL_MSG_SIZE);
+		return 1;
+	}
+
+	memcpy(res->ctrl_buf + CTRL_MSG_SIZE, local_data, xfer_size);
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t)(res->ctrl_buf + CTRL_MSG_SIZE);
+	sge.length = xfer_size;
+	sge.lkey = res->ctrl_mr->lkey;
+
+	memset(&sr, 0, sizeof(sr));
+	sr.wr_id = CTRL_SEND_WRID;
+	sr.sg_list = &sge;
+	sr.num_sge = 1;
+	sr.opcode = IBV_WR_SEND;
+	sr.send_flags = IBV_SEND_SIGNALED;
+
+	if (ibv_post_send(res->qp, &sr, &bad_wr)) {
+		fprintf(stderr, "failed to post control SR\n");
+		return 1;
+	}
+
+	while (!sent || !received) {
+		if (ctrl_wait_completion(res, &wc)) {
+			fprintf(stderr, "failed waiting for control completion\n");
+			return 1;
+		}
+
+		if (wc.status != IBV_WC_SUCCESS) {
+			fprintf(stderr, "got bad control completion with status: 0x%x, vendor syndrome: 0x%x\n", wc.status, wc.vendor_err);
+			return 1;
+		}
+
+		if (wc.wr_id == CTRL_SEND_WRID)
+			sent = 1;
+		else if (wc.wr_id == CTRL_RECV_WRID)
+			received = 1;
+	}
+
+	memcpy(remote_data, res->ctrl_buf, xfer_size);
+
+	/* the peer may send its next message as soon as it has ours, rnr_retry
+	 * covers the window until this receive is posted */
+	return ctrl_post_recv(res);
+}
+
+
 /**
  * Pin all current and future memory pages in memory so that the OS does not
  * swap them to disk.
@@ -77,6 +188,50 @@ static void pin_all_memory() {
 }
 
 
+int poll_completion(struct resources *res)
+{
+	/* poll the completion for a while before giving up of doing it .. */
+	return cq_wait(res->cq, 1, cq_deadline(CQ_TIMEOUT_MS), TSC_NONE, NULL);
+}
+
+
+
+int post_send(struct resources *res, int opcode)
+{
+	struct ibv_send_wr	sr;
+	struct ibv_sge		sge;
+	struct ibv_send_wr	*bad_wr = NULL;
+	int			rc;
+
+	/* prepare the scatter/gather entry */
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t)res->buf;
+	sge.length = config.msg_size;
+	sge.lkey = res->mr->lkey;
+
+	/* prepare the send work request */
+	memset(&sr, 0, sizeof(sr));
+	sr.next = NULL;
+	sr.wr_id = 0;
+	sr.sg_list = &sge;
+	sr.num_sge = 1;
+	sr.opcode = opcode;
+	sr.send_flags = IBV_SEND_SIGNALED;
+
+	if(opcode != IBV_WR_SEND) {
+		sr.wr.rdma.remote_addr = res->remote_props.addr;
+		sr.wr.rdma.rkey = remote_rkey(res, res->remote_props.addr);
+	}
+
+	/* there is a Receive Request in the responder side, so we won't get any into RNR flow */
+	rc = ibv_post_send(res->qp, &sr, &bad_wr);
+	if (rc)
+		fprintf(stderr, "failed to post SR\n");
+
+	return rc;
+}
+
+
 void resources_init(struct resources *res)
 {
 	memset(res, 0, sizeof *res);
@@ -84,40 +239,15 @@ void resources_init(struct resources *res)
 }
 
 
-int resources_create(struct resources *res)
+/* Find config.dev_name (or the first device) and open it */
+static int open_ib_device(struct resources *res)
 {
 	struct ibv_device	 **dev_list = NULL;
-	struct ibv_qp_init_attr  qp_init_attr;
 	struct ibv_device	 *ib_dev = NULL;
-	size_t			 size;
-	int		 	 i, j;
-	int			 mr_flags = 0;
-	int			 cq_size = 0;
+	int		 	 i;
 	int			 num_devices;
 	int			 rc = 0;
-	char			 curr_num = 0;
-
 
-	if (config.server_name)	{
-		/* Client side */
-		res->sock = sock_connect(config.server_name, config.tcp_port);
-		if (res->sock < 0) {
-			fprintf(stderr, "[Client only] failed to establish TCP connection to server %s, port %d\n", config.server_name, config.tcp_port);
-			rc = -1;
-			goto resources_create_exit;
-		}
-	} else {
-		/* server side */
-		debug_print("[Server only] waiting on port %d for TCP connection\n", config.tcp_port);
-		res->sock = sock_connect(NULL, config.tcp_port);
-		if (res->sock < 0) {
-			fprintf(stderr, "[Server only] failed to establish TCP connection with client on port %d\n", config.tcp_port);
-			rc = -1;
-			goto resources_create_exit;
-		}
-	}
-
-	debug_print("TCP connection was established\n");
 	debug_print("searching for IB devices in host\n");
 
 	/* get device names in the system */
@@ -125,14 +255,14 @@ int resources_create(struct resources *res)
 	if (!dev_list) {
 		fprintf(stderr, "failed to get IB devices list\n");
 		rc = 1;
-		goto resources_create_exit;
+		goto open_ib_device_exit;
 	}
 
 	/* if there isn't any IB device in host */
 	if (!num_devices) {
 		fprintf(stderr, "found %d device(s)\n", num_devices);
 		rc = 1;
-		goto resources_create_exit;
+		goto open_ib_device_exit;
 	}
 
 	debug_print("found %d device(s)\n", num_devices);
@@ -153,7 +283,7 @@ int resources_create(struct resources *res)
 	if (!ib_dev) {
 		fprintf(stderr, "IB device %s wasn't found\n", config.dev_name);
 		rc = 1;
-		goto resources_create_exit;
+		goto open_ib_device_exit;
 	}
 
 	/* get device handle */
@@ -161,19 +291,189 @@ int resources_create(struct resources *res)
 	if (!res->ib_ctx) {
 		fprintf(stderr, "failed to open device %s\n", config.dev_name);
 		rc = 1;
-		goto resources_create_exit;
+		goto open_ib_device_exit;
 	}
 
-	/* We are now done with device list, free it */
-	ibv_free_device_list(dev_list);
-	dev_list = NULL;
-	ib_dev = NULL;
+open_ib_device_exit:
+	if (dev_list)
+		ibv_free_device_list(dev_list);
+
+	return rc;
+}
+
+
+/* Release the device context, librdmacm owns the ones it opened */
+static int close_device(struct resources *res)
+{
+#ifdef HAVE_RDMACM
+	if (config.rdma_cm) {
+		cm_close_device();
+		return 0;
+	}
+#endif
+	return ibv_close_device(res->ib_ctx);
+}
+
+
+static double elapsed(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+
+/* Fail early with a clear message when the device cannot do ODP over RC */
+static int check_odp(struct resources *res)
+{
+	struct ibv_device_attr_ex	attr;
+	uint32_t			need = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_READ | IBV_ODP_SUPPORT_WRITE;
+
+	if (ibv_query_device_ex(res->ib_ctx, NULL, &attr)) {
+		fprintf(stderr, "ibv_query_device_ex failed, cannot check for ODP\n");
+		return 1;
+	}
+
+	if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT) || (attr.odp_caps.per_transport_caps.rc_odp_caps & need) != need) {
+		fprintf(stderr, "%s does not support on-demand paging for RC SEND/READ/WRITE\n", ibv_get_device_name(res->ib_ctx->device));
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int deregister_buffer(struct resources *res)
+{
+	int i, rc = 0;
+
+	if (res->mrs) {
+		for (i = 0; i < res->num_mrs; i++)
+			if (res->mrs[i] && ibv_dereg_mr(res->mrs[i])) {
+				fprintf(stderr, "failed to deregister MR %d\n", i);
+				rc = 1;
+			}
+		free(res->mrs);
+		res->mrs = NULL;
+		res->num_mrs = 0;
+	} else if (res->mr && ibv_dereg_mr(res->mr)) {
+		fprintf(stderr, "failed to deregister MR\n");
+		rc = 1;
+	}
+
+	res->mr = NULL;
+	return rc;
+}
+
+
+/* Register buf as one MR, or as one per config.reg_chunk bytes. A buf
+ * larger than the device's largest MR is split even without reg_chunk. */
+static int register_buffer(struct resources *res, int mr_flags)
+{
+	size_t	chunk = config.reg_chunk;
+	size_t	max = res->device_attr.max_mr_size;
+	int	i;
+
+	if (max && res->size > max && (!chunk || chunk > max)) {
+		/* whole pages and whole messages, so no probe straddles two MRs */
+		chunk = max & ~(size_t) (sysconf(_SC_PAGESIZE) - 1);
+		chunk -= chunk % config.msg_size;
+		fprintf(stderr, "[Server] %zu bytes is more than one MR may hold, registering in chunks of %zu\n", res->size, chunk);
+	}
+
+	if (!chunk || chunk >= res->size) {
+		res->mr = ibv_reg_mr(res->pd, res->buf, res->size, mr_flags);
+		if (!res->mr) {
+			fprintf(stderr, "ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
+			return 1;
+		}
+		return 0;
+	}
+
+	res->mr_chunk = chunk;
+	res->num_mrs = (res->size + chunk - 1) / chunk;
+	res->mrs = calloc(res->num_mrs, sizeof(*res->mrs));
+	if (!res->mrs) {
+		fprintf(stderr, "failed to allocate %d MR handles\n", res->num_mrs);
+		return 1;
+	}
+
+	for (i = 0; i < res->num_mrs; i++) {
+		size_t offset = (size_t) i * chunk;
+		size_t length = res->size - offset < chunk ? res->size - offset : chunk;
+
+		res->mrs[i] = ibv_reg_mr(res->pd, res->buf + offset, length, mr_flags);
+		if (!res->mrs[i]) {
+			fprintf(stderr, "ibv_reg_mr failed for chunk %d with mr_flags=0x%x\n", i, mr_flags);
+			return 1;
+		}
+	}
+	res->mr = res->mrs[0];
+
+	return 0;
+}
+
+
+/* Fault the whole of an on-demand buf into the device's page tables now, so
+ * that probes do not. Not an error if the device cannot, the probes pay then. */
+static void prefetch_buffer(struct resources *res)
+{
+	struct ibv_sge	sge;
+	struct ibv_mr	*mr;
+	size_t		offset, end;
+	int		i, n = res->mrs ? res->num_mrs : 1;
+	int		rc;
+
+	for (i = 0; i < n; i++) {
+		mr = res->mrs ? res->mrs[i] : res->mr;
+		end = (uintptr_t) mr->addr + mr->length;
+
+		for (offset = (uintptr_t) mr->addr; offset < end; offset += PREFETCH_SIZE) {
+			sge.addr = offset;
+			sge.length = end - offset < PREFETCH_SIZE ? end - offset : PREFETCH_SIZE;
+			sge.lkey = mr->lkey;
+
+			rc = ibv_advise_mr(res->pd, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE, IBV_ADVISE_MR_FLAG_FLUSH, &sge, 1);
+			if (rc) {
+				fprintf(stderr, "ibv_advise_mr prefetch failed (%s), first touches will fault\n", strerror(rc));
+				return;
+			}
+		}
+	}
+}
+
+
+int resources_open_device(struct resources *res)
+{
+	size_t			 size;
+	struct timeval		 start;
+	uint64_t	 	 i, j;
+	int			 mr_flags = 0;
+	int			 rc = 0;
+	char			 curr_num = 0;
+
+#ifdef HAVE_RDMACM
+	if (config.rdma_cm)
+		rc = cm_open_device(res);
+	else
+#endif
+	rc = open_ib_device(res);
+	if (rc)
+		goto resources_open_device_exit;
+
+	/* query device limits, the READ depth depends on them */
+	if (ibv_query_device(res->ib_ctx, &res->device_attr)) {
+		fprintf(stderr, "ibv_query_device failed\n");
+		rc = 1;
+		goto resources_open_device_exit;
+	}
 
 	/* query port properties */
 	if (ibv_query_port(res->ib_ctx, config.ib_port, &res->port_attr)) {
 		fprintf(stderr, "ibv_query_port on port %u failed\n", config.ib_port);
 		rc = 1;
-		goto resources_create_exit;
+		goto resources_open_device_exit;
 	}
 
 	/* allocate Protection Domain */
@@ -181,37 +481,31 @@ int resources_create(struct resources *res)
 	if (!res->pd) {
 		fprintf(stderr, "ibv_alloc_pd failed\n");
 		rc = 1;
-		goto resources_create_exit;
-	}
-
-	/* each side will send only one WR, so Completion Queue with 1 entry is enough */
-	cq_size = 1;
-	res->cq = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
-	if (!res->cq) {
-		fprintf(stderr, "failed to create CQ with %u entries\n", cq_size);
-		rc = 1;
-		goto resources_create_exit;
+		goto resources_open_device_exit;
 	}
 
 	/* allocate the memory buffer that will hold the data */
 	if (!config.server_name)
-		size = config.row_count * (config.column_count * config.msg_size);
+		size = buffer_size();
 	else
-		size = config.msg_size;
+		size = (size_t) config.msg_size * config.batch; /* one slot per probe of a batch */
 
 	res->buf = (char *) malloc(size);
-	pin_all_memory();
+	res->size = size;
+	/* on demand registration is there to avoid pinning all of this */
+	if (!config.odp)
+		pin_all_memory();
 
 	if (!res->buf) {
 		fprintf(stderr, "failed to malloc %Zu bytes to memory buffer\n", size);
 		rc = 1;
-		goto resources_create_exit;
+		goto resources_open_device_exit;
 	}
 
 	if (!config.server_name) {
 		for (i = 0; i < config.row_count; i++) {
 			for (j = 0; j < config.column_count; j++) {
-				res->buf[j * (config.column_count * config.msg_size) + i * (config.msg_size)] = curr_num;
+				res->buf[i * (config.column_count * config.msg_size) + j * config.msg_size] = curr_num;
 				curr_num++;
 			}
 		}
@@ -221,15 +515,116 @@ int resources_create(struct resources *res)
 
 	/* register the memory buffer */
 	mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-	res->mr = ibv_reg_mr(res->pd, res->buf, size, mr_flags);
-	if (!res->mr) {
-		fprintf(stderr, "ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
+	if (config.odp) {
+		if (check_odp(res)) {
+			rc = 1;
+			goto resources_open_device_exit;
+		}
+		mr_flags |= IBV_ACCESS_ON_DEMAND;
+	}
+
+	gettimeofday(&start, NULL);
+	if (register_buffer(res, mr_flags)) {
 		rc = 1;
-		goto resources_create_exit;
+		goto resources_open_device_exit;
+	}
+	if (!config.server_name)
+		fprintf(stderr, "[Server] registered %zu bytes as %d MR(s) in %.3f s (%s)\n",
+				size, res->mrs ? res->num_mrs : 1, elapsed(&start), config.odp ? "on demand" : "pinned");
+
+	if (config.odp) {
+		gettimeofday(&start, NULL);
+		prefetch_buffer(res);
+		if (!config.server_name)
+			fprintf(stderr, "[Server] prefetched in %.3f s\n", elapsed(&start));
 	}
 
 	debug_print("MR was registered with addr=%p, lkey=0x%x, rkey=0x%x, flags=0x%x\n", res->buf, res->mr->lkey, res->mr->rkey, mr_flags);
 
+resources_open_device_exit:
+	if (rc) {
+		/* Error encountered, cleanup */
+
+		deregister_buffer(res);
+
+		if (res->buf) {
+			free(res->buf);
+			res->buf = NULL;
+		}
+
+		if (res->pd) {
+			ibv_dealloc_pd(res->pd);
+			res->pd = NULL;
+		}
+
+		if (res->ib_ctx) {
+			close_device(res);
+			res->ib_ctx = NULL;
+		}
+	}
+
+	return rc;
+}
+
+
+/* the QP from attr, through rdma_cm when it owns the connection, NULL on failure */
+static struct ibv_qp *create_qp(struct resources *res, struct ibv_qp_init_attr *attr)
+{
+#ifdef HAVE_RDMACM
+	if (res->cm_id) {
+		/* rdma_cm owns the QP and moves it through INIT/RTR/RTS itself */
+		if (rdma_create_qp(res->cm_id, res->pd, attr))
+			return NULL;
+		return res->cm_id->qp;
+	}
+#endif
+	return ibv_create_qp(res->pd, attr);
+}
+
+
+int resources_create_qp(struct resources *res)
+{
+	struct ibv_qp_init_attr  qp_init_attr;
+	int			 cq_size = 0;
+	int			 rc = 0;
+
+	/* each side has at most one batch of WRs in flight */
+	cq_size = config.batch;
+
+	/* over rdma_cm the control messages share the QP, give them room and a
+	 * completion channel to sleep on */
+	if (config.rdma_cm) {
+		cq_size += 3;
+
+		res->comp_channel = ibv_create_comp_channel(res->ib_ctx);
+		if (!res->comp_channel) {
+			fprintf(stderr, "failed to create completion channel\n");
+			rc = 1;
+			goto resources_create_qp_exit;
+		}
+
+		res->ctrl_buf = (char *) calloc(2, CTRL_MSG_SIZE);
+		if (!res->ctrl_buf) {
+			fprintf(stderr, "failed to malloc control buffer\n");
+			rc = 1;
+			goto resources_create_qp_exit;
+		}
+
+		res->ctrl_mr = ibv_reg_mr(res->pd, res->ctrl_buf, 2 * CTRL_MSG_SIZE, IBV_ACCESS_LOCAL_WRITE);
+		if (!res->ctrl_mr) {
+			fprintf(stderr, "ibv_reg_mr failed for control buffer\n");
+			rc = 1;
+			goto resources_create_qp_exit;
+		}
+	}
+
+	res->cq = ibv_create_cq(res->ib_ctx, cq_size, NULL, res->comp_channel, 0);
+	if (!res->cq) {
+		fprintf(stderr, "failed to create CQ with %u entries\n", cq_size);
+		rc = 1;
+		goto resources_create_qp_exit;
+	}
+
 	/* create the Queue Pair */
 	memset(&qp_init_attr, 0, sizeof(qp_init_attr));
 
@@ -237,59 +632,89 @@ int resources_create(struct resources *res)
 	qp_init_attr.sq_sig_all = 0;
 	qp_init_attr.send_cq = res->cq;
 	qp_init_attr.recv_cq = res->cq;
-	qp_init_attr.cap.max_send_wr  = 1;
-	qp_init_attr.cap.max_recv_wr  = 1;
+	qp_init_attr.cap.max_send_wr  = config.batch + (config.rdma_cm ? 1 : 0);
+	qp_init_attr.cap.max_recv_wr  = config.rdma_cm ? 2 : 1;
 	qp_init_attr.cap.max_send_sge = 1;
 	qp_init_attr.cap.max_recv_sge = 1;
 
-	res->qp = ibv_create_qp(res->pd, &qp_init_attr);
+	/* room to send a probe inline, or none if the device will not give it */
+	qp_init_attr.cap.max_inline_data = config.msg_size <= MAX_INLINE_PROBE ? config.msg_size : 0;
+	res->qp = create_qp(res, &qp_init_attr);
+	if (!res->qp && qp_init_attr.cap.max_inline_data) {
+		qp_init_attr.cap.max_inline_data = 0;
+		res->qp = create_qp(res, &qp_init_attr);
+	}
 	if (!res->qp) {
-		fprintf(stderr, "failed to create QP\n");
+		fprintf(stderr, "failed to create QP (%s)\n", strerror(errno));
 		rc = 1;
-		goto resources_create_exit;
+		goto resources_create_qp_exit;
 	}
 
+	/* the create calls return the capabilities the device actually gave */
+	res->max_inline = qp_init_attr.cap.max_inline_data;
+
 	debug_print("QP was created, QP number=0x%x\n", res->qp->qp_num);
 
+resources_create_qp_exit:
+	if (rc)
+		resources_destroy_qp(res);
+
+	return rc;
+}
+
+
+int resources_create(struct resources *res)
+{
+	int			 rc = 0;
+
+	if (config.server_name)	{
+		/* Client side */
+		res->sock = sock_connect(config.server_name, config.tcp_port);
+		if (res->sock < 0) {
+			fprintf(stderr, "[Client only] failed to establish TCP connection to server %s, port %d\n", config.server_name, config.tcp_port);
+			rc = -1;
+			goto resources_create_exit;
+		}
+	} else {
+		/* server side */
+		debug_print("[Server only] waiting on port %d for TCP connection\n", config.tcp_port);
+		res->sock = sock_connect(NULL, config.tcp_port);
+		if (res->sock < 0) {
+			fprintf(stderr, "[Server only] failed to establish TCP connection with client on port %d\n", config.tcp_port);
+			rc = -1;
+			goto resources_create_exit;
+		}
+	}
+
+	debug_print("TCP connection was established\n");
+
+	rc = resources_open_device(res);
+	if (rc)
+		goto resources_create_exit;
+
+	rc = resources_create_qp(res);
+
 resources_create_exit:
 	if (rc) {
 		/* Error encountered, cleanup */
 
-		if (res->qp) {
-			ibv_destroy_qp(res->qp);
-			res->qp = NULL;
-		}
-
-		if (res->mr) {
-			ibv_dereg_mr(res->mr);
-			res->mr = NULL;
-		}
+		deregister_buffer(res);
 
 		if (res->buf) {
 			free(res->buf);
 			res->buf = NULL;
 		}
 
-		if (res->cq) {
-			ibv_destroy_cq(res->cq);
-			res->cq = NULL;
-		}
-
 		if (res->pd) {
 			ibv_dealloc_pd(res->pd);
 			res->pd = NULL;
 		}
 
 		if (res->ib_ctx) {
-			ibv_close_device(res->ib_ctx);
+			close_device(res);
 			res->ib_ctx = NULL;
 		}
 
-		if (dev_list) {
-			ibv_free_device_list(dev_list);
-			dev_list = NULL;
-		}
-
 		if (res->sock >= 0) {
 			if (close(res->sock))
 				fprintf(stderr, "failed to close socket\n");
@@ -323,7 +748,7 @@ int modify_qp_to_init(struct ibv_qp *qp)
 }
 
 
-int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, const uint8_t *dgid)
+int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, const uint8_t *dgid, int rd_atomic)
 {
 	struct ibv_qp_attr	attr;
 	int			flags;
@@ -335,7 +760,7 @@ int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, cons
 	attr.path_mtu = IBV_MTU_2048;
 	attr.dest_qp_num = remote_qpn;
 	attr.rq_psn = 0;
-	attr.max_dest_rd_atomic = 1;
+	attr.max_dest_rd_atomic = rd_atomic;
 	attr.min_rnr_timer = 0x12;
 	attr.ah_attr.is_global = 0;
 	attr.ah_attr.dlid = dlid;
@@ -362,7 +787,7 @@ int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, cons
 }
 
 
-int modify_qp_to_rts(struct ibv_qp *qp)
+int modify_qp_to_rts(struct ibv_qp *qp, int rd_atomic)
 {
 	struct ibv_qp_attr	attr;
 	int			flags;
@@ -375,7 +800,7 @@ int modify_qp_to_rts(struct ibv_qp *qp)
 	attr.retry_cnt	= 6;
 	attr.rnr_retry	= 0;
 	attr.sq_psn	= 0;
-	attr.max_rd_atomic = 1;
+	attr.max_rd_atomic = rd_atomic;
 
 	flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
 
@@ -387,6 +812,68 @@ int modify_qp_to_rts(struct ibv_qp *qp)
 }
 
 
+int mr_table_exchange(struct resources *res)
+{
+	uint32_t	keys_out[CTRL_MSG_SIZE / sizeof(uint32_t)];
+	uint32_t	keys_in[CTRL_MSG_SIZE / sizeof(uint32_t)];
+	uint32_t	i, n, done, count;
+	int		server = !config.server_name;
+
+	count = server ? (uint32_t) (res->mrs ? res->num_mrs : 1) : res->remote_mrs.count;
+
+	/* a single MR's rkey came with the connection data */
+	if (count <= 1)
+		return 0;
+
+	if (!server) {
+		if (!res->remote_mrs.chunk) {
+			fprintf(stderr, "server sent %u MRs of 0 bytes\n", count);
+			return 1;
+		}
+		res->remote_mrs.rkeys = calloc(count, sizeof(uint32_t));
+		if (!res->remote_mrs.rkeys) {
+			fprintf(stderr, "failed to allocate %u rkeys\n", count);
+			return 1;
+		}
+	}
+
+	memset(keys_out, 0, sizeof(keys_out));
+	for (done = 0; done < count; done += n) {
+		n = count - done < CTRL_MSG_SIZE / sizeof(uint32_t) ? count - done : CTRL_MSG_SIZE / sizeof(uint32_t);
+
+		if (server)
+			for (i = 0; i < n; i++)
+				keys_out[i] = htonl(res->mrs[done + i]->rkey);
+
+		if (ctrl_sync(res, n * sizeof(uint32_t), (char *) keys_out, (char *) keys_in)) {
+			fprintf(stderr, "failed to exchange MR table\n");
+			return 1;
+		}
+
+		if (!server)
+			for (i = 0; i < n; i++)
+				res->remote_mrs.rkeys[done + i] = ntohl(keys_in[i]);
+	}
+
+	return 0;
+}
+
+
+int qp_rd_atomic(const struct resources *res, int responder)
+{
+	int max = responder ? res->device_attr.max_qp_rd_atom : res->device_attr.max_qp_init_rd_atom;
+	int depth = responder ? MAX_RD_ATOMIC : config.batch;
+
+	if (depth > max)
+		depth = max;
+	/* nor more than the peer will answer, once the handshake has said */
+	if (!responder && res->peer.max_rd_atomic && depth > (int) res->peer.max_rd_atomic)
+		depth = res->peer.max_rd_atomic;
+
+	return depth < 1 ? 1 : depth;
+}
+
+
 int connect_qp(struct resources *res)
 {
 	struct cm_con_data_t	local_con_data;
@@ -439,6 +926,11 @@ int connect_qp(struct resources *res)
 				p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
 	}
 
+	/* settle what both sides can do before the QP takes on any of it */
+	rc = handshake(res);
+	if (rc)
+		return rc;
+
 	/* modify the QP to init */
 	rc = modify_qp_to_init(res->qp);
 	if (rc) {
@@ -457,13 +949,13 @@ int connect_qp(struct resources *res)
 
 
 	/* modify the QP to RTR */
-	rc = modify_qp_to_rtr(res->qp, remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid);
+	rc = modify_qp_to_rtr(res->qp, remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid, qp_rd_atomic(res, 1));
 	if (rc) {
 		fprintf(stderr, "failed to modify QP state to RTR (%s)\n", strerror(errno));
 		return rc;
 	}
 
-	rc = modify_qp_to_rts(res->qp);
+	rc = modify_qp_to_rts(res->qp, qp_rd_atomic(res, 0));
 	if (rc) {
 		fprintf(stderr, "failed to modify QP state to RTS (%s)\n", strerror(errno));
 		return rc;
@@ -481,30 +973,90 @@ int connect_qp(struct resources *res)
 }
 
 
-int resources_destroy(struct resources *res)
+int resources_destroy_qp(struct resources *res)
 {
 	int rc = 0;
 
-	if (res->qp)
+	if (res->qp) {
+#ifdef HAVE_RDMACM
+		if (res->cm_id)
+			rdma_destroy_qp(res->cm_id);
+		else
+#endif
 		if (ibv_destroy_qp(res->qp)) {
 			fprintf(stderr, "failed to destroy QP\n");
 			rc = 1;
 		}
+		res->qp = NULL;
+	}
 
-	if (res->mr)
-		if (ibv_dereg_mr(res->mr)) {
-			fprintf(stderr, "failed to deregister MR\n");
+	if (res->cq) {
+		if (ibv_destroy_cq(res->cq)) {
+			fprintf(stderr, "failed to destroy CQ\n");
 			rc = 1;
 		}
+		res->cq = NULL;
+	}
 
-	if (res->buf)
-		free(res->buf);
+	if (res->comp_channel) {
+		if (ibv_destroy_comp_channel(res->comp_channel)) {
+			fprintf(stderr, "failed to destroy completion channel\n");
+			rc = 1;
+		}
+		res->comp_channel = NULL;
+	}
 
-	if (res->cq)
-		if (ibv_destroy_cq(res->cq)) {
-			fprintf(stderr, "failed to destroy CQ\n");
+	if (res->ctrl_mr) {
+		if (ibv_dereg_mr(res->ctrl_mr)) {
+			fprintf(stderr, "failed to deregister control MR\n");
 			rc = 1;
 		}
+		res->ctrl_mr = NULL;
+	}
+
+	if (res->ctrl_buf) {
+		free(res->ctrl_buf);
+		res->ctrl_buf = NULL;
+	}
+
+	if (res->sock >= 0) {
+		if (close(res->sock)) {
+			fprintf(stderr, "failed to close socket\n");
+			rc = 1;
+		}
+		res->sock = -1;
+	}
+
+	return rc;
+}
+
+
+int resources_destroy(struct resources *res)
+{
+	int rc = 0;
+
+#ifdef HAVE_RDMACM
+	if (res->cm_id)
+		if (cm_disconnect(res))
+			rc = 1;
+#endif
+
+	if (resources_destroy_qp(res))
+		rc = 1;
+
+	doorbell_detach(res->evict);
+	res->evict = NULL;
+	doorbell_detach(res->oracle);
+	res->oracle = NULL;
+	clocksync_close(res->clock);
+	res->clock = NULL;
+	if (deregister_buffer(res))
+		rc = 1;
+	free(res->remote_mrs.rkeys);
+	res->remote_mrs.rkeys = NULL;
+
+	if (res->buf)
+		free(res->buf);
 
 	if (res->pd)
 		if (ibv_dealloc_pd(res->pd)) {
@@ -513,16 +1065,10 @@ int resources_destroy(struct resources *res)
 		}
 
 	if (res->ib_ctx)
-		if (ibv_close_device(res->ib_ctx)) {
+		if (close_device(res)) {
 			fprintf(stderr, "failed to close device context\n");
 			rc = 1;
 		}
 
-	if (res->sock >= 0)
-		if (close(res->sock)) {
-			fprintf(stderr, "failed to close socket\n");
-			rc = 1;
-		}
-
 	return rc;
 }
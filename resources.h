@@ -30,6 +30,47 @@ struct cm_con_data_t {
 } __attribute__((packed));
 
 
+/* control messages exchanged over the QP when there is no TCP socket */
+#define CTRL_MSG_SIZE	256
+
+/* most probes a client chains into one post, see --batch */
+#define MAX_BATCH	64
+
+/* most RDMA READs a responder lets its peer have in flight */
+#define MAX_RD_ATOMIC	16
+
+/* largest msg_size the QP is asked to send inline, see HS_INLINE */
+#define MAX_INLINE_PROBE	256
+
+/* timestamps the verbs probe kernels take, see --tsc */
+#define TSC_FENCED	0	/* start_tsc and stop_tsc */
+#define TSC_RDTSCP	1	/* rdtscp_tsc at both ends */
+
+/* how the server registered its buffer, see mr_table_exchange */
+#define MR_TABLE_ODP	0x1	/* registered on demand, first touches may fault */
+
+struct mr_table {
+	uint64_t	chunk;		/* bytes per MR, the last one may be shorter */
+	uint32_t	count;		/* number of MRs */
+	uint32_t	flags;		/* MR_TABLE_* */
+	uint64_t	base;		/* remote address of the first MR */
+	uint32_t	*rkeys;		/* rkey of each MR in address order, NULL for a single MR */
+};
+
+/* what the other side said in the handshake, see handshake.h */
+struct peer_info {
+	uint32_t	version;	/* handshake version both sides speak, 0 before the handshake */
+	uint32_t	caps;		/* HS_CAP_* of the peer */
+	uint32_t	max_inline;	/* largest inline send the peer's QP takes */
+	uint32_t	max_rd_atomic;	/* RDMA READs the peer lets us have outstanding, 0 if unknown */
+	uint64_t	tsc_khz;	/* the peer's TSC rate */
+	uint32_t	mode;		/* server: the mode the client runs, which the server follows */
+	uint32_t	iters;		/* server: the iterations the client runs */
+	int		wants_oracle;	/* server: the client asked for a residency oracle (oracle.h) */
+	int		wants_clock;	/* server: the client asked to read the server's TSC (clocksync.h) */
+	int		wants_sweep;	/* server: the client calibrates after a sweep of the LLC (calibration.h) */
+};
+
 /* structure of system resources */
 struct resources {
 	struct ibv_device_attr 	device_attr;	/* Device attributes */
@@ -39,9 +80,26 @@ struct resources {
 	struct ibv_pd		*pd;		/* PD handle */
 	struct ibv_cq		*cq;		/* CQ handle */
 	struct ibv_qp		*qp;		/* QP handle */
-	struct ibv_mr		*mr;		/* MR handle for buf */
+	struct ibv_mr		*mr;		/* MR handle for buf, the first of mrs when chunked */
+	struct ibv_mr		**mrs;		/* MRs of buf registered in config.reg_chunk pieces */
+	int			num_mrs;	/* entries in mrs, 0 when buf is a single MR */
+	size_t			mr_chunk;	/* bytes per entry of mrs, the last one may be shorter */
+	struct mr_table		remote_mrs;	/* the server's MRs, client only */
+	struct peer_info	peer;		/* the other side, from the handshake */
+	uint32_t		max_inline;	/* largest inline send the QP takes */
 	char			*buf;		/* memory buffer pointer, used for RDMA and send ops */
+	size_t			size;		/* size of buf in bytes */
 	int			sock;		/* TCP socket file descriptor */
+	struct rdma_cm_id	*cm_id;		/* rdma_cm connection, used instead of sock */
+	struct ibv_comp_channel	*comp_channel;	/* lets ctrl_sync sleep instead of spinning */
+	struct ibv_mr		*ctrl_mr;	/* MR handle for ctrl_buf */
+	char			*ctrl_buf;	/* receive then send slot for control messages */
+	const struct transport	*transport;	/* backend the client probes through */
+	struct sim		*sim;		/* simulated server, sim transport only */
+	struct local		*local;		/* local buffer, local transport only */
+	struct doorbell_link	*evict;		/* the server's eviction doorbell, verbs client in mode 5 only */
+	struct doorbell_link	*oracle;	/* the server's residency oracle, verbs client with -G only */
+	struct clocksync	*clock;		/* the server's TSC and the estimates of it, verbs client with -Y only */
 };
 
 /* structure of test parameters */
@@ -52,14 +110,45 @@ struct config_t {
 	int		ib_port;	/* local IB port to work with */
 	int		gid_idx;	/* gid index to use */
 	int		iters;		/* number of iterations */
-	int		mode; /* 0 for seq, 1 for rand */
-	int		msg_size; /* size of client buffer */
-	int		column_count; /* number of columns in the 2D array, size of one row is msg_size * column_count */
-	int		row_count; /* number of rows in the 2D array */
+	int		mode; /* 0 for seq, 1 for rand, 2 for clflush, 3 for the prefetch sweep, 4 for the DDIO sweep, 5 for the eviction helper */
+	uint32_t	msg_size; /* size of client buffer */
+	uint64_t	column_count; /* number of columns in the 2D array, size of one row is msg_size * column_count */
+	uint64_t	row_count; /* number of rows in the 2D array */
+	int		daemon; /* server only, keep serving clients until terminated */
+	int		max_clients; /* server only, number of clients the daemon serves at once */
+	int		rdma_cm; /* connect with librdmacm instead of the TCP exchange */
+	const char	*backend; /* client only, "verbs", "sim" or "local" */
+	const char	*sim_params; /* parameters of the simulated server, see sim.h */
+	int		histogram; /* client only, print the latency histogram and classifier */
+	int		batch; /* client only, lines probed per post */
+	int		odp; /* server only, register buf on demand instead of pinning it */
+	size_t		reg_chunk; /* server only, register buf in MRs of this many bytes, 0 for one */
+	int		pf_lines; /* client only, neighbours on either side the prefetch sweep reads */
+	uint64_t	ddio_max; /* client only, largest working set in lines the DDIO sweep writes */
+	const char	*telemetry; /* client only, file to write CPU telemetry to, NULL for none */
+	int		block; /* client only, samples per telemetry block */
+	double		freq_tol; /* client only, frequency drift in percent that flags a block */
+	int		low_noise; /* client only, probe under the low-noise profile (see lownoise.h) */
+	const char	*output; /* client only, file the trace writer puts the samples in, NULL for stdout */
+	int		tsc; /* client only, TSC_FENCED or TSC_RDTSCP, timestamps of the verbs probe kernels */
+	const char	*heatmap; /* client only, file to export the per-line heatmap to, NULL for none */
+	uint64_t	seed; /* client only, seed of the rand pattern */
+	const char	*record; /* client only, file to record the probed offsets to, NULL for none */
+	const char	*replay; /* client only, file of offsets to probe instead of a pattern, NULL for none */
+	int		oracle; /* client only, have the server label every read (see oracle.h) */
+	const char	*contention; /* server and local backend, contention workload parameters (see contention.h), NULL for none */
+	const char	*clock; /* client only, file to write the server clock estimates to (see clocksync.h), NULL for none */
+	uint32_t	calibration; /* client only, reads of each kind in the hit/miss calibration (see calibration.h), 0 for none */
 };
 
 extern struct config_t config;
 
+/* bytes in the server's buffer, row_count rows of column_count messages */
+static inline uint64_t buffer_size(void)
+{
+	return config.row_count * config.column_count * config.msg_size;
+}
+
 /******************************************************************************
  * *	Function: resources_init
  * *
@@ -98,6 +187,43 @@ void resources_init(struct resources *res);
 int resources_create(struct resources *res);
 
 
+/******************************************************************************
+ * *	Function: resources_open_device
+ * *
+ * *	Input
+ * *	res	pointer to resources structure to be filled in
+ * *
+ * *	Output
+ * *	res	device context, PD, buffer and MR filled in
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Open the IB device and allocate, fill and register the memory buffer.
+ * *	These are the resources a persistent server keeps across sessions.
+ * *****************************************************************************/
+int resources_open_device(struct resources *res);
+
+
+/******************************************************************************
+ * *	Function: resources_create_qp
+ * *
+ * *	Input
+ * *	res	pointer to resources structure with an open device
+ * *
+ * *	Output
+ * *	res	CQ and QP filled in
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Create the per-connection CQ and QP against the already opened device.
+ * *****************************************************************************/
+int resources_create_qp(struct resources *res);
+
+
 /******************************************************************************
  * *	Function: modify_qp_to_init
  * *
@@ -124,6 +250,7 @@ int modify_qp_to_init(struct ibv_qp *qp);
  * *	remote_qpn	remote QP number
  * *	dlid		destination LID
  * *	dgid		destination GID (mandatory for RoCEE)
+ * *	rd_atomic	RDMA READs the peer may have outstanding at this QP
  * *
  * *	Output
  * *	none
@@ -134,14 +261,15 @@ int modify_qp_to_init(struct ibv_qp *qp);
  * *	Description
  * *	Transition a QP from the INIT to RTR state, using the specified QP number
  * ******************************************************************************/
-int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, const uint8_t *dgid);
+int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, const uint8_t *dgid, int rd_atomic);
 
 
 /******************************************************************************
  * *	Function: modify_qp_to_rts
  * *
  * *	Input
- * *	qp	QP to transition
+ * *	qp		QP to transition
+ * *	rd_atomic	RDMA READs this QP may have outstanding at the peer
  * *
  * *	Output
  * *	none
@@ -152,7 +280,25 @@ int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, cons
  * *	Description
  * *	Transition a QP from the RTR to RTS state
  * ******************************************************************************/
-int modify_qp_to_rts(struct ibv_qp *qp);
+int modify_qp_to_rts(struct ibv_qp *qp, int rd_atomic);
+
+
+/******************************************************************************
+ * *	Function: qp_rd_atomic
+ * *
+ * *	Input
+ * *	res		resources with an open device
+ * *	responder	1 for the READs we serve, 0 for the READs we issue
+ * *
+ * *	Returns
+ * *	the READ depth to configure, at least 1
+ * *
+ * *	Description
+ * *	A responder accepts as many READs as the device allows, up to
+ * *	MAX_RD_ATOMIC. A requester asks for no more than its batch needs, and
+ * *	no more than its peer grants once the handshake has run.
+ * ******************************************************************************/
+int qp_rd_atomic(const struct resources *res, int responder);
 
 
 /******************************************************************************
@@ -173,6 +319,158 @@ int modify_qp_to_rts(struct ibv_qp *qp);
 int connect_qp(struct resources *res);
 
 
+/******************************************************************************
+ * *	Function: poll_completion
+ * *
+ * *	Input
+ * *	res	pointer to resources structure
+ * *
+ * *	Output
+ * *	none
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Poll the completion queue for a single event. This function will continue to
+ * *	poll the queue until CQ_TIMEOUT_MS milliseconds have passed (see completion.h).
+ * ******************************************************************************/
+int poll_completion(struct resources *res);
+
+
+/******************************************************************************
+ * *	Function: post_send
+ * *
+ * *	Input
+ * *	res	 pointer to resources structure
+ * *	opcode   IBV_WR_SEND, IBV_WR_RDMA_READ or IBV_WR_RDMA_WRITE
+ * *
+ * *	Output
+ * *	none
+ * *
+ * *	Returns
+ * *	0 on success, error code on failure
+ * *
+ * *	Description
+ * *	This function will create and post a send work request
+ * ******************************************************************************/
+int post_send(struct resources *res, int opcode);
+
+
+/******************************************************************************
+ * *	Function: post_receive
+ * *
+ * *	Input
+ * *	res	pointer to resources structure
+ * *
+ * *	Output
+ * *	none
+ * *
+ * *	Returns
+ * *	0 on success, error code on failure
+ * *
+ * *	Description
+ * *	Post a receive request for the server's initial SEND into buf
+ * ******************************************************************************/
+int post_receive(struct resources *res);
+
+
+/******************************************************************************
+ * *	Function: ctrl_post_recv
+ * *
+ * *	Input
+ * *	res	pointer to resources structure
+ * *
+ * *	Output
+ * *	none
+ * *
+ * *	Returns
+ * *	0 on success, error code on failure
+ * *
+ * *	Description
+ * *	Post the receive request for the next control message. Only used when
+ * *	the control path runs over the QP (rdma_cm), where exactly one is kept
+ * *	outstanding at all times.
+ * ******************************************************************************/
+int ctrl_post_recv(struct resources *res);
+
+
+/******************************************************************************
+ * *	Function: ctrl_sync
+ * *
+ * *	Input
+ * *	res		pointer to resources structure
+ * *	xfer_size	size of data to transfer
+ * *	local_data	pointer to data to be sent to remote
+ * *
+ * *	Output
+ * *	remote_data	pointer to buffer to receive remote data
+ * *
+ * *	Returns
+ * *	0 on success, non zero on failure
+ * *
+ * *	Description
+ * *	sock_sync_data over whichever control path res was connected with. Over
+ * *	rdma_cm this is a SEND/RECV pair of at most CTRL_MSG_SIZE bytes that
+ * *	sleeps on the completion channel while waiting for the peer.
+ * ******************************************************************************/
+int ctrl_sync(struct resources *res, int xfer_size, char *local_data, char *remote_data);
+
+
+/******************************************************************************
+ * *	Function: mr_table_exchange
+ * *
+ * *	Input
+ * *	res	connected resources
+ * *
+ * *	Output
+ * *	res	client: remote_mrs.rkeys filled in
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	After the handshake has told the client how the server's buffer is
+ * *	registered, the server sends every rkey when there is more than one
+ * *	MR. The rkeys go CTRL_MSG_SIZE bytes at a time so this works over
+ * *	either control path.
+ * ******************************************************************************/
+int mr_table_exchange(struct resources *res);
+
+
+/* rkey of the server MR holding addr */
+static inline uint32_t remote_rkey(const struct resources *res, uint64_t addr)
+{
+	const struct mr_table	*t = &res->remote_mrs;
+	uint64_t		i;
+
+	if (!t->rkeys)
+		return res->remote_props.rkey;
+
+	i = (addr - t->base) / t->chunk;
+	return t->rkeys[i < t->count ? i : t->count - 1];
+}
+
+
+/******************************************************************************
+ * *	Function: resources_destroy_qp
+ * *
+ * *	Input
+ * *	res	pointer to resources structure
+ * *
+ * *	Output
+ * *	none
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Cleanup the per-connection QP, CQ, control buffer and socket, leaving the
+ * *	device, PD and MR in place for the next connection
+ * ******************************************************************************/
+int resources_destroy_qp(struct resources *res);
+
+
 /******************************************************************************
  * *	Function: resources_destroy
  * *
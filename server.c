@@ -0,0 +1,494 @@
+/* vim: set noet: */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <emmintrin.h>
+
+#include <infiniband/verbs.h>
+
+#include "resources.h"
+#include "sockets.h"
+#include "stats.h"
+#include "cm.h"
+#include "handshake.h"
+#include "evict.h"
+#include "oracle.h"
+#include "clocksync.h"
+#include "calibration.h"
+#include "server.h"
+
+int server_session(struct resources *res, struct session_report *report)
+{
+	struct session_report	none;
+	struct doorbell_wire	wire, ignored;
+	struct evictor		*evictor = NULL;
+	struct oracle		*oracle = NULL;
+	struct clocksync_source	*clock = NULL;
+	char			temp_char;
+	uint32_t		i;
+	int			rc = 1;
+
+	/* let the server post the sr */
+	if (post_send(res, IBV_WR_SEND)) {
+		fprintf(stderr, "failed to post sr\n");
+		return 1;
+	}
+
+	if (poll_completion(res)) {
+		fprintf(stderr, "poll completion failed\n");
+		return 1;
+	}
+
+	/* Sync so we are sure server side has data ready before client tries to read it */
+	if (ctrl_sync(res, 1, "R", &temp_char)) {  /* just send a dummy char back and forth */
+		fprintf(stderr, "sync error before RDMA ops\n");
+		return 1;
+	}
+
+	/* the oracle labels the client's reads until the session is over */
+	if (res->peer.wants_oracle) {
+		memset(&wire, 0, sizeof(wire));
+		oracle = oracle_start(res, &wire);
+		if (!oracle)
+			return 1;
+		if (ctrl_sync(res, sizeof(wire), (char *) &wire, (char *) &ignored)) {
+			fprintf(stderr, "failed to send the oracle's doorbell\n");
+			goto server_session_exit;
+		}
+	}
+
+	/* the TSC is there for the client to read until the session is over */
+	if (res->peer.wants_clock) {
+		memset(&wire, 0, sizeof(wire));
+		clock = clocksync_start(res, &wire);
+		if (!clock)
+			goto server_session_exit;
+		if (ctrl_sync(res, sizeof(wire), (char *) &wire, (char *) &ignored)) {
+			fprintf(stderr, "failed to send the clock line\n");
+			goto server_session_exit;
+		}
+	}
+
+	/* the helper evicts on the client's RDMA doorbell until the session is over */
+	if (res->peer.mode == 5) {
+		memset(&wire, 0, sizeof(wire));
+		evictor = evictor_start(res, &wire);
+		if (!evictor)
+			goto server_session_exit;
+		if (ctrl_sync(res, sizeof(wire), (char *) &wire, (char *) &ignored)) {
+			fprintf(stderr, "failed to send the eviction doorbell\n");
+			goto server_session_exit;
+		}
+	}
+
+	/* the client calibrates right after the LLC was swept, and the run starts from a swept one */
+	for (i = 0; res->peer.wants_sweep && i < 2; i++) {
+		if (ctrl_sync(res, 1, "S", &temp_char)) {  /* just send a dummy char back and forth */
+			fprintf(stderr, "sync error before the calibration sweep\n");
+			goto server_session_exit;
+		}
+		if (calibration_sweep())
+			goto server_session_exit;
+		if (ctrl_sync(res, 1, "C", &temp_char)) {  /* just send a dummy char back and forth */
+			fprintf(stderr, "sync error after the calibration sweep\n");
+			goto server_session_exit;
+		}
+	}
+
+	if (res->peer.mode == 2) {
+		for (i = 0; i < res->peer.iters; ++i) {
+			if (ctrl_sync(res, 1, "A", &temp_char)) {  /* just send a dummy char back and forth */
+				fprintf(stderr, "sync error after RDMA ops\n");
+				goto server_session_exit;
+			}
+
+			_mm_clflush(res->buf);
+			_mm_mfence();
+
+			if (ctrl_sync(res, 1, "B", &temp_char)) {  /* just send a dummy char back and forth */
+				fprintf(stderr, "sync error after RDMA ops\n");
+				goto server_session_exit;
+			}
+		}
+	}
+
+	/* collect the client's statistics, the server has none of its own */
+	memset(&none, 0, sizeof(none));
+	if (session_report_exchange(res, &none, report))
+		goto server_session_exit;
+
+	/* Sync so server will know that client is done mucking with its memory */
+	if (ctrl_sync(res, 1, "W", &temp_char)) {  /* just send a dummy char back and forth */
+		fprintf(stderr, "sync error after RDMA ops\n");
+		goto server_session_exit;
+	}
+
+	rc = 0;
+
+server_session_exit:
+	if (evictor_stop(evictor))
+		rc = 1;
+	if (oracle_stop(oracle))
+		rc = 1;
+	if (clocksync_stop(clock))
+		rc = 1;
+	return rc;
+}
+
+
+/* one concurrent client session */
+struct session_slot {
+	struct resources	*shared;	/* daemon resources, device, PD and MR are shared */
+	pthread_t		thread;
+	pthread_mutex_t		lock;		/* protects live against the shutdown path */
+	int			sock;		/* control socket of the client */
+	struct rdma_cm_id	*cm_id;		/* or its rdma_cm connection */
+	struct cm_con_data_t	remote;		/* private data of the rdma_cm request */
+	int			live;		/* connection may still be blocked on the client */
+	int			stop;		/* the daemon is shutting down */
+	int			donefd;		/* eventfd the thread signals when it exits */
+	int			in_use;
+	int			done;		/* set by the session thread, read by the event loop */
+	int			peak;		/* most sessions running at once during this one */
+	unsigned long		id;
+	char			peer[INET_ADDRSTRLEN];
+};
+
+
+/* Wake a session blocked on its client, called with the slot locked */
+static void disconnect_session(struct session_slot *slot)
+{
+#ifdef HAVE_RDMACM
+	if (slot->cm_id)
+		rdma_disconnect(slot->cm_id);
+	else
+#endif
+	shutdown(slot->sock, SHUT_RDWR);
+}
+
+
+static void kick_session(struct session_slot *slot)
+{
+	pthread_mutex_lock(&slot->lock);
+	slot->stop = 1;
+	if (slot->live)
+		disconnect_session(slot);
+	pthread_mutex_unlock(&slot->lock);
+}
+
+
+static void set_live(struct session_slot *slot, int live)
+{
+	pthread_mutex_lock(&slot->lock);
+	slot->live = live;
+	/* shutdown began while the connection was still being set up */
+	if (live && slot->stop)
+		disconnect_session(slot);
+	pthread_mutex_unlock(&slot->lock);
+}
+
+
+/* Run one session on its own QP and CQ, sharing the daemon's PD and MR */
+static void *serve_client(void *arg)
+{
+	struct session_slot	*slot = arg;
+	struct resources	conn;
+	struct session_report	report;
+	struct timeval		start, end;
+	uint64_t		one = 1;
+	int			rc;
+
+	conn = *slot->shared;
+	conn.sock = slot->sock;
+	conn.cq = NULL;
+	conn.qp = NULL;
+	memset(&conn.remote_props, 0, sizeof(conn.remote_props));
+	memset(&report, 0, sizeof(report));
+
+	gettimeofday(&start, NULL);
+
+#ifdef HAVE_RDMACM
+	if (slot->cm_id) {
+		rc = cm_accept(&conn, slot->cm_id, &slot->remote);
+		if (!rc)
+			set_live(slot, 1);
+		if (!rc)
+			rc = handshake(&conn);
+	} else
+#endif
+	{
+		rc = resources_create_qp(&conn);
+		if (!rc)
+			rc = connect_qp(&conn);
+	}
+	if (!rc)
+		rc = mr_table_exchange(&conn);
+	if (!rc)
+		rc = server_session(&conn, &report);
+
+	set_live(slot, 0);
+
+#ifdef HAVE_RDMACM
+	if (conn.cm_id && cm_disconnect(&conn))
+		rc = 1;
+#endif
+	if (resources_destroy_qp(&conn))
+		rc = 1;
+
+	gettimeofday(&end, NULL);
+
+	fprintf(stderr, "[Server] session %lu from %s %s (mode %u, %u iters, %d concurrent, %.3f s)\n",
+			slot->id, slot->peer, rc ? "failed" : "done",
+			conn.peer.mode, conn.peer.iters,
+			__atomic_load_n(&slot->peak, __ATOMIC_RELAXED),
+			(end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+	if (!rc && report.samples) {
+		fprintf(stderr, "[Server] session %lu ", slot->id);
+		session_report_print(stderr, &report);
+	}
+
+	__atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+	if (write(slot->donefd, &one, sizeof(one)) != sizeof(one))
+		perror("eventfd write");
+
+	return NULL;
+}
+
+
+/* Join every session thread that has signalled completion */
+static int reap_sessions(struct session_slot *slots, int max_clients)
+{
+	int i, active = 0;
+
+	for (i = 0; i < max_clients; i++) {
+		if (!slots[i].in_use)
+			continue;
+
+		if (__atomic_load_n(&slots[i].done, __ATOMIC_ACQUIRE)) {
+			pthread_join(slots[i].thread, NULL);
+			pthread_mutex_destroy(&slots[i].lock);
+			slots[i].in_use = 0;
+		} else
+			active++;
+	}
+
+	return active;
+}
+
+
+int server_daemon(struct resources *res)
+{
+	struct pollfd		fds[3];
+	struct sockaddr_in	peer_addr;
+	struct session_slot	*slots = NULL;
+	struct session_slot	*slot;
+#ifdef HAVE_RDMACM
+	struct rdma_cm_id	*listen_id = NULL;
+#endif
+	struct rdma_cm_id	*cm_id = NULL;
+	struct cm_con_data_t	remote = { 0 };
+	socklen_t		peer_len;
+	sigset_t		mask;
+	unsigned long		sessions = 0;
+	uint64_t		finished;
+	int			listenfd = -1;
+	int			sigfd = -1;
+	int			donefd = -1;
+	int			active = 0;
+	int			sock;
+	int			i;
+	int			rc = 0;
+
+	if (resources_open_device(res)) {
+		fprintf(stderr, "failed to open device\n");
+		return 1;
+	}
+
+	slots = calloc(config.max_clients, sizeof(*slots));
+	if (!slots) {
+		fprintf(stderr, "failed to allocate %d session slots\n", config.max_clients);
+		return 1;
+	}
+
+	/* a client disappearing mid-session must not take the daemon with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* take SIGINT and SIGTERM through the event loop so the MR is released
+	 * cleanly, session threads inherit the blocked mask */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL)) {
+		perror("sigprocmask");
+		rc = 1;
+		goto server_daemon_exit;
+	}
+
+	sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (sigfd < 0) {
+		perror("signalfd");
+		rc = 1;
+		goto server_daemon_exit;
+	}
+
+	donefd = eventfd(0, EFD_CLOEXEC);
+	if (donefd < 0) {
+		perror("eventfd");
+		rc = 1;
+		goto server_daemon_exit;
+	}
+
+#ifdef HAVE_RDMACM
+	if (config.rdma_cm) {
+		if (cm_listen(config.tcp_port, &listen_id)) {
+			rc = 1;
+			goto server_daemon_exit;
+		}
+		listenfd = listen_id->channel->fd;
+	} else
+#endif
+	listenfd = sock_listen(config.tcp_port, SOMAXCONN);
+	if (listenfd < 0) {
+		rc = 1;
+		goto server_daemon_exit;
+	}
+
+	fprintf(stderr, "[Server] serving %zu byte region on port %u to up to %d concurrent client(s)\n",
+			res->size, config.tcp_port, config.max_clients);
+
+	fds[0].fd = listenfd;
+	fds[1].fd = sigfd;
+	fds[1].events = POLLIN;
+	fds[2].fd = donefd;
+	fds[2].events = POLLIN;
+
+	while (1) {
+		/* leave new clients in the backlog while every slot is busy */
+		fds[0].events = active < config.max_clients ? POLLIN : 0;
+
+		if (poll(fds, 3, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			rc = 1;
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			struct signalfd_siginfo si;
+
+			if (read(sigfd, &si, sizeof(si)) == sizeof(si))
+				fprintf(stderr, "[Server] caught signal %u, shutting down\n", si.ssi_signo);
+			break;
+		}
+
+		if (fds[2].revents & POLLIN) {
+			if (read(donefd, &finished, sizeof(finished)) != sizeof(finished))
+				perror("eventfd read");
+			active = reap_sessions(slots, config.max_clients);
+		}
+
+		if (fds[0].revents & POLLIN) {
+			sock = -1;
+			cm_id = NULL;
+			peer_addr.sin_addr.s_addr = 0;
+
+#ifdef HAVE_RDMACM
+			if (listen_id) {
+				if (cm_get_request(listen_id, &cm_id, &remote) || !cm_id)
+					continue;
+				memcpy(&peer_addr, rdma_get_peer_addr(cm_id), sizeof(peer_addr));
+			} else
+#endif
+			{
+				peer_len = sizeof(peer_addr);
+				sock = accept(listenfd, (struct sockaddr *) &peer_addr, &peer_len);
+				if (sock < 0) {
+					perror("server accept");
+					continue;
+				}
+			}
+
+			for (slot = slots; slot->in_use; slot++)
+				;
+
+			memset(slot, 0, sizeof(*slot));
+			pthread_mutex_init(&slot->lock, NULL);
+			slot->shared = res;
+			slot->sock = sock;
+			slot->cm_id = cm_id;
+			slot->remote = remote;
+			slot->live = sock >= 0;
+			slot->donefd = donefd;
+			slot->id = ++sessions;
+			if (!inet_ntop(AF_INET, &peer_addr.sin_addr, slot->peer, sizeof(slot->peer)))
+				strcpy(slot->peer, "unknown");
+
+			if (pthread_create(&slot->thread, NULL, serve_client, slot)) {
+				fprintf(stderr, "failed to start session %lu\n", slot->id);
+				pthread_mutex_destroy(&slot->lock);
+#ifdef HAVE_RDMACM
+				if (cm_id) {
+					rdma_reject(cm_id, NULL, 0);
+					rdma_destroy_id(cm_id);
+				} else
+#endif
+				close(sock);
+				continue;
+			}
+			slot->in_use = 1;
+			active++;
+
+			/* let every running session know how crowded it got */
+			for (i = 0; i < config.max_clients; i++)
+				if (slots[i].in_use && __atomic_load_n(&slots[i].peak, __ATOMIC_RELAXED) < active)
+					__atomic_store_n(&slots[i].peak, active, __ATOMIC_RELAXED);
+		}
+	}
+
+server_daemon_exit:
+	/* unblock sessions still waiting on their client and wait for them */
+	if (slots) {
+		for (i = 0; i < config.max_clients; i++) {
+			if (!slots[i].in_use)
+				continue;
+			kick_session(&slots[i]);
+			pthread_join(slots[i].thread, NULL);
+			pthread_mutex_destroy(&slots[i].lock);
+		}
+		free(slots);
+	}
+
+#ifdef HAVE_RDMACM
+	if (listen_id) {
+		struct rdma_event_channel *ch = listen_id->channel;
+
+		rdma_destroy_id(listen_id);
+		rdma_destroy_event_channel(ch);
+	} else
+#endif
+	if (listenfd >= 0)
+		close(listenfd);
+
+	if (sigfd >= 0)
+		close(sigfd);
+
+	if (donefd >= 0)
+		close(donefd);
+
+	fprintf(stderr, "[Server] served %lu session(s)\n", sessions);
+
+	return rc;
+}
@@ -0,0 +1,57 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Server side
+ *
+ * The server does not take part in the measurements. It exposes its buffer,
+ * answers the client's control syncs and, in clflush mode, flushes the target
+ * line between iterations. A persistent server keeps its registered buffer
+ * across sessions and creates a fresh QP for every client that connects.
+ *
+ * ******************************************************************************/
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include "resources.h"
+#include "stats.h"
+
+/******************************************************************************
+ * *	Function: server_session
+ * *
+ * *	Input
+ * *	res	pointer to resources structure with a connected QP
+ * *
+ * *	Output
+ * *	report	statistics the client reported at the end of its run
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Serve one client from the initial SEND until its final sync. The mode and
+ * *	iteration count are the ones the client announced in connect_qp.
+ * ******************************************************************************/
+int server_session(struct resources *res, struct session_report *report);
+
+
+/******************************************************************************
+ * *	Function: server_daemon
+ * *
+ * *	Input
+ * *	res	pointer to initialized resources structure
+ * *
+ * *	Output
+ * *	res	device, PD and MR filled in, to be released by resources_destroy
+ * *
+ * *	Returns
+ * *	0 on a clean shutdown (SIGINT or SIGTERM), 1 on failure
+ * *
+ * *	Description
+ * *	Open the device and register the buffer once, then serve clients from a
+ * *	poll() event loop on the listening socket until terminated. Up to
+ * *	config.max_clients sessions run at once, each on its own thread, QP and
+ * *	CQ. A failed session is logged and does not stop the server.
+ * ******************************************************************************/
+int server_daemon(struct resources *res);
+
+#endif // SERVER_H_
@@ -0,0 +1,389 @@
+/* vim: set noet: */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <infiniband/verbs.h>
+
+#include "resources.h"
+#include "transport.h"
+#include "sim.h"
+#include "topology.h"
+
+#define SIM_LINE_SIZE 64
+
+struct sim {
+	uint64_t	sets;
+	uint64_t	ways;
+	uint64_t	ddio_ways;	/* ways a write may allocate into */
+	int		read_alloc;
+	uint64_t	prefetch;	/* lines after a write that it pulls in too */
+	uint64_t	*tags;		/* sets * ways, line number + 1, 0 when empty */
+	uint64_t	*stamps;	/* last use of each way, for LRU */
+	uint64_t	clock;
+
+	double		hit_mean;
+	double		miss_mean;
+	double		sd;
+	uint64_t	rng;		/* xorshift64* state */
+	double		spare;		/* second Box-Muller value */
+	int		have_spare;
+
+	char		*region;
+	size_t		size;
+	int		last_hit;
+};
+
+
+struct sim *sim_new(const char *params)
+{
+	enum { LLC, WAYS, DDIO, HIT, MISS, SD, RALLOC, SEED, PF };
+	char *const	tokens[] = {
+		[LLC] = "llc", [WAYS] = "ways", [DDIO] = "ddio", [HIT] = "hit",
+		[MISS] = "miss", [SD] = "sd", [RALLOC] = "ralloc", [SEED] = "seed",
+		[PF] = "pf", NULL
+	};
+	struct sim	*sim;
+	char		*opts = NULL, *p, *value;
+	uint64_t	llc = 20 << 20;
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return NULL;
+
+	sim->ways = 20;
+	sim->ddio_ways = 2;
+	sim->hit_mean = 4300;
+	sim->miss_mean = 4800;
+	sim->sd = 150;
+	sim->rng = 1;
+
+	if (params) {
+		opts = p = strdup(params);
+		while (p && *p) {
+			int opt = getsubopt(&p, tokens, &value);
+
+			if (opt < 0 || !value) {
+				fprintf(stderr, "bad simulator parameter '%s'\n", value ? value : "");
+				goto sim_new_fail;
+			}
+
+			switch (opt) {
+				case LLC: llc = parse_size(value); break;
+				case WAYS: sim->ways = strtoull(value, NULL, 0); break;
+				case DDIO: sim->ddio_ways = strtoull(value, NULL, 0); break;
+				case HIT: sim->hit_mean = strtod(value, NULL); break;
+				case MISS: sim->miss_mean = strtod(value, NULL); break;
+				case SD: sim->sd = strtod(value, NULL); break;
+				case RALLOC: sim->read_alloc = atoi(value); break;
+				case SEED: sim->rng = strtoull(value, NULL, 0); break;
+				case PF: sim->prefetch = strtoull(value, NULL, 0); break;
+			}
+		}
+		free(opts);
+		opts = NULL;
+	}
+
+	if (!sim->ways || llc < sim->ways * SIM_LINE_SIZE || sim->ddio_ways > sim->ways) {
+		fprintf(stderr, "bad simulator geometry: llc=%lu ways=%lu ddio=%lu\n", llc, sim->ways, sim->ddio_ways);
+		goto sim_new_fail;
+	}
+	if (!sim->ddio_ways)
+		sim->ddio_ways = sim->ways;
+	if (!sim->rng)
+		sim->rng = 1;
+
+	sim->sets = llc / (sim->ways * SIM_LINE_SIZE);
+	sim->tags = calloc(sim->sets * sim->ways, sizeof(*sim->tags));
+	sim->stamps = calloc(sim->sets * sim->ways, sizeof(*sim->stamps));
+	if (!sim->tags || !sim->stamps) {
+		fprintf(stderr, "failed to allocate simulator state\n");
+		goto sim_new_fail;
+	}
+
+	debug_print("simulated LLC: %lu sets x %lu ways, writes allocate into %lu\n", sim->sets, sim->ways, sim->ddio_ways);
+
+	return sim;
+
+sim_new_fail:
+	free(opts);
+	sim_free(sim);
+	return NULL;
+}
+
+
+void sim_free(struct sim *sim)
+{
+	if (!sim)
+		return;
+
+	free(sim->tags);
+	free(sim->stamps);
+	free(sim->region);
+	free(sim);
+}
+
+
+int sim_map(struct sim *sim, size_t size)
+{
+	/* calloc leaves the pages untouched until the probes get to them */
+	sim->region = calloc(1, size);
+	if (!sim->region) {
+		fprintf(stderr, "failed to allocate %zu bytes of simulated server buffer\n", size);
+		return 1;
+	}
+	sim->size = size;
+
+	return 0;
+}
+
+
+char *sim_region(struct sim *sim)
+{
+	return sim->region;
+}
+
+
+void sim_topology(struct sim *sim, struct cache_topology *t)
+{
+	t->line_size = SIM_LINE_SIZE;
+	t->ways = sim->ways;
+	t->slices = 0;
+	t->llc_size = sim->sets * sim->ways * SIM_LINE_SIZE;
+}
+
+
+int sim_access(struct sim *sim, uint64_t offset, int write)
+{
+	uint64_t	line = offset / SIM_LINE_SIZE;
+	uint64_t	*tags = sim->tags + (line % sim->sets) * sim->ways;
+	uint64_t	*stamps = sim->stamps + (line % sim->sets) * sim->ways;
+	uint64_t	w, victim = 0;
+
+	sim->clock++;
+
+	for (w = 0; w < sim->ways; w++) {
+		if (tags[w] == line + 1) {
+			stamps[w] = sim->clock;
+			return 1;
+		}
+	}
+
+	if (!write && !sim->read_alloc)
+		return 0;
+
+	/* allocate into the least recently used of the DDIO ways */
+	for (w = 1; w < sim->ddio_ways; w++)
+		if (stamps[w] < stamps[victim])
+			victim = w;
+
+	tags[victim] = line + 1;
+	stamps[victim] = sim->clock;
+
+	return 0;
+}
+
+
+void sim_flush(struct sim *sim, uint64_t offset)
+{
+	uint64_t	line = offset / SIM_LINE_SIZE;
+	uint64_t	*tags = sim->tags + (line % sim->sets) * sim->ways;
+	uint64_t	w;
+
+	for (w = 0; w < sim->ways; w++)
+		if (tags[w] == line + 1)
+			tags[w] = 0;
+}
+
+
+static uint64_t sim_rand(struct sim *sim)
+{
+	sim->rng ^= sim->rng >> 12;
+	sim->rng ^= sim->rng << 25;
+	sim->rng ^= sim->rng >> 27;
+	return sim->rng * 0x2545f4914f6cdd1dull;
+}
+
+
+/* standard normal deviate, Box-Muller */
+static double sim_gauss(struct sim *sim)
+{
+	double u, v, r;
+
+	if (sim->have_spare) {
+		sim->have_spare = 0;
+		return sim->spare;
+	}
+
+	u = ((sim_rand(sim) >> 11) + 1.0) / 9007199254740993.0;
+	v = (sim_rand(sim) >> 11) / 9007199254740992.0;
+	r = sqrt(-2 * log(u));
+
+	sim->spare = r * sin(2 * M_PI * v);
+	sim->have_spare = 1;
+
+	return r * cos(2 * M_PI * v);
+}
+
+
+uint64_t sim_latency(struct sim *sim, int hit)
+{
+	double cycles = (hit ? sim->hit_mean : sim->miss_mean) + sim->sd * sim_gauss(sim);
+
+	return cycles < 1 ? 1 : (uint64_t) cycles;
+}
+
+
+static int sim_create(struct resources *res)
+{
+	res->sim = sim_new(config.sim_params);
+	if (!res->sim)
+		return 1;
+
+	/* the simulated LLC is the server's, size the region from it */
+	sim_topology(res->sim, &server_cache);
+	topology_size_buffer(&server_cache);
+	if (sim_map(res->sim, buffer_size()))
+		return 1;
+
+	res->buf = calloc(config.batch, config.msg_size);
+	if (!res->buf) {
+		fprintf(stderr, "failed to malloc %u bytes to memory buffer\n", config.msg_size * config.batch);
+		return 1;
+	}
+	res->size = config.msg_size * config.batch;
+
+	/* the client addresses the simulated region as if it were the server's MR */
+	memset(&res->remote_props, 0, sizeof(res->remote_props));
+	res->remote_props.addr = (uintptr_t) sim_region(res->sim);
+
+	return 0;
+}
+
+
+/* the simulated server has always sent its message already */
+static int sim_poll_completion(struct resources *res)
+{
+	(void) res;
+	return 0;
+}
+
+
+static int sim_probe(struct resources *res, int opcode, uint64_t *cycle_count)
+{
+	struct sim	*sim = res->sim;
+	uint64_t	offset = res->remote_props.addr - (uintptr_t) sim->region;
+	uint64_t	line, i;
+	int		write = opcode == IBV_WR_RDMA_WRITE;
+	int		hit = 1;
+
+	if (res->remote_props.addr < (uintptr_t) sim->region || offset + config.msg_size > sim->size) {
+		fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", IBV_WC_REM_ACCESS_ERR, 0);
+		return 1;
+	}
+
+	/* a message spanning several lines only hits if all of them do */
+	for (line = offset & ~(uint64_t)(SIM_LINE_SIZE - 1); line < offset + config.msg_size; line += SIM_LINE_SIZE)
+		hit &= sim_access(sim, line, write);
+
+	/* an adjacent-line prefetcher pulls the lines after a write in with it */
+	for (i = 0; write && i < sim->prefetch; i++, line += SIM_LINE_SIZE)
+		sim_access(sim, line, write);
+
+	if (write)
+		memcpy(sim->region + offset, res->buf, config.msg_size);
+	else
+		memcpy(res->buf, sim->region + offset, config.msg_size);
+
+	sim->last_hit = hit;
+	*cycle_count = sim_latency(sim, hit);
+
+	return 0;
+}
+
+
+/* Probe each line in turn, then hold every completion back until the one
+ * posted before it is in, as an RC QP delivers them in order. */
+static int sim_probe_batch(struct resources *res, int opcode, const uint64_t *addrs, int n, uint64_t *cycles, int *hits)
+{
+	uint64_t	orig_addr = res->remote_props.addr;
+	char		*orig_buf = res->buf;
+	int		i, rc = 0;
+
+	for (i = 0; i < n && !rc; i++) {
+		res->remote_props.addr = addrs[i];
+		res->buf = orig_buf + i * config.msg_size;
+		rc = sim_probe(res, opcode, &cycles[i]);
+		hits[i] = res->sim->last_hit;
+		if (i && cycles[i] < cycles[i - 1])
+			cycles[i] = cycles[i - 1];
+	}
+
+	res->remote_props.addr = orig_addr;
+	res->buf = orig_buf;
+
+	return rc;
+}
+
+
+/* There is no peer to sync with, echo the data back. In clflush mode this is
+ * where the server would flush its first line, so do that too, and before
+ * the calibration where it would sweep its LLC. */
+static int sim_sync(struct resources *res, int xfer_size, char *local_data, char *remote_data)
+{
+	if (config.mode == 2 && xfer_size == 1 && local_data[0] == 'A')
+		sim_flush(res->sim, 0);
+	if (xfer_size == 1 && local_data[0] == 'S')
+		memset(res->sim->tags, 0, res->sim->sets * res->sim->ways * sizeof(*res->sim->tags));
+
+	memmove(remote_data, local_data, xfer_size);
+
+	return 0;
+}
+
+
+/* The model has no eviction buffer to walk, the helper's walk ends with
+ * the line out of the LLC, so drop it. */
+static int sim_evict(struct resources *res, uint64_t addr)
+{
+	uint64_t offset = addr - (uintptr_t) sim_region(res->sim);
+	uint64_t line;
+
+	for (line = offset & ~(uint64_t)(SIM_LINE_SIZE - 1); line < offset + config.msg_size; line += SIM_LINE_SIZE)
+		sim_flush(res->sim, line);
+
+	return 0;
+}
+
+
+static int sim_last_hit(struct resources *res)
+{
+	return res->sim->last_hit;
+}
+
+
+static int sim_destroy(struct resources *res)
+{
+	sim_free(res->sim);
+	res->sim = NULL;
+
+	free(res->buf);
+	res->buf = NULL;
+
+	return 0;
+}
+
+
+const struct transport sim_transport = {
+	.name = "sim",
+	.create = sim_create,
+	.poll_completion = sim_poll_completion,
+	.probe = sim_probe,
+	.probe_batch = sim_probe_batch,
+	.sync = sim_sync,
+	.evict = sim_evict,
+	.last_hit = sim_last_hit,
+	.destroy = sim_destroy,
+};
@@ -0,0 +1,79 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Simulated server
+ *
+ * An in-process stand in for the server behind sim_transport. It models the
+ * server's LLC as a set-associative LRU cache in which RDMA writes may only
+ * allocate into the first few (DDIO) ways and RDMA reads that miss do not
+ * allocate at all, and it draws each probe's latency from a hit or a miss
+ * distribution. Because the model knows whether every access hit, its runs
+ * come with ground truth.
+ *
+ * Parameters are given as a getsubopt() string, e.g.
+ * "llc=20M,ways=20,ddio=2,hit=4300,miss=4800,sd=150,seed=1,pf=0":
+ *
+ *	llc	LLC size in bytes, K/M/G suffixes allowed (default 20M)
+ *	ways	associativity (default 20)
+ *	ddio	ways RDMA writes may allocate into, 0 for all of them (default 2)
+ *	hit	mean latency of a hit in cycles (default 4300)
+ *	miss	mean latency of a miss in cycles (default 4800)
+ *	sd	standard deviation of both latencies in cycles (default 150)
+ *	ralloc	1 to let read misses allocate like writes do (default 0)
+ *	seed	seed of the latency generator (default 1)
+ *	pf	lines after a written one the write pulls in too (default 0)
+ *
+ * ******************************************************************************/
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "topology.h"
+
+struct sim;
+
+/******************************************************************************
+ * *	Function: sim_new
+ * *
+ * *	Input
+ * *	params	parameter string as above, NULL for the defaults
+ * *
+ * *	Returns
+ * *	the model without a buffer yet, NULL on a bad parameter or
+ * *	allocation failure
+ * ******************************************************************************/
+struct sim *sim_new(const char *params);
+
+void sim_free(struct sim *sim);
+
+/* give the model a zeroed buffer of size bytes, 0 on success */
+int sim_map(struct sim *sim, size_t size);
+
+/* the simulated server buffer */
+char *sim_region(struct sim *sim);
+
+/* the simulated LLC, as topology_read would describe it */
+void sim_topology(struct sim *sim, struct cache_topology *t);
+
+/******************************************************************************
+ * *	Function: sim_access
+ * *
+ * *	Input
+ * *	sim	the model
+ * *	offset	byte offset of the line in the region
+ * *	write	1 for an RDMA write, 0 for an RDMA read
+ * *
+ * *	Returns
+ * *	1 if the line was in the LLC, 0 if it was not
+ * ******************************************************************************/
+int sim_access(struct sim *sim, uint64_t offset, int write);
+
+/* drop a line from the LLC, like clflush */
+void sim_flush(struct sim *sim, uint64_t offset);
+
+/* draw a latency in cycles from the hit or the miss distribution */
+uint64_t sim_latency(struct sim *sim, int hit);
+
+#endif // SIM_H_
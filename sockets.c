@@ -73,6 +73,54 @@ sock_connect_exit:
 	return sockfd;
 }
 
+int sock_listen(int port, int backlog)
+{
+	struct addrinfo	*resolved_addr = NULL;
+	struct addrinfo	*iterator;
+	char		service[6];
+	int		listenfd = -1;
+	int		rc;
+	int		one = 1;
+	struct addrinfo hints =	{
+		.ai_flags = AI_PASSIVE,
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM
+	};
+
+	if (sprintf(service, "%d", port) < 0)
+		return -1;
+
+	rc = getaddrinfo(NULL, service, &hints, &resolved_addr);
+	if (rc < 0) {
+		fprintf(stderr, "%s for port %d\n", gai_strerror(rc), port);
+		return -1;
+	}
+
+	for (iterator = resolved_addr; iterator ; iterator = iterator->ai_next) {
+		listenfd = socket(iterator->ai_family, iterator->ai_socktype, iterator->ai_protocol);
+		if (listenfd < 0)
+			continue;
+
+		/* a restarted daemon should not have to wait out TIME_WAIT */
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if (!bind(listenfd, iterator->ai_addr, iterator->ai_addrlen) && !listen(listenfd, backlog))
+			break;
+
+		close(listenfd);
+		listenfd = -1;
+	}
+
+	freeaddrinfo(resolved_addr);
+
+	if (listenfd < 0) {
+		perror("server listen");
+		fprintf(stderr, "Couldn't listen on port %d\n", port);
+	}
+
+	return listenfd;
+}
+
 int sock_sync_data(int sock, int xfer_size, char *local_data, char *remote_data)
 {
 	int	rc;
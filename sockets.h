@@ -33,6 +33,27 @@
 int sock_connect(const char *servername, int port);
 
 
+/******************************************************************************
+ * *	Function: sock_listen
+ * *
+ *  *	Input
+ *  *	port	port of service
+ *  *	backlog	number of pending connections the kernel may queue
+ *  *
+ *  *	Output
+ *  *	none
+ *  *
+ *  *	Returns
+ *  *	listening socket (fd) on success, negative error code on failure
+ *  *
+ *  *	Description
+ *  *	Bind and listen on the indicated port without accepting a connection.
+ *  *	Used by the persistent server, which accepts clients from its event loop.
+ *  *
+ *  ******************************************************************************/
+int sock_listen(int port, int backlog);
+
+
 /******************************************************************************
  * *	Function: sock_sync_data
  * *
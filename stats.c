@@ -0,0 +1,258 @@
+/* vim: set noet: */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "resources.h"
+#include "transport.h"
+#include "stats.h"
+
+#define REPORT_WORDS 9
+#define HIST_ROWS 32	/* rows hist_print folds the populated range into */
+#define HIST_BAR 30	/* width of the longest bar */
+
+void stats_init(struct stats *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->min = UINT64_MAX;
+}
+
+
+double stats_stddev(const struct stats *s)
+{
+	if (s->count < 2)
+		return 0;
+
+	return sqrt(s->m2 / (s->count - 1));
+}
+
+
+void hist_init(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+
+void hist_classify(const struct histogram *h, struct classifier *c)
+{
+	uint64_t	b, below1 = 0, below2 = 0;
+	double		n1 = h->total[0], n2 = h->total[1];
+
+	/* a threshold of 0 calls everything a miss */
+	memset(c, 0, sizeof(*c));
+	c->miss_rate = 1;
+	c->accuracy = 0.5;
+	if (!n1 || !n2)
+		return;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		double miss_rate, hit_rate, accuracy;
+
+		below1 += h->count[0][b];
+		below2 += h->count[1][b];
+		miss_rate = 1 - below1 / n1;
+		hit_rate = below2 / n2;
+		accuracy = (miss_rate + hit_rate) / 2;
+
+		if (accuracy > c->accuracy) {
+			c->threshold = (b + 1) * HIST_WIDTH;
+			c->accuracy = accuracy;
+			c->miss_rate = miss_rate;
+			c->hit_rate = hit_rate;
+		}
+	}
+}
+
+
+uint64_t hist_below(const struct histogram *h, int which, uint64_t threshold)
+{
+	uint64_t b, n = 0;
+
+	for (b = 0; b < HIST_BUCKETS && (b + 1) * HIST_WIDTH <= threshold; b++)
+		n += h->count[which][b];
+
+	return n;
+}
+
+
+void hist_score(const struct histogram *h, uint64_t threshold, struct classifier *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->threshold = threshold;
+	c->miss_rate = h->total[0] ? 1 - (double) hist_below(h, 0, threshold) / h->total[0] : 0;
+	c->hit_rate = h->total[1] ? (double) hist_below(h, 1, threshold) / h->total[1] : 0;
+	c->accuracy = (c->miss_rate + c->hit_rate) / 2;
+}
+
+
+uint64_t hist_percentile(const struct histogram *h, int which, double part)
+{
+	uint64_t	b, seen = 0;
+	double		target = part * h->total[which];
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->count[which][b];
+		if (seen > target)
+			return b * HIST_WIDTH;
+	}
+
+	return HIST_BUCKETS * HIST_WIDTH;
+}
+
+
+/* first bucket at which the combined count passes `part` of all samples */
+static uint64_t hist_quantile(const struct histogram *h, double part)
+{
+	uint64_t	b, seen = 0;
+	double		target = part * (h->total[0] + h->total[1]);
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->count[0][b] + h->count[1][b];
+		if (seen > target)
+			return b;
+	}
+
+	return HIST_BUCKETS - 1;
+}
+
+
+void hist_print(FILE *f, const struct histogram *h, const struct classifier *c, double cycles_to_usec)
+{
+	static const char	bar[HIST_BAR + 1] = "##############################";
+	double			ns_per_cycle = 1000 / cycles_to_usec;
+	uint64_t		lo, hi, step, b, i, peak = 1;
+
+	if (!h->total[0] && !h->total[1])
+		return;
+
+	lo = hist_quantile(h, 0.001);
+	hi = hist_quantile(h, 0.999);
+	step = (hi - lo) / HIST_ROWS + 1;
+
+	for (b = lo; b <= hi; b += step) {
+		uint64_t c1 = 0, c2 = 0;
+
+		for (i = b; i < b + step && i < HIST_BUCKETS; i++) {
+			c1 += h->count[0][i];
+			c2 += h->count[1][i];
+		}
+		if (c1 > peak)
+			peak = c1;
+		if (c2 > peak)
+			peak = c2;
+	}
+
+	fprintf(f, "%12s %9s %9s  %-*s  %s\n", "ns", "read1", "read2", HIST_BAR, "read1", "read2");
+	for (b = lo; b <= hi; b += step) {
+		uint64_t c1 = 0, c2 = 0;
+
+		for (i = b; i < b + step && i < HIST_BUCKETS; i++) {
+			c1 += h->count[0][i];
+			c2 += h->count[1][i];
+		}
+		fprintf(f, "%12.1f %9lu %9lu  %-*.*s  %.*s\n",
+				b * HIST_WIDTH * ns_per_cycle, c1, c2,
+				HIST_BAR, (int) (c1 * HIST_BAR / peak), bar,
+				(int) (c2 * HIST_BAR / peak), bar);
+	}
+	if (h->overflow[0] || h->overflow[1]) {
+		char above[32];
+
+		snprintf(above, sizeof(above), ">%.1f", HIST_BUCKETS * HIST_WIDTH * ns_per_cycle);
+		fprintf(f, "%12s %9lu %9lu\n", above, h->overflow[0], h->overflow[1]);
+	}
+
+	fprintf(f, "threshold=%.1f ns (%lu cycles) accuracy=%.2f%% read1 miss=%.2f%% read2 hit=%.2f%%\n",
+			c->threshold * ns_per_cycle, c->threshold,
+			c->accuracy * 100, c->miss_rate * 100, c->hit_rate * 100);
+}
+
+
+void session_report_fill(struct session_report *r, const struct stats *read1, const struct stats *read2, double cycles_to_usec)
+{
+	double ns_per_cycle = 1000 / cycles_to_usec;
+
+	memset(r, 0, sizeof(*r));
+	r->samples = read1->count;
+	if (!r->samples)
+		return;
+
+	r->read1_mean = read1->mean * ns_per_cycle;
+	r->read1_stddev = stats_stddev(read1) * ns_per_cycle;
+	r->read1_min = read1->min * ns_per_cycle;
+	r->read1_max = read1->max * ns_per_cycle;
+	r->read2_mean = read2->mean * ns_per_cycle;
+	r->read2_stddev = stats_stddev(read2) * ns_per_cycle;
+	r->read2_min = read2->min * ns_per_cycle;
+	r->read2_max = read2->max * ns_per_cycle;
+}
+
+
+static uint64_t htond(double d)
+{
+	uint64_t u;
+
+	memcpy(&u, &d, sizeof(u));
+	return htonll(u);
+}
+
+
+static double ntohd(uint64_t u)
+{
+	double d;
+
+	u = ntohll(u);
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+
+int session_report_exchange(struct resources *res, const struct session_report *local, struct session_report *remote)
+{
+	uint64_t	out[REPORT_WORDS];
+	uint64_t	in[REPORT_WORDS];
+
+	out[0] = htonll(local->samples);
+	out[1] = htond(local->read1_mean);
+	out[2] = htond(local->read1_stddev);
+	out[3] = htond(local->read1_min);
+	out[4] = htond(local->read1_max);
+	out[5] = htond(local->read2_mean);
+	out[6] = htond(local->read2_stddev);
+	out[7] = htond(local->read2_min);
+	out[8] = htond(local->read2_max);
+
+	if (transport_sync(res, sizeof(out), (char *) out, (char *) in)) {
+		fprintf(stderr, "failed to exchange session report\n");
+		return 1;
+	}
+
+	remote->samples = ntohll(in[0]);
+	remote->read1_mean = ntohd(in[1]);
+	remote->read1_stddev = ntohd(in[2]);
+	remote->read1_min = ntohd(in[3]);
+	remote->read1_max = ntohd(in[4]);
+	remote->read2_mean = ntohd(in[5]);
+	remote->read2_stddev = ntohd(in[6]);
+	remote->read2_min = ntohd(in[7]);
+	remote->read2_max = ntohd(in[8]);
+
+	return 0;
+}
+
+
+void session_report_print(FILE *f, const struct session_report *r)
+{
+	double pooled, separation = 0;
+
+	pooled = sqrt((r->read1_stddev * r->read1_stddev + r->read2_stddev * r->read2_stddev) / 2);
+	if (pooled > 0)
+		separation = (r->read1_mean - r->read2_mean) / pooled;
+
+	fprintf(f, "samples=%lu read1=%.1f+-%.1f [%.1f,%.1f] ns read2=%.1f+-%.1f [%.1f,%.1f] ns separation=%.2f\n",
+			r->samples,
+			r->read1_mean, r->read1_stddev, r->read1_min, r->read1_max,
+			r->read2_mean, r->read2_stddev, r->read2_min, r->read2_max,
+			separation);
+}
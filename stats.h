@@ -0,0 +1,183 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Sample statistics
+ *
+ * Running summaries of read latencies, kept in O(1) memory so they can be
+ * updated on every probe, and the per-session report a client hands to the
+ * server when it is done.
+ *
+ * Histograms of both reads and the hit/miss threshold that best separates
+ * them, shared by the remote modes and the local backend so their numbers
+ * can be compared directly.
+ *
+ * ******************************************************************************/
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "resources.h"
+
+/* running min/max/mean/variance of a stream of cycle counts (Welford) */
+struct stats {
+	uint64_t	count;
+	uint64_t	min;
+	uint64_t	max;
+	double		mean;
+	double		m2;	/* sum of squared deviations from the mean */
+};
+
+/* summary of one client's session, all latencies in nanoseconds */
+struct session_report {
+	uint64_t	samples;
+	double		read1_mean;
+	double		read1_stddev;
+	double		read1_min;
+	double		read1_max;
+	double		read2_mean;
+	double		read2_stddev;
+	double		read2_min;
+	double		read2_max;
+};
+
+/* latency histogram of the first and the second reads, in cycles */
+#define HIST_WIDTH	2	/* cycles per bucket */
+#define HIST_BUCKETS	8192	/* anything past HIST_WIDTH * HIST_BUCKETS overflows */
+
+struct histogram {
+	uint64_t	count[2][HIST_BUCKETS];	/* [0] first reads, [1] second reads */
+	uint64_t	overflow[2];
+	uint64_t	total[2];
+};
+
+/* best single threshold between the first (miss) and second (hit) reads */
+struct classifier {
+	uint64_t	threshold;	/* cycles, reads at or above it are misses */
+	double		accuracy;	/* balanced accuracy, mean of the two rates below */
+	double		miss_rate;	/* first reads classified as misses */
+	double		hit_rate;	/* second reads classified as hits */
+};
+
+void stats_init(struct stats *s);
+
+static inline void stats_add(struct stats *s, uint64_t v)
+{
+	double delta;
+
+	if (v < s->min)
+		s->min = v;
+	if (v > s->max)
+		s->max = v;
+
+	s->count++;
+	delta = v - s->mean;
+	s->mean += delta / s->count;
+	s->m2 += delta * (v - s->mean);
+}
+
+double stats_stddev(const struct stats *s);
+
+
+void hist_init(struct histogram *h);
+
+/* which is 0 for a first read, 1 for a second read */
+static inline void hist_add(struct histogram *h, int which, uint64_t cycles)
+{
+	uint64_t b = cycles / HIST_WIDTH;
+
+	if (b < HIST_BUCKETS)
+		h->count[which][b]++;
+	else
+		h->overflow[which]++;
+	h->total[which]++;
+}
+
+
+/******************************************************************************
+ * *	Function: hist_classify
+ * *
+ * *	Input
+ * *	h	histogram of a run
+ * *
+ * *	Output
+ * *	c	threshold with the highest balanced accuracy
+ * *
+ * *	Returns
+ * *	none
+ * *
+ * *	Description
+ * *	Treat every first read as a miss and every second read as a hit and
+ * *	try each bucket boundary as the cutoff. Balanced accuracy is used so an
+ * *	uneven number of samples does not pull the threshold either way.
+ * ******************************************************************************/
+void hist_classify(const struct histogram *h, struct classifier *c);
+
+/* number of `which` reads below threshold cycles, i.e. classified as hits */
+uint64_t hist_below(const struct histogram *h, int which, uint64_t threshold);
+
+/* how the given threshold classifies h, as hist_classify's best one would be described */
+void hist_score(const struct histogram *h, uint64_t threshold, struct classifier *c);
+
+/* cycles below which `part` (0 to 1) of the `which` reads are, HIST_WIDTH * HIST_BUCKETS past the last bucket */
+uint64_t hist_percentile(const struct histogram *h, int which, double part);
+
+
+/******************************************************************************
+ * *	Function: hist_print
+ * *
+ * *	Description
+ * *	Print the populated range of h (without the outer 0.1% on either side)
+ * *	as a text histogram in nanoseconds, followed by the classifier c.
+ * ******************************************************************************/
+void hist_print(FILE *f, const struct histogram *h, const struct classifier *c, double cycles_to_usec);
+
+
+/******************************************************************************
+ * *	Function: session_report_fill
+ * *
+ * *	Input
+ * *	read1		statistics of the first (expected miss) reads
+ * *	read2		statistics of the second (expected hit) reads
+ * *	cycles_to_usec	cycles per microsecond, from get_cpu_mhz
+ * *
+ * *	Output
+ * *	r	report with the statistics converted to nanoseconds
+ * *
+ * *	Returns
+ * *	none
+ * ******************************************************************************/
+void session_report_fill(struct session_report *r, const struct stats *read1, const struct stats *read2, double cycles_to_usec);
+
+
+/******************************************************************************
+ * *	Function: session_report_exchange
+ * *
+ * *	Input
+ * *	res	connection to transfer the report on
+ * *	local	report to send
+ * *
+ * *	Output
+ * *	remote	report received from the other side
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Swap reports with transport_sync. Doubles are sent as their IEEE 754 bit
+ * *	pattern in network byte order.
+ * ******************************************************************************/
+int session_report_exchange(struct resources *res, const struct session_report *local, struct session_report *remote);
+
+
+/******************************************************************************
+ * *	Function: session_report_print
+ * *
+ * *	Description
+ * *	Print a one line summary of r, including the hit/miss separation (the
+ * *	difference of the means over the pooled standard deviation).
+ * ******************************************************************************/
+void session_report_print(FILE *f, const struct session_report *r);
+
+#endif // STATS_H_
@@ -0,0 +1,347 @@
+/* vim: set noet: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <infiniband/verbs.h>
+
+#include "resources.h"
+#include "transport.h"
+#include "stats.h"
+#include "pattern.h"
+#include "sweep.h"
+#include "topology.h"
+
+#define SWEEP_PAGE	4096
+#define BASE_STRIDE	1024	/* lines between the lines trials are built around */
+
+
+/* One READ or WRITE at addr, leaving remote_props.addr as it was */
+static int probe_at(struct resources *res, int opcode, uint64_t addr, uint64_t *cycles, int *hit)
+{
+	uint64_t	orig_addr = res->remote_props.addr;
+	int		rc;
+
+	res->remote_props.addr = addr;
+	rc = transport_probe(res, opcode, cycles);
+	*hit = transport_last_hit(res);
+	res->remote_props.addr = orig_addr;
+
+	return rc;
+}
+
+
+/* Add a cold and a just written control read to the run's statistics */
+static void add_controls(const struct sweep_stats *out, uint64_t cold, uint64_t warm)
+{
+	stats_add(out->read1, cold);
+	stats_add(out->read2, warm);
+	hist_add(out->hist, 0, cold);
+	hist_add(out->hist, 1, warm);
+}
+
+
+static int offset_index(const int *offsets, int n, int offset)
+{
+	int i;
+
+	for (i = 0; i < n && offsets[i] != offset; i++);
+	return i;
+}
+
+
+int prefetch_sweep(struct resources *res, const struct sweep_stats *out, double cycles_to_usec)
+{
+	uint32_t		line = topology_line(&server_cache);
+	uint64_t		lines = buffer_size() / line;
+	uint64_t		bases = lines / BASE_STRIDE;
+	uint64_t		start = res->remote_props.addr;
+	uint64_t		base, cold, warm, cycles, next = 0;
+	struct histogram	*offset_hist = NULL;
+	struct stats		offset_stats[2 * MAX_PF_LINES + 4];
+	struct classifier	c;
+	int			offsets[2 * MAX_PF_LINES + 4];
+	double			hit_rate[2 * MAX_PF_LINES + 4];
+	int			page_lines = SWEEP_PAGE > line ? SWEEP_PAGE / line : 1;
+	int			n = 0, i, it, hit, reach_fwd, reach_back, rc = 1;
+
+	if (!bases) {
+		fprintf(stderr, "the prefetch sweep needs a buffer of at least %d lines\n", BASE_STRIDE);
+		return 1;
+	}
+
+	/* neighbours within pf_lines, then one and two pages away */
+	offsets[n++] = -2 * page_lines;
+	offsets[n++] = -page_lines;
+	for (i = -config.pf_lines; i <= config.pf_lines; i++)
+		if (i)
+			offsets[n++] = i;
+	offsets[n++] = page_lines;
+	offsets[n++] = 2 * page_lines;
+
+	offset_hist = calloc(n, sizeof(*offset_hist));
+	if (!offset_hist) {
+		fprintf(stderr, "failed to allocate prefetch sweep histograms\n");
+		return 1;
+	}
+	for (i = 0; i < n; i++)
+		stats_init(&offset_stats[i]);
+
+	for (it = 0; it < config.iters; it++) {
+		for (i = 0; i < n; i++) {
+			/* every trial gets a line in the middle of a fresh BASE_STRIDE
+			 * block, with the block's first line as the cold control */
+			base = start + (next * BASE_STRIDE + BASE_STRIDE / 2) * line;
+			next = (next + 1) % bases;
+
+			if (probe_at(res, IBV_WR_RDMA_READ, base - BASE_STRIDE / 2 * line, &cold, &hit))
+				goto prefetch_sweep_exit;
+
+			res->buf[0] += 2;
+			if (probe_at(res, IBV_WR_RDMA_WRITE, base, &cycles, &hit))
+				goto prefetch_sweep_exit;
+
+			if (probe_at(res, IBV_WR_RDMA_READ, base + (int64_t) offsets[i] * line, &cycles, &hit))
+				goto prefetch_sweep_exit;
+			stats_add(&offset_stats[i], cycles);
+			hist_add(&offset_hist[i], 0, cycles);
+
+			if (hit >= 0)
+				data_print("%d,%lu,%f,%d\n", offsets[i], cycles, cycles * 1000 / cycles_to_usec, hit);
+			else
+				data_print("%d,%lu,%f\n", offsets[i], cycles, cycles * 1000 / cycles_to_usec);
+
+			if (probe_at(res, IBV_WR_RDMA_READ, base, &warm, &hit))
+				goto prefetch_sweep_exit;
+			add_controls(out, cold, warm);
+		}
+	}
+
+	/* the controls tell us where a hit ends */
+	hist_classify(out->hist, &c);
+
+	for (i = 0; i < n; i++)
+		hit_rate[i] = offset_hist[i].total[0] ? (double) hist_below(&offset_hist[i], 0, c.threshold) / offset_hist[i].total[0] : 0;
+
+	fprintf(stderr, "%8s %9s %9s %7s\n", "offset", "samples", "mean ns", "hit %");
+	for (i = 0; i < n; i++)
+		fprintf(stderr, "%8d %9lu %9.1f %7.2f\n", offsets[i], offset_stats[i].count,
+				offset_stats[i].mean * 1000 / cycles_to_usec, hit_rate[i] * 100);
+
+	/* reach is the last neighbour of an unbroken run of likely hits */
+	for (reach_fwd = 0; reach_fwd < config.pf_lines; reach_fwd++)
+		if (hit_rate[offset_index(offsets, n, reach_fwd + 1)] < 0.5)
+			break;
+	for (reach_back = 0; reach_back < config.pf_lines; reach_back++)
+		if (hit_rate[offset_index(offsets, n, -reach_back - 1)] < 0.5)
+			break;
+
+	fprintf(stderr, "threshold=%.1f ns accuracy=%.2f%%, prefetch reach +%d/-%d lines, seq mode is safe with -c %u at -s %u\n",
+			c.threshold * 1000 / cycles_to_usec, c.accuracy * 100, reach_fwd, reach_back,
+			((reach_fwd + 1) * line + config.msg_size - 1) / config.msg_size, config.msg_size);
+
+	rc = 0;
+
+prefetch_sweep_exit:
+	if (rc)
+		fprintf(stderr, "prefetch sweep failed\n");
+	free(offset_hist);
+	return rc;
+}
+
+
+/* One control trial on a fresh line: read it cold, write it, read it again */
+static int control_trial(struct resources *res, uint64_t addr, const struct sweep_stats *out)
+{
+	uint64_t	cold, warm, cycles;
+	int		hit;
+
+	if (probe_at(res, IBV_WR_RDMA_READ, addr, &cold, &hit))
+		return 1;
+
+	res->buf[0] += 2;
+	if (probe_at(res, IBV_WR_RDMA_WRITE, addr, &cycles, &hit))
+		return 1;
+
+	if (probe_at(res, IBV_WR_RDMA_READ, addr, &warm, &hit))
+		return 1;
+
+	add_controls(out, cold, warm);
+	return 0;
+}
+
+
+/* Write the n lines at addrs, a batch at a time, and read them back one by
+ * one: a chain's later completions wait on its earlier ones, which would
+ * blur the threshold. Returns the second reads under threshold and the ones
+ * that really hit, when the backend knows. */
+static int write_read_back(struct resources *res, const uint64_t *addrs, uint64_t n, uint64_t threshold, uint64_t *hits, int64_t *true_hits)
+{
+	uint64_t	cycles[MAX_BATCH];
+	int		hit[MAX_BATCH];
+	uint64_t	i, m;
+
+	for (i = 0; i < n; i += m) {
+		m = n - i < (uint64_t) config.batch ? n - i : (uint64_t) config.batch;
+		if (transport_probe_batch(res, IBV_WR_RDMA_WRITE, addrs + i, m, cycles, hit))
+			return 1;
+	}
+
+	*hits = 0;
+	*true_hits = 0;
+	for (i = 0; i < n; i++) {
+		if (probe_at(res, IBV_WR_RDMA_READ, addrs[i], &cycles[0], &hit[0]))
+			return 1;
+
+		*hits += cycles[0] < threshold;
+		if (hit[0] < 0 || *true_hits < 0)
+			*true_hits = -1;
+		else
+			*true_hits += hit[0];
+	}
+
+	return 0;
+}
+
+
+#define DDIO_MIN_LINES		16
+#define DDIO_MAX_STEPS		128
+#define DDIO_CALIBRATION	200	/* control trials before the sweep */
+
+int ddio_sweep(struct resources *res, const struct sweep_stats *out, double cycles_to_usec)
+{
+	static const char	*layout_name[2] = { "contiguous", "random" };
+	uint32_t		line = topology_line(&server_cache);
+	uint64_t		lines = buffer_size() / line;
+	uint64_t		start = res->remote_props.addr;
+	uint64_t		max = config.ddio_max;
+	uint64_t		steps[DDIO_MAX_STEPS];
+	struct stats		retained[2][DDIO_MAX_STEPS];
+	double			kept[2][DDIO_MAX_STEPS], kept_ci[2][DDIO_MAX_STEPS];
+	double			false_hit, scale;
+	uint64_t		*addrs = NULL;
+	uint64_t		cursor = 0, offset, hits, w, i;
+	int64_t			true_hits;
+	struct classifier	c;
+	struct pattern		rand_lines;
+	double			step;
+	int			n = 0, s, layout, it, best, knee, rc = 1;
+
+	/* the random layout draws from the lines rand mode uses */
+	if (pattern_init(&rand_lines, 1))
+		return 1;
+	if (max > rand_lines.lines)
+		max = rand_lines.lines;
+	if (max > lines / 2)
+		max = lines / 2;
+	if (max < DDIO_MIN_LINES) {
+		fprintf(stderr, "the DDIO sweep needs a buffer of at least %d lines\n", 2 * DDIO_MIN_LINES);
+		return 1;
+	}
+
+	/* W grows by a quarter of an octave, always by at least one line */
+	for (step = DDIO_MIN_LINES; n < DDIO_MAX_STEPS && (uint64_t) step <= max; step *= 1.189207115) {
+		if (n && (uint64_t) step == steps[n - 1])
+			continue;
+		steps[n++] = step;
+	}
+
+	addrs = malloc(max * sizeof(*addrs));
+	if (!addrs) {
+		fprintf(stderr, "failed to allocate %lu addresses\n", max);
+		return 1;
+	}
+
+	for (it = 0; it < DDIO_CALIBRATION; it++) {
+		if (control_trial(res, start + cursor * line, out))
+			goto ddio_sweep_exit;
+		cursor = (cursor + 1) % lines;
+	}
+	hist_classify(out->hist, &c);
+
+	for (s = 0; s < n; s++) {
+		w = steps[s];
+		for (layout = 0; layout < 2; layout++) {
+			stats_init(&retained[layout][s]);
+
+			for (it = 0; it < config.iters; it++) {
+				/* fresh lines every pass, so the last pass cannot help */
+				if (layout == 0) {
+					if (cursor + w > lines)
+						cursor = 0;
+					for (i = 0; i < w; i++)
+						addrs[i] = start + (cursor + i) * line;
+					cursor += w;
+				} else {
+					if (pattern_init(&rand_lines, 1))
+						goto ddio_sweep_exit;
+					rand_lines.count = w;
+					for (i = 0; pattern_next(&rand_lines, &offset); i++)
+						addrs[i] = start + offset;
+				}
+
+				if (write_read_back(res, addrs, w, c.threshold, &hits, &true_hits))
+					goto ddio_sweep_exit;
+				stats_add(&retained[layout][s], hits);
+
+				if (true_hits >= 0)
+					data_print("%s,%lu,%lu,%ld\n", layout_name[layout], w, hits, true_hits);
+				else
+					data_print("%s,%lu,%lu\n", layout_name[layout], w, hits);
+			}
+		}
+	}
+
+	/* Undo the classifier's mistakes: a fraction f of reads under the
+	 * threshold means (f - false hits) / (true hits - false hits) hit. */
+	false_hit = 1 - c.miss_rate;
+	scale = c.hit_rate - false_hit;
+	if (scale <= 0) {
+		fprintf(stderr, "cold and written lines are indistinguishable, no DDIO estimate\n");
+		goto ddio_sweep_exit;
+	}
+
+	fprintf(stderr, "threshold=%.1f ns accuracy=%.2f%%, hit rates below corrected for it\n", c.threshold * 1000 / cycles_to_usec, c.accuracy * 100);
+	fprintf(stderr, "%8s %24s %24s\n", "W", "contiguous hit % (95% CI)", "random hit % (95% CI)");
+	for (s = 0; s < n; s++) {
+		fprintf(stderr, "%8lu", steps[s]);
+		for (layout = 0; layout < 2; layout++) {
+			struct stats *r = &retained[layout][s];
+
+			kept[layout][s] = (r->mean - false_hit * steps[s]) / scale;
+			kept_ci[layout][s] = 1.96 * stats_stddev(r) / sqrt(r->count) / scale;
+			fprintf(stderr, " %14.2f (+-%6.2f)", kept[layout][s] * 100 / steps[s], kept_ci[layout][s] * 100 / steps[s]);
+		}
+		fprintf(stderr, "\n");
+	}
+
+	/* capacity is the most lines any W kept, the knee the first W that
+	 * surely lost more than a tenth of its lines */
+	for (layout = 0; layout < 2; layout++) {
+		best = 0;
+		knee = -1;
+		for (s = 0; s < n; s++) {
+			if (kept[layout][s] > kept[layout][best])
+				best = s;
+			if (knee < 0 && kept[layout][s] + kept_ci[layout][s] < 0.9 * steps[s])
+				knee = s;
+		}
+
+		fprintf(stderr, "%s: at most %.0f +- %.0f lines (%.0f KiB) retained, at W=%lu, ",
+				layout_name[layout], kept[layout][best], kept_ci[layout][best],
+				kept[layout][best] * line / 1024, steps[best]);
+		if (knee >= 0)
+			fprintf(stderr, "second reads start to miss at W=%lu\n", steps[knee]);
+		else
+			fprintf(stderr, "second reads still hit at W=%lu\n", steps[n - 1]);
+	}
+
+	rc = 0;
+
+ddio_sweep_exit:
+	if (rc)
+		fprintf(stderr, "DDIO sweep failed\n");
+	free(addrs);
+	return rc;
+}
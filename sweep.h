@@ -0,0 +1,73 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Characterization sweeps
+ *
+ * Modes that measure a property of the server's cache rather than probing
+ * a buffer line by line. Each one calibrates its own hit/miss threshold
+ * from control reads of a line known to be cold and a line just written,
+ * and adds those controls to the run's read1/read2 statistics so the
+ * session report and -H still describe the run.
+ *
+ * ******************************************************************************/
+
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#include "resources.h"
+#include "stats.h"
+
+/* where a sweep puts its control reads */
+struct sweep_stats {
+	struct stats		*read1;	/* cold lines */
+	struct stats		*read2;	/* lines just written */
+	struct histogram	*hist;
+};
+
+/* most neighbours on either side the prefetch sweep looks at */
+#define MAX_PF_LINES	32
+
+/******************************************************************************
+ * *	Function: prefetch_sweep
+ * *
+ * *	Input
+ * *	res		connected resources
+ * *	out		statistics to add the control reads to
+ * *	cycles_to_usec	cycles per microsecond, from get_cpu_mhz
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Mode 3. Write one line, then read a single neighbour at an offset of
+ * *	+-1..+-config.pf_lines lines or +-1 and +-2 pages, each trial around a
+ * *	fresh line. Every read is a CSV row "offset,cycles,ns". The hit
+ * *	probability per offset, the prefetch reach on either side and the
+ * *	smallest column count the seq sweep can safely use go to stderr.
+ * ******************************************************************************/
+int prefetch_sweep(struct resources *res, const struct sweep_stats *out, double cycles_to_usec);
+
+
+/******************************************************************************
+ * *	Function: ddio_sweep
+ * *
+ * *	Input
+ * *	res		connected resources
+ * *	out		statistics to add the control reads to
+ * *	cycles_to_usec	cycles per microsecond, from get_cpu_mhz
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	Mode 4. For working sets of W lines, growing by 2^(1/4) from 16 up to
+ * *	config.ddio_max, write W fresh lines and read them back in the same
+ * *	order, config.iters times each, once with the lines contiguous and
+ * *	once scattered at random. Each pass is a CSV row
+ * *	"layout,W,hits[,true hits]". The hit rate and lines retained per W,
+ * *	with 95% confidence intervals, go to stderr, followed by the largest
+ * *	number of lines retained and the W at which most second reads miss.
+ * *	Writes go out config.batch at a time.
+ * ******************************************************************************/
+int ddio_sweep(struct resources *res, const struct sweep_stats *out, double cycles_to_usec);
+
+#endif // SWEEP_H_
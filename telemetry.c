@@ -0,0 +1,307 @@
+/* vim: set noet: */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "get_clock.h"
+#include "print.h"
+#include "telemetry.h"
+
+/* architectural and package C-state residency MSRs */
+#define MSR_IA32_MPERF		0xe7
+#define MSR_IA32_APERF		0xe8
+#define MSR_PKG_C2_RESIDENCY	0x60d
+#define MSR_PKG_C3_RESIDENCY	0x3f8
+#define MSR_PKG_C6_RESIDENCY	0x3f9
+#define MSR_PKG_C7_RESIDENCY	0x3fa
+
+enum { APERF, MPERF, PKG_C2, PKG_C3, PKG_C6, PKG_C7, COUNTERS };
+
+static const struct {
+	uint32_t	msr;
+	const char	*pmu;	/* perf PMU and event offering the same count */
+	const char	*event;
+} sources[COUNTERS] = {
+	[APERF] = { MSR_IA32_APERF, "msr", "aperf" },
+	[MPERF] = { MSR_IA32_MPERF, "msr", "mperf" },
+	[PKG_C2] = { MSR_PKG_C2_RESIDENCY, "cstate_pkg", "c2-residency" },
+	[PKG_C3] = { MSR_PKG_C3_RESIDENCY, "cstate_pkg", "c3-residency" },
+	[PKG_C6] = { MSR_PKG_C6_RESIDENCY, "cstate_pkg", "c6-residency" },
+	[PKG_C7] = { MSR_PKG_C7_RESIDENCY, "cstate_pkg", "c7-residency" },
+};
+
+struct counter {
+	int		fd;	/* perf event, -1 when read from the msr device or missing */
+	int		ok;
+	uint64_t	last;
+};
+
+struct block {
+	uint64_t	first_sample;
+	uint64_t	samples;
+	double		eff_mhz;	/* < 0 when APERF/MPERF are missing */
+	double		cur_mhz;	/* < 0 when cpufreq is missing */
+	double		pkg_c[4];	/* share of the block in C2, C3, C6, C7, < 0 when missing */
+	int		drift;
+};
+
+struct telemetry {
+	int		cpu;
+	double		tsc_mhz;
+	int		msr_fd;
+	int		freq_fd;	/* scaling_cur_freq, -1 without cpufreq */
+	struct counter	counters[COUNTERS];
+	uint64_t	last_tsc;
+	struct block	*blocks;
+	uint64_t	num_blocks;
+	uint64_t	max_blocks;
+	uint64_t	dropped;	/* blocks past max_blocks */
+};
+
+
+/* perf event of a sysfs PMU event such as msr/aperf, counting on cpu */
+static int perf_open(const char *pmu, const char *event, int cpu)
+{
+	struct perf_event_attr	attr;
+	char			path[256];
+	FILE			*f;
+	int			type;
+	long			config;
+
+	snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/type", pmu);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &type) != 1)
+		type = -1;
+	fclose(f);
+
+	snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/events/%s", pmu, event);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "event=%li", &config) != 1)
+		type = -1;
+	fclose(f);
+
+	if (type < 0)
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+
+	return syscall(__NR_perf_event_open, &attr, -1, cpu, -1, 0);
+}
+
+
+static int counter_read(struct telemetry *t, int i, uint64_t *v)
+{
+	if (t->counters[i].fd >= 0)
+		return read(t->counters[i].fd, v, sizeof(*v)) != sizeof(*v);
+
+	return pread(t->msr_fd, v, sizeof(*v), sources[i].msr) != sizeof(*v);
+}
+
+
+/* cpufreq's idea of the current frequency in MHz, -1 without cpufreq */
+static double cur_freq_mhz(struct telemetry *t)
+{
+	char	text[32], *end;
+	ssize_t	n;
+	long	khz;
+
+	/* sysfs regenerates the value on every read from offset 0 */
+	n = t->freq_fd >= 0 ? pread(t->freq_fd, text, sizeof(text) - 1, 0) : -1;
+	if (n <= 0)
+		return -1;
+	text[n] = 0;
+	khz = strtol(text, &end, 10);
+
+	return end == text ? -1 : khz / 1000.0;
+}
+
+
+struct telemetry *telemetry_open(int cpu, double tsc_mhz, uint64_t max_blocks)
+{
+	struct telemetry	*t;
+	char			path[128];
+	int			i, found = 0;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->cpu = cpu;
+	t->tsc_mhz = tsc_mhz;
+
+	/* all of it up front, telemetry_block runs between two probes */
+	t->max_blocks = max_blocks ? max_blocks : 1;
+	t->blocks = calloc(t->max_blocks, sizeof(*t->blocks));
+	if (!t->blocks) {
+		free(t);
+		return NULL;
+	}
+
+	snprintf(path, sizeof(path), "/dev/cpu/%d/msr", cpu);
+	t->msr_fd = open(path, O_RDONLY);
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu);
+	t->freq_fd = open(path, O_RDONLY);
+
+	for (i = 0; i < COUNTERS; i++) {
+		struct counter *c = &t->counters[i];
+
+		c->fd = -1;
+		if (t->msr_fd >= 0)
+			c->ok = !counter_read(t, i, &c->last);
+		if (!c->ok) {
+			c->fd = perf_open(sources[i].pmu, sources[i].event, cpu);
+			c->ok = c->fd >= 0 && !counter_read(t, i, &c->last);
+		}
+		found += c->ok;
+	}
+
+	if (!t->counters[APERF].ok || !t->counters[MPERF].ok)
+		fprintf(stderr, "no APERF/MPERF on cpu %d (needs the msr module or perf access), effective frequency is not recorded\n", cpu);
+	debug_print("telemetry: %d of %d counters on cpu %d\n", found, COUNTERS, cpu);
+
+	t->last_tsc = get_cycles();
+
+	return t;
+}
+
+
+void telemetry_block(struct telemetry *t, uint64_t first_sample, uint64_t samples)
+{
+	struct block	*b;
+	uint64_t	now[COUNTERS], delta[COUNTERS];
+	uint64_t	tsc = get_cycles();
+	uint64_t	dtsc = tsc - t->last_tsc;
+	int		i;
+
+	for (i = 0; i < COUNTERS; i++) {
+		struct counter *c = &t->counters[i];
+
+		if (c->ok && !counter_read(t, i, &now[i])) {
+			delta[i] = now[i] - c->last;
+			c->last = now[i];
+		} else
+			c->ok = 0;
+	}
+	t->last_tsc = tsc;
+
+	/* more blocks than the run was to have, lose them rather than grow here */
+	if (t->num_blocks == t->max_blocks) {
+		t->dropped++;
+		return;
+	}
+
+	b = &t->blocks[t->num_blocks++];
+	memset(b, 0, sizeof(*b));
+	b->first_sample = first_sample;
+	b->samples = samples;
+	b->eff_mhz = -1;
+	if (t->counters[APERF].ok && t->counters[MPERF].ok && delta[MPERF])
+		b->eff_mhz = t->tsc_mhz * delta[APERF] / delta[MPERF];
+	b->cur_mhz = cur_freq_mhz(t);
+	for (i = 0; i < 4; i++)
+		b->pkg_c[i] = t->counters[PKG_C2 + i].ok && dtsc ? (double) delta[PKG_C2 + i] / dtsc : -1;
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+int telemetry_finish(struct telemetry *t, const char *path, double tolerance)
+{
+	double		*eff, median = -1;
+	uint64_t	i, n = 0, drifted = 0;
+	FILE		*f;
+	int		c;
+
+	/* the run's typical frequency is the median over the blocks that have one */
+	eff = malloc((t->num_blocks + 1) * sizeof(*eff));
+	if (eff) {
+		for (i = 0; i < t->num_blocks; i++)
+			if (t->blocks[i].eff_mhz >= 0)
+				eff[n++] = t->blocks[i].eff_mhz;
+		qsort(eff, n, sizeof(*eff), cmp_double);
+		if (n)
+			median = eff[n / 2];
+		free(eff);
+	}
+
+	for (i = 0; median > 0 && i < t->num_blocks; i++) {
+		struct block *b = &t->blocks[i];
+
+		b->drift = b->eff_mhz >= 0 && fabs(b->eff_mhz - median) > tolerance * median;
+		drifted += b->drift;
+	}
+
+	if (median > 0)
+		fprintf(stderr, "telemetry: %lu of %lu blocks drifted more than %.1f%% from %.0f MHz\n",
+				drifted, t->num_blocks, tolerance * 100, median);
+	if (t->dropped)
+		fprintf(stderr, "telemetry: %lu blocks past the %lu expected were not recorded\n", t->dropped, t->max_blocks);
+
+	if (!path)
+		return 0;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+
+	fprintf(f, "block,first_sample,samples,eff_mhz,cur_mhz,pkg_c2,pkg_c3,pkg_c6,pkg_c7,drift\n");
+	for (i = 0; i < t->num_blocks; i++) {
+		struct block *b = &t->blocks[i];
+
+		fprintf(f, "%lu,%lu,%lu,", i, b->first_sample, b->samples);
+		if (b->eff_mhz >= 0)
+			fprintf(f, "%.1f", b->eff_mhz);
+		fprintf(f, ",");
+		if (b->cur_mhz >= 0)
+			fprintf(f, "%.1f", b->cur_mhz);
+		for (c = 0; c < 4; c++) {
+			fprintf(f, ",");
+			if (b->pkg_c[c] >= 0)
+				fprintf(f, "%.4f", b->pkg_c[c]);
+		}
+		fprintf(f, ",%d\n", b->drift);
+	}
+
+	return fclose(f) ? 1 : 0;
+}
+
+
+void telemetry_close(struct telemetry *t)
+{
+	int i;
+
+	if (!t)
+		return;
+
+	for (i = 0; i < COUNTERS; i++)
+		if (t->counters[i].fd >= 0)
+			close(t->counters[i].fd);
+	if (t->msr_fd >= 0)
+		close(t->msr_fd);
+	if (t->freq_fd >= 0)
+		close(t->freq_fd);
+
+	free(t->blocks);
+	free(t);
+}
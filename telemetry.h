@@ -0,0 +1,68 @@
+/* vim: set noet: */
+/******************************************************************************
+ * CPU telemetry
+ *
+ * Frequency and idle state of the probing CPU, sampled at the end of every
+ * block of samples so that blocks measured at a different clock than the
+ * rest of the run can be told apart and thrown away.
+ *
+ * Each block records the effective frequency (the TSC rate scaled by
+ * APERF/MPERF), cpufreq's scaling_cur_freq and the share of the block the
+ * package spent in C2, C3, C6 and C7. The counters come from /dev/cpu/N/msr
+ * when it can be read, otherwise from the msr and cstate_pkg perf PMUs.
+ * Anything neither offers is left out.
+ *
+ * ******************************************************************************/
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdint.h>
+
+struct telemetry;
+
+/******************************************************************************
+ * *	Function: telemetry_open
+ * *
+ * *	Input
+ * *	cpu		CPU the probes run on
+ * *	tsc_mhz		TSC rate, from get_cpu_mhz
+ * *	max_blocks	blocks the run will close, including a short last one
+ * *
+ * *	Returns
+ * *	telemetry with its counters read for the start of the first block,
+ * *	NULL if it could not be allocated
+ * *
+ * *	Description
+ * *	The counters, cpufreq's file and room for max_blocks blocks are all
+ * *	opened and allocated here, so closing a block between two probes
+ * *	reads the counters and nothing else. Blocks past max_blocks are
+ * *	counted and left out.
+ * ******************************************************************************/
+struct telemetry *telemetry_open(int cpu, double tsc_mhz, uint64_t max_blocks);
+
+/* close the block of samples [first_sample, first_sample + samples) */
+void telemetry_block(struct telemetry *t, uint64_t first_sample, uint64_t samples);
+
+/******************************************************************************
+ * *	Function: telemetry_finish
+ * *
+ * *	Input
+ * *	t		telemetry of the run
+ * *	path		file to write the blocks to as CSV, NULL for none
+ * *	tolerance	largest relative deviation from the run's median effective
+ * *			frequency a block may have, e.g. 0.05
+ * *
+ * *	Returns
+ * *	0 on success, 1 if path could not be written
+ * *
+ * *	Description
+ * *	Flag drifted blocks, write one CSV row per block
+ * *	"block,first_sample,samples,eff_mhz,cur_mhz,pkg_c2,pkg_c3,pkg_c6,pkg_c7,drift"
+ * *	(empty where a counter is missing) and summarize on stderr.
+ * ******************************************************************************/
+int telemetry_finish(struct telemetry *t, const char *path, double tolerance);
+
+void telemetry_close(struct telemetry *t);
+
+#endif // TELEMETRY_H_
@@ -0,0 +1,253 @@
+/* vim: set noet: */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "print.h"
+#include "resources.h"
+#include "topology.h"
+
+#define CPU_DIR	"/sys/devices/system/cpu"
+
+struct cache_topology server_cache;
+
+
+uint64_t parse_size(const char *s)
+{
+	char		*end;
+	uint64_t	v = strtoull(s, &end, 0);
+
+	switch (*end) {
+		case 'G': case 'g': v <<= 10; /* fall through */
+		case 'M': case 'm': v <<= 10; /* fall through */
+		case 'K': case 'k': v <<= 10;
+	}
+
+	return v;
+}
+
+
+int cpulist_parse(const char *list, cpu_set_t *set)
+{
+	const char	*p;
+	char		*end;
+	long		first, last;
+	int		n = 0;
+
+	for (p = list; *p && *p != '\n'; p = end + (*end == ',')) {
+		first = last = strtol(p, &end, 10);
+		if (end == p || first < 0)
+			return 0;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (*end && *end != ',' && *end != '\n')
+			return 0;
+		for (; first <= last && first < CPU_SETSIZE; first++, n++)
+			CPU_SET(first, set);
+	}
+
+	return n;
+}
+
+
+int cpulist_read(const char *path, cpu_set_t *set)
+{
+	FILE	*f;
+	char	line[4096];
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (!fgets(line, sizeof(line), f)) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	cpulist_parse(line, set);
+	return 1;
+}
+
+
+/* a number from a sysfs file, with a K/M suffix as cache sizes have, 0 if missing */
+static uint64_t read_value(int cpu, int index, const char *name)
+{
+	char		path[128];
+	FILE		*f;
+	uint64_t	v = 0;
+	char		suffix = 0;
+
+	snprintf(path, sizeof(path), CPU_DIR "/cpu%d/cache/index%d/%s", cpu, index, name);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%lu%c", &v, &suffix) < 1)
+		v = 0;
+	fclose(f);
+
+	if (suffix == 'K')
+		v <<= 10;
+	else if (suffix == 'M')
+		v <<= 20;
+	return v;
+}
+
+/* logical CPUs in a cpulist file, 0 if missing */
+static int count_cpus(const char *path)
+{
+	cpu_set_t s;
+
+	CPU_ZERO(&s);
+	return cpulist_read(path, &s) ? CPU_COUNT(&s) : 0;
+}
+
+
+/* A CPU next to the buffer: the one we are on, unless the device's NUMA node
+ * says the buffer, the NIC and the helpers belong on another socket. */
+static int topology_cpu(void)
+{
+	cpu_set_t	nic;
+	char		path[128];
+	int		cpu = sched_getcpu();
+
+	CPU_ZERO(&nic);
+	if (config.dev_name) {
+		snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/local_cpulist", config.dev_name);
+		cpulist_read(path, &nic);
+	}
+	if (!CPU_COUNT(&nic) || (cpu >= 0 && CPU_ISSET(cpu, &nic)))
+		return cpu >= 0 ? cpu : 0;
+
+	for (cpu = 0; !CPU_ISSET(cpu, &nic); cpu++)
+		;
+	return cpu;
+}
+
+
+static int topology_sysfs(struct cache_topology *t)
+{
+	char	path[128];
+	int	i, level, best = -1, best_level = 0, sharing, smt;
+	int	cpu = topology_cpu();
+
+	/* the highest level data or unified cache is the LLC */
+	for (i = 0; (level = read_value(cpu, i, "level")); i++) {
+		FILE	*f;
+		char	type[32] = "";
+
+		snprintf(path, sizeof(path), CPU_DIR "/cpu%d/cache/index%d/type", cpu, i);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%31s", type) != 1)
+			type[0] = 0;
+		fclose(f);
+
+		if (strcmp(type, "Instruction") && level > best_level) {
+			best = i;
+			best_level = level;
+		}
+	}
+	if (best < 0)
+		return 1;
+
+	t->llc_size = read_value(cpu, best, "size");
+	t->ways = read_value(cpu, best, "ways_of_associativity");
+	t->line_size = read_value(cpu, best, "coherency_line_size");
+
+	snprintf(path, sizeof(path), CPU_DIR "/cpu%d/cache/index%d/shared_cpu_list", cpu, best);
+	sharing = count_cpus(path);
+	snprintf(path, sizeof(path), CPU_DIR "/cpu%d/topology/thread_siblings_list", cpu);
+	smt = count_cpus(path);
+	t->slices = sharing && smt ? sharing / smt : 0;
+
+	return !t->llc_size || !t->line_size;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+/* CPUID leaf 4, or 0x8000001d on AMD, in the same format */
+static int topology_cpuid(struct cache_topology *t)
+{
+	unsigned int	leaves[] = { 4, 0x8000001d };
+	unsigned int	a, b, c, d, i, l, level, best_level = 0, smt = 1;
+
+	if (__get_cpuid_count(0xb, 0, &a, &b, &c, &d) && (b & 0xffff))
+		smt = b & 0xffff;
+
+	for (l = 0; l < sizeof(leaves) / sizeof(leaves[0]) && !best_level; l++) {
+		for (i = 0; __get_cpuid_count(leaves[l], i, &a, &b, &c, &d) && (a & 0x1f); i++) {
+			level = (a >> 5) & 0x7;
+			/* type 2 is an instruction cache */
+			if ((a & 0x1f) == 2 || level <= best_level)
+				continue;
+
+			best_level = level;
+			t->ways = (b >> 22) + 1;
+			t->line_size = (b & 0xfff) + 1;
+			t->llc_size = (uint64_t) t->ways * (((b >> 12) & 0x3ff) + 1) * t->line_size * (c + 1);
+			t->slices = (((a >> 14) & 0xfff) + 1) / smt;
+		}
+	}
+
+	return !best_level;
+}
+#else
+static int topology_cpuid(struct cache_topology *t)
+{
+	(void) t;
+	return 1;
+}
+#endif
+
+
+int topology_read(struct cache_topology *t)
+{
+	memset(t, 0, sizeof(*t));
+	if (!topology_sysfs(t))
+		return 0;
+
+	memset(t, 0, sizeof(*t));
+	if (!topology_cpuid(t))
+		return 0;
+
+	memset(t, 0, sizeof(*t));
+	return 1;
+}
+
+
+void topology_size_buffer(const struct cache_topology *t)
+{
+	uint64_t	row_size;
+	int		automatic = !config.column_count || !config.row_count;
+
+	if (!t->llc_size || !t->line_size) {
+		if (automatic)
+			fprintf(stderr, "cache topology unknown, sizing the buffer for a 20 MB LLC\n");
+		if (!config.column_count)
+			config.column_count = DEFAULT_COLUMNS;
+		if (!config.row_count)
+			config.row_count = DEFAULT_ROWS;
+		return;
+	}
+
+	if (!config.column_count) {
+		config.column_count = (PF_GUARD_LINES * t->line_size + config.msg_size - 1) / config.msg_size;
+		if (!config.column_count)
+			config.column_count = 1;
+	}
+
+	row_size = config.column_count * config.msg_size;
+	if (!config.row_count)
+		config.row_count = (EVICT_FACTOR * t->llc_size + row_size - 1) / row_size;
+
+	if (!automatic)
+		return;
+	fprintf(stderr, "LLC %lu KB, %u ways, %u slices, %u B lines: %lu rows of %lu columns (%lu MB)\n",
+			t->llc_size >> 10, t->ways, t->slices, t->line_size,
+			config.row_count, config.column_count, buffer_size() >> 20);
+}
@@ -0,0 +1,93 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Cache topology
+ *
+ * The server's last level cache, read from /sys/devices/system/cpu/cpuN/cache
+ * or, failing that, from CPUID, and handed to the client in the handshake
+ * (see handshake.h). N is the CPU the server runs on or, when -d names a
+ * device whose local_cpulist does not include it, the first CPU of that
+ * list, so a multi-socket server describes the LLC next to its NIC. CPUID
+ * describes the CPU it runs on. Whichever side
+ * owns the probed buffer sizes it from this when -r and -c are not given:
+ *
+ *	columns	enough msg_size columns for a row to span PF_GUARD_LINES
+ *		cache lines, so seq mode steps past the adjacent line prefetcher
+ *	rows	enough rows for the buffer to be EVICT_FACTOR times the LLC,
+ *		so a seq pass evicts every line the previous one left behind
+ *
+ * The rand pattern, the sweeps, the calibration and the contention threads
+ * step through their buffers at the cache's line size.
+ *
+ * ******************************************************************************/
+
+#ifndef TOPOLOGY_H_
+#define TOPOLOGY_H_
+
+#include <stdint.h>
+#include <sched.h>
+
+#define EVICT_FACTOR	4
+#define PF_GUARD_LINES	4
+
+/* the buffer without any topology, sized for a 20 MB LLC */
+#define DEFAULT_COLUMNS	4
+#define DEFAULT_ROWS	524288
+
+struct cache_topology {
+	uint32_t	line_size;	/* bytes, 0 when nothing is known */
+	uint32_t	ways;
+	uint32_t	slices;		/* taken as the cores sharing the LLC */
+	uint64_t	llc_size;	/* bytes */
+};
+
+/* the server's cache as far as it is known, read by topology_read or
+ * received from the server, all 0 until then */
+extern struct cache_topology server_cache;
+
+/* the line size assumed while the topology is unknown */
+#define TOPOLOGY_LINE	64
+
+/* the bytes to step a buffer by to visit each of t's lines once */
+static inline uint32_t topology_line(const struct cache_topology *t)
+{
+	return t->line_size ? t->line_size : TOPOLOGY_LINE;
+}
+
+/******************************************************************************
+ * *	Function: topology_read
+ * *
+ * *	Output
+ * *	t	this machine's last level cache
+ * *
+ * *	Returns
+ * *	0 on success, 1 if neither sysfs nor CPUID describe it, t is all 0 then
+ * ******************************************************************************/
+int topology_read(struct cache_topology *t);
+
+/******************************************************************************
+ * *	Function: topology_size_buffer
+ * *
+ * *	Input
+ * *	t	cache the buffer is meant to overflow
+ * *
+ * *	Returns
+ * *	none
+ * *
+ * *	Description
+ * *	Fill in config.column_count and config.row_count where they are 0
+ * *	(not given), from t as above or from the defaults when t is unknown,
+ * *	and say what was picked on stderr.
+ * ******************************************************************************/
+void topology_size_buffer(const struct cache_topology *t);
+
+/* add a cpulist such as "0-3,8,10-11" to set, the number of CPUs in it,
+ * 0 for anything else */
+int cpulist_parse(const char *list, cpu_set_t *set);
+
+/* add the cpulist in the file at path to set, 0 if it could not be read */
+int cpulist_read(const char *path, cpu_set_t *set);
+
+/* a byte count with an optional K, M or G suffix, as cache sizes are given */
+uint64_t parse_size(const char *s);
+
+#endif // TOPOLOGY_H_
@@ -0,0 +1,272 @@
+/* vim: set noet: */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <emmintrin.h>
+
+#include "print.h"
+#include "trace.h"
+#include "topology.h"
+
+/* O_DIRECT writes are whole multiples of this, at offsets that are too */
+#define TRACE_ALIGN	4096
+/* text the writer formats before writing it out, and the longest row */
+#define TRACE_TEXT	(1024 * 1024)
+#define TRACE_ROW_MAX	160
+/* how long the writer sleeps when there is nothing to write */
+#define TRACE_IDLE_NS	50000
+
+static int ring_push(struct trace_ring *r, struct trace_block *b)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == TRACE_BLOCKS)
+		return 0;
+	r->slots[head % TRACE_BLOCKS] = b;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return 1;
+}
+
+static struct trace_block *ring_pop(struct trace_ring *r)
+{
+	uint32_t		tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	struct trace_block	*b;
+
+	if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+		return NULL;
+	b = r->slots[tail % TRACE_BLOCKS];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return b;
+}
+
+
+/* write all of buf, remembering the first error and writing nothing after it */
+static void write_all(struct trace *t, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len && !t->error) {
+		n = write(t->fd, buf, len);
+		if (n < 0) {
+			/* some filesystems only turn O_DIRECT down on the first write */
+			if (errno == EINVAL && fcntl(t->fd, F_GETFL) & O_DIRECT)
+				fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) & ~O_DIRECT);
+			else if (errno != EINTR)
+				t->error = errno;
+			continue;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* write the aligned front of text and move the rest to its start */
+static void flush_aligned(struct trace *t, char *text, size_t *len)
+{
+	size_t n = *len & ~(size_t) (TRACE_ALIGN - 1);
+
+	write_all(t, text, n);
+	memmove(text, text + n, *len - n);
+	*len -= n;
+}
+
+/* Another core than the probing one, and no isolcpus or nohz_full CPU
+ * while there is another one, then any CPU but the probing one. The writer
+ * keeps the scheduler's default policy. */
+static void writer_placement(struct trace *t)
+{
+	struct sched_param	param = { .sched_priority = 0 };
+	cpu_set_t		siblings, quiet, s;
+	char			path[128];
+	int			cpu, pass;
+
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+	CPU_ZERO(&siblings);
+	CPU_ZERO(&quiet);
+	if (t->probe_cpu >= 0) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", t->probe_cpu);
+		cpulist_read(path, &siblings);
+		CPU_SET(t->probe_cpu, &siblings);
+	}
+	cpulist_read("/sys/devices/system/cpu/isolated", &quiet);
+	cpulist_read("/sys/devices/system/cpu/nohz_full", &quiet);
+
+	for (pass = 0; pass < 3; pass++) {
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (cpu == t->probe_cpu || (pass < 2 && CPU_ISSET(cpu, &siblings)) || (pass < 1 && CPU_ISSET(cpu, &quiet)))
+				continue;
+			CPU_ZERO(&s);
+			CPU_SET(cpu, &s);
+			if (!pthread_setaffinity_np(pthread_self(), sizeof(s), &s)) {
+				if (pass == 2)
+					fprintf(stderr, "trace: no other core for the writer, it shares the probes' core on cpu %d\n", cpu);
+				debug_print("trace: writer on cpu %d\n", cpu);
+				return;
+			}
+		}
+	}
+	fprintf(stderr, "trace: no other CPU for the writer, it shares cpu %d with the probes\n", t->probe_cpu);
+}
+
+static void *trace_writer(void *arg)
+{
+	struct trace		*t = arg;
+	struct trace_block	*b;
+	struct timespec		idle = { 0, TRACE_IDLE_NS };
+	char			*text = t->text;
+	size_t			len = t->header;
+	uint32_t		i;
+	int			done;
+
+	writer_placement(t);
+
+	while (1) {
+		/* done is read first, so a block pushed before it was set is still found */
+		done = atomic_load_explicit(&t->done, memory_order_acquire);
+		b = ring_pop(&t->full);
+		if (!b) {
+			if (done)
+				break;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		for (i = 0; i < b->count; i++) {
+			struct trace_sample *s = &b->samples[i];
+
+			if (len > TRACE_TEXT - TRACE_ROW_MAX)
+				flush_aligned(t, text, &len);
+
+			/* the same rows record_sample prints */
+			if (s->hit1 >= 0 || s->hit2 >= 0)
+				len += snprintf(text + len, TRACE_TEXT - len, "%lu,%lu,%f,%f,%d,%d\n", s->read1, s->read2,
+						(s->read1 * 1000) / t->cycles_to_usec, (s->read2 * 1000) / t->cycles_to_usec, s->hit1, s->hit2);
+			else
+				len += snprintf(text + len, TRACE_TEXT - len, "%lu,%lu,%f,%f\n", s->read1, s->read2,
+						(s->read1 * 1000) / t->cycles_to_usec, (s->read2 * 1000) / t->cycles_to_usec);
+		}
+		t->written += b->count;
+
+		b->count = 0;
+		ring_push(&t->empty, b);
+	}
+
+	/* the tail is not a whole block, write it without O_DIRECT */
+	flush_aligned(t, text, &len);
+	fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) & ~O_DIRECT);
+	write_all(t, text, len);
+
+	return NULL;
+}
+
+
+struct trace *trace_open(const char *path, const char *header, double cycles_to_usec)
+{
+	struct trace	*t;
+	int		i;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->probe_cpu = sched_getcpu();
+	t->cycles_to_usec = cycles_to_usec;
+
+	/* filesystems without O_DIRECT, such as older tmpfs, get buffered writes */
+	t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (t->fd < 0 && errno == EINVAL)
+		t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (t->fd < 0) {
+		perror(path);
+		goto trace_open_fail;
+	}
+
+	/* touch every block so the probing thread does not fault them in */
+	t->blocks = malloc(TRACE_BLOCKS * sizeof(*t->blocks));
+	if (!t->blocks) {
+		fprintf(stderr, "failed to allocate %lu bytes of trace blocks\n", TRACE_BLOCKS * sizeof(*t->blocks));
+		goto trace_open_fail;
+	}
+	memset(t->blocks, 0, TRACE_BLOCKS * sizeof(*t->blocks));
+
+	t->text = aligned_alloc(TRACE_ALIGN, TRACE_TEXT);
+	if (!t->text) {
+		fprintf(stderr, "failed to allocate the trace text buffer\n");
+		goto trace_open_fail;
+	}
+	if (header) {
+		t->header = strnlen(header, TRACE_TEXT - TRACE_ROW_MAX);
+		memcpy(t->text, header, t->header);
+	}
+
+	t->cur = &t->blocks[0];
+	for (i = 1; i < TRACE_BLOCKS; i++)
+		ring_push(&t->empty, &t->blocks[i]);
+
+	if (pthread_create(&t->thread, NULL, trace_writer, t)) {
+		fprintf(stderr, "failed to start the trace writer\n");
+		goto trace_open_fail;
+	}
+
+	return t;
+
+trace_open_fail:
+	if (t->fd >= 0)
+		close(t->fd);
+	free(t->text);
+	free(t->blocks);
+	free(t);
+	return NULL;
+}
+
+
+void trace_hand_off(struct trace *t)
+{
+	struct trace_block *b;
+
+	/* there are no more blocks than slots, so the push cannot fail */
+	ring_push(&t->full, t->cur);
+
+	b = ring_pop(&t->empty);
+	if (!b) {
+		t->stalls++;
+		while (!(b = ring_pop(&t->empty)))
+			_mm_pause();
+	}
+	t->cur = b;
+}
+
+
+int trace_close(struct trace *t)
+{
+	int rc;
+
+	if (!t)
+		return 0;
+
+	ring_push(&t->full, t->cur);
+	atomic_store_explicit(&t->done, 1, memory_order_release);
+	pthread_join(t->thread, NULL);
+
+	if (t->stalls)
+		fprintf(stderr, "trace: probing waited for the writer %lu times\n", t->stalls);
+	if (t->error)
+		fprintf(stderr, "trace: writing failed after %lu samples (%s)\n", t->written, strerror(t->error));
+	debug_print("trace: %lu samples written\n", t->written);
+
+	rc = t->error != 0;
+	if (close(t->fd))
+		rc = 1;
+
+	free(t->text);
+	free(t->blocks);
+	free(t);
+	return rc;
+}
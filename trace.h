@@ -0,0 +1,112 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Trace writer
+ *
+ * Moves the per-sample CSV rows off the probing CPU. The probing thread
+ * appends raw samples to a block and, once the block is full, hands it to
+ * a writer thread on another core over a single-producer single-consumer
+ * ring. The writer formats the rows, writes them to the file with O_DIRECT
+ * and hands the empty block back over a second ring. The probing thread
+ * makes no system calls, and memory use stays at TRACE_BLOCKS blocks
+ * however long the run is.
+ *
+ * When every block is still waiting to be written, the probing thread
+ * spins until one comes back. The number of such waits is reported on
+ * close. A header given to trace_open goes ahead of the rows, the same run
+ * header stdout gets (calibration.h).
+ *
+ * ******************************************************************************/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* samples per block and blocks in flight, a power of 2 */
+#define TRACE_BLOCK_SAMPLES	65536
+#define TRACE_BLOCKS		8
+
+struct trace_sample {
+	uint64_t	read1;
+	uint64_t	read2;
+	int32_t		hit1;	/* ground truth, -1 when the backend has none */
+	int32_t		hit2;
+};
+
+struct trace_block {
+	uint32_t		count;
+	struct trace_sample	samples[TRACE_BLOCK_SAMPLES];
+};
+
+/* head is only written by the producer and tail only by the consumer */
+struct trace_ring {
+	_Atomic uint32_t	head __attribute__((aligned(64)));
+	_Atomic uint32_t	tail __attribute__((aligned(64)));
+	struct trace_block	*slots[TRACE_BLOCKS];
+};
+
+struct trace {
+	struct trace_block	*cur;		/* block the probing thread fills */
+	struct trace_ring	full;		/* probing thread to writer */
+	struct trace_ring	empty;		/* writer to probing thread */
+	uint64_t		stalls;		/* hand-offs that had to wait for an empty block */
+	_Atomic int		done;
+	int			fd;
+	int			probe_cpu;
+	double			cycles_to_usec;
+	int			error;		/* errno of the first failed write */
+	uint64_t		written;	/* samples written */
+	size_t			header;		/* bytes of header at the start of text */
+	pthread_t		thread;
+	struct trace_block	*blocks;
+	char			*text;		/* writer's formatting buffer */
+};
+
+/******************************************************************************
+ * *	Function: trace_open
+ * *
+ * *	Input
+ * *	path		file to write the samples to, truncated
+ * *	header		text written ahead of the samples, NULL for none
+ * *	cycles_to_usec	cycles per microsecond, from get_cpu_mhz
+ * *
+ * *	Returns
+ * *	trace with its writer running on another core than the calling
+ * *	thread, outside isolcpus and nohz_full where possible, NULL on
+ * *	failure
+ * ******************************************************************************/
+struct trace *trace_open(const char *path, const char *header, double cycles_to_usec);
+
+/* hand the full block to the writer and take an empty one */
+void trace_hand_off(struct trace *t);
+
+/* record one line's pair of reads, written as a CSV row in the format of stdout */
+static inline void trace_add(struct trace *t, uint64_t read1, uint64_t read2, int hit1, int hit2)
+{
+	struct trace_sample *s = &t->cur->samples[t->cur->count++];
+
+	s->read1 = read1;
+	s->read2 = read2;
+	s->hit1 = hit1;
+	s->hit2 = hit2;
+	if (t->cur->count == TRACE_BLOCK_SAMPLES)
+		trace_hand_off(t);
+}
+
+/******************************************************************************
+ * *	Function: trace_close
+ * *
+ * *	Input
+ * *	t	trace from trace_open, may be NULL
+ * *
+ * *	Returns
+ * *	0 on success, 1 if any write failed
+ * *
+ * *	Description
+ * *	Write the partial last block, stop the writer and close the file.
+ * ******************************************************************************/
+int trace_close(struct trace *t);
+
+#endif // TRACE_H_
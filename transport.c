@@ -0,0 +1,249 @@
+/* vim: set noet: */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <infiniband/verbs.h>
+
+#include "get_clock.h"
+#include "resources.h"
+#include "cm.h"
+#include "completion.h"
+#include "handshake.h"
+#include "evict.h"
+#include "oracle.h"
+#include "transport.h"
+
+/* send_flags of WRITE probes, IBV_SEND_INLINE added by verbs_create when
+ * msg_size fits both QPs' inline data */
+static unsigned int write_send_flags = IBV_SEND_SIGNALED;
+
+/* Time the difference between an post_send and a poll_cq. opcode and tsc
+ * are constants in every caller, so each kernel below is built with only
+ * its own WR setup and timestamps and nothing else between them. */
+static __inline __attribute__((always_inline)) int probe_kernel(struct resources *res, const int opcode, const int tsc, uint64_t *cycle_count)
+{
+	struct ibv_sge		sge = {
+		.addr = (uintptr_t) res->buf,
+		.length = config.msg_size,
+		.lkey = res->mr->lkey,
+	};
+	struct ibv_send_wr	sr = {
+		.wr_id = 0,
+		.next = NULL,
+		.sg_list = &sge,
+		.num_sge = 1,
+		.opcode = opcode,
+		.send_flags = opcode == IBV_WR_RDMA_WRITE ? write_send_flags : IBV_SEND_SIGNALED,
+		.wr.rdma.remote_addr = res->remote_props.addr,
+		.wr.rdma.rkey = remote_rkey(res, res->remote_props.addr),
+	};
+	struct ibv_send_wr	*bad_wr = NULL;
+	struct ibv_qp		*qp = res->qp;
+	struct ibv_cq		*cq = res->cq;
+	uint64_t		deadline = cq_deadline(CQ_TIMEOUT_MS);
+	uint64_t		start_cycle_count, end_cycle_count = 0;
+
+	/* there is a Receive Request in the responder side, so we won't get any into RNR flow */
+	start_cycle_count = tsc == TSC_FENCED ? start_tsc() : rdtscp_tsc();
+
+	if (ibv_post_send(qp, &sr, &bad_wr)) {
+		fprintf(stderr, "failed to post SR\n");
+		return 1;
+	}
+	if (cq_wait(cq, 1, deadline, tsc, &end_cycle_count))
+		return 1;
+
+	*cycle_count = end_cycle_count - start_cycle_count;
+
+	return 0;
+}
+
+#define PROBE_KERNEL(name, opcode, tsc) \
+	static int name(struct resources *res, uint64_t *cycle_count) \
+	{ \
+		return probe_kernel(res, opcode, tsc, cycle_count); \
+	}
+
+PROBE_KERNEL(probe_read_fenced, IBV_WR_RDMA_READ, TSC_FENCED)
+PROBE_KERNEL(probe_write_fenced, IBV_WR_RDMA_WRITE, TSC_FENCED)
+PROBE_KERNEL(probe_read_rdtscp, IBV_WR_RDMA_READ, TSC_RDTSCP)
+PROBE_KERNEL(probe_write_rdtscp, IBV_WR_RDMA_WRITE, TSC_RDTSCP)
+
+/* kernels for READ and WRITE, picked by verbs_create from config.tsc */
+static int (*probe_kernels[2])(struct resources *res, uint64_t *cycle_count) = {
+	probe_read_fenced, probe_write_fenced
+};
+
+static int post_send_poll_complete(struct resources *res, int opcode, uint64_t *cycle_count)
+{
+	return probe_kernels[opcode == IBV_WR_RDMA_WRITE](res, cycle_count);
+}
+
+
+/* Post the whole chain with one doorbell and time each WR from the post to
+ * the poll that returned its completion. wr_id is the WR's index, so the
+ * latency lands on the right line whatever order the completions come in.
+ * tsc is a constant in every caller, as in probe_kernel. */
+static __inline __attribute__((always_inline)) int batch_kernel(struct resources *res, int opcode, const uint64_t *addrs, int n, const int tsc, uint64_t *cycles, int *hits)
+{
+	struct ibv_send_wr	sr[MAX_BATCH];
+	struct ibv_sge		sge[MAX_BATCH];
+	struct ibv_send_wr	*bad_wr = NULL;
+	uint64_t		deadline = cq_deadline(CQ_TIMEOUT_MS);
+	uint64_t		start_cycle_count;
+	int			i, rc;
+
+	memset(sge, 0, n * sizeof(sge[0]));
+	memset(sr, 0, n * sizeof(sr[0]));
+	for (i = 0; i < n; i++) {
+		sge[i].addr = (uintptr_t) res->buf + i * config.msg_size;
+		sge[i].length = config.msg_size;
+		sge[i].lkey = res->mr->lkey;
+
+		sr[i].next = i + 1 < n ? &sr[i + 1] : NULL;
+		sr[i].wr_id = i;
+		sr[i].sg_list = &sge[i];
+		sr[i].num_sge = 1;
+		sr[i].opcode = opcode;
+		sr[i].send_flags = opcode == IBV_WR_RDMA_WRITE ? write_send_flags : IBV_SEND_SIGNALED;
+		sr[i].wr.rdma.remote_addr = addrs[i];
+		sr[i].wr.rdma.rkey = remote_rkey(res, addrs[i]);
+
+		hits[i] = -1;
+	}
+
+	start_cycle_count = tsc == TSC_FENCED ? start_tsc() : rdtscp_tsc();
+
+	if (ibv_post_send(res->qp, sr, &bad_wr)) {
+		fprintf(stderr, "failed to post SR chain at WR %ld\n", bad_wr ? (long) bad_wr->wr_id : -1L);
+		return 1;
+	}
+
+	rc = cq_wait(res->cq, n, deadline, tsc, cycles);
+	for (i = 0; i < n; i++)
+		cycles[i] -= start_cycle_count;
+
+	return rc;
+}
+
+#define BATCH_KERNEL(name, tsc) \
+	static int name(struct resources *res, int opcode, const uint64_t *addrs, int n, uint64_t *cycles, int *hits) \
+	{ \
+		return batch_kernel(res, opcode, addrs, n, tsc, cycles, hits); \
+	}
+
+BATCH_KERNEL(batch_fenced, TSC_FENCED)
+BATCH_KERNEL(batch_rdtscp, TSC_RDTSCP)
+
+/* the batch kernel, picked by verbs_create from config.tsc */
+static int (*batch_probe_kernel)(struct resources *res, int opcode, const uint64_t *addrs, int n, uint64_t *cycles, int *hits) = batch_fenced;
+
+static int post_send_poll_complete_batch(struct resources *res, int opcode, const uint64_t *addrs, int n, uint64_t *cycles, int *hits)
+{
+	return batch_probe_kernel(res, opcode, addrs, n, cycles, hits);
+}
+
+
+/* WRITE probes go inline when the message fits what both QPs take */
+static void pick_write_flags(const struct resources *res)
+{
+	uint32_t fits = res->max_inline < res->peer.max_inline ? res->max_inline : res->peer.max_inline;
+
+	write_send_flags = IBV_SEND_SIGNALED;
+	if (config.msg_size <= fits)
+		write_send_flags |= IBV_SEND_INLINE;
+	debug_print("WRITE probes %s inline, %u bytes fit\n", config.msg_size <= fits ? "go" : "do not go", fits);
+}
+
+
+static int verbs_create(struct resources *res)
+{
+	if (config.tsc == TSC_RDTSCP) {
+		probe_kernels[0] = probe_read_rdtscp;
+		probe_kernels[1] = probe_write_rdtscp;
+		batch_probe_kernel = batch_rdtscp;
+	}
+
+#ifdef HAVE_RDMACM
+	if (config.rdma_cm) {
+		/* rdma_cm creates and connects everything in one go */
+		if (cm_connect(res)) {
+			fprintf(stderr, "failed to connect with rdma_cm\n");
+			return 1;
+		}
+		if (handshake(res) || mr_table_exchange(res))
+			return 1;
+		pick_write_flags(res);
+		return 0;
+	}
+#endif
+
+	/* create resources before using them */
+	if (resources_create(res)) {
+		fprintf(stderr, "failed to create resources\n");
+		return 1;
+	}
+
+	/* connect the QPs */
+	if (connect_qp(res)) {
+		fprintf(stderr, "failed to connect QPs\n");
+		return 1;
+	}
+
+	/* connect_qp has run the handshake */
+	if (mr_table_exchange(res))
+		return 1;
+	pick_write_flags(res);
+	return 0;
+}
+
+
+const struct transport verbs_transport = {
+	.name = "verbs",
+	.create = verbs_create,
+	.poll_completion = poll_completion,
+	.probe = post_send_poll_complete,
+	.probe_batch = post_send_poll_complete_batch,
+	.sync = ctrl_sync,
+	.evict = evict_remote,
+	.last_hit = oracle_last_hit,
+	.destroy = resources_destroy,
+};
+
+
+int transport_probe_batch(struct resources *res, int opcode, const uint64_t *addrs, int n, uint64_t *cycles, int *hits)
+{
+	uint64_t	orig_addr = res->remote_props.addr;
+	char		*orig_buf = res->buf;
+	int		i, rc = 0;
+
+	if (res->transport->probe_batch)
+		return res->transport->probe_batch(res, opcode, addrs, n, cycles, hits);
+
+	/* step buf through the slots so each probe keeps its own data */
+	for (i = 0; i < n && !rc; i++) {
+		res->remote_props.addr = addrs[i];
+		res->buf = orig_buf + i * config.msg_size;
+		rc = transport_probe(res, opcode, &cycles[i]);
+		hits[i] = transport_last_hit(res);
+	}
+
+	res->remote_props.addr = orig_addr;
+	res->buf = orig_buf;
+
+	return rc;
+}
+
+
+const struct transport *transport_find(const char *name)
+{
+	if (!strcmp(name, verbs_transport.name))
+		return &verbs_transport;
+	if (!strcmp(name, sim_transport.name))
+		return &sim_transport;
+	if (!strcmp(name, local_transport.name))
+		return &local_transport;
+
+	return NULL;
+}
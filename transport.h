@@ -0,0 +1,114 @@
+/* vim: set noet: */
+/******************************************************************************
+ * Transports
+ *
+ * Everything the client does to the server goes through one of these: the
+ * verbs backend talks to a real server over RDMA, the simulated backend runs
+ * an in-process model of the server's LLC (see sim.h) so the probe loop can
+ * run, and be checked against ground truth, without an RDMA device. The
+ * local backend times loads of a local buffer after clflush and after a
+ * touch instead, a per-host baseline for the remote numbers.
+ *
+ * ******************************************************************************/
+
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "resources.h"
+
+struct transport {
+	const char	*name;
+
+	/* create the resources and connect to the peer (resources_create + connect_qp) */
+	int		(*create)(struct resources *res);
+
+	/* wait for the server's initial SEND */
+	int		(*poll_completion)(struct resources *res);
+
+	/* post one READ or WRITE of msg_size bytes at remote_props.addr and
+	 * return its latency in cycles (post_send_poll_complete) */
+	int		(*probe)(struct resources *res, int opcode, uint64_t *cycle_count);
+
+	/* post n READs or WRITEs to addrs as one chain, the i-th from/to the
+	 * i-th msg_size slot of buf, and return each one's latency in cycles
+	 * and whether it hit (-1 when unknown). NULL to probe one at a time. */
+	int		(*probe_batch)(struct resources *res, int opcode, const uint64_t *addrs, int n, uint64_t *cycles, int *hits);
+
+	/* exchange xfer_size bytes with the peer (sock_sync_data) */
+	int		(*sync)(struct resources *res, int xfer_size, char *local_data, char *remote_data);
+
+	/* evict the line at remote address addr from the server's LLC, see
+	 * evict.h, NULL when the backend cannot */
+	int		(*evict)(struct resources *res, uint64_t addr);
+
+	/* whether the last probe hit in the LLC, NULL when the backend cannot tell */
+	int		(*last_hit)(struct resources *res);
+
+	int		(*destroy)(struct resources *res);
+};
+
+extern const struct transport verbs_transport;
+extern const struct transport sim_transport;
+extern const struct transport local_transport;
+
+/******************************************************************************
+ * *	Function: transport_find
+ * *
+ * *	Input
+ * *	name	"verbs", "sim" or "local"
+ * *
+ * *	Returns
+ * *	the transport, NULL if there is none by that name
+ * ******************************************************************************/
+const struct transport *transport_find(const char *name);
+
+
+static inline int transport_probe(struct resources *res, int opcode, uint64_t *cycle_count)
+{
+	return res->transport->probe(res, opcode, cycle_count);
+}
+
+/******************************************************************************
+ * *	Function: transport_probe_batch
+ * *
+ * *	Input
+ * *	res	connected resources
+ * *	opcode	IBV_WR_RDMA_READ or IBV_WR_RDMA_WRITE
+ * *	addrs	n remote addresses, n <= config.batch
+ * *
+ * *	Output
+ * *	cycles	latency of each probe
+ * *	hits	whether each probe hit, -1 when the backend cannot tell
+ * *
+ * *	Returns
+ * *	0 on success, 1 on failure
+ * *
+ * *	Description
+ * *	The backend's probe_batch, or one probe after the other for backends
+ * *	without one. remote_props.addr is left as it was.
+ * ******************************************************************************/
+int transport_probe_batch(struct resources *res, int opcode, const uint64_t *addrs, int n, uint64_t *cycles, int *hits);
+
+static inline int transport_sync(struct resources *res, int xfer_size, char *local_data, char *remote_data)
+{
+	return res->transport->sync(res, xfer_size, local_data, remote_data);
+}
+
+static inline int transport_evict(struct resources *res, uint64_t addr)
+{
+	if (!res->transport->evict) {
+		fprintf(stderr, "the %s backend cannot evict\n", res->transport->name);
+		return 1;
+	}
+	return res->transport->evict(res, addr);
+}
+
+static inline int transport_last_hit(struct resources *res)
+{
+	return res->transport->last_hit ? res->transport->last_hit(res) : -1;
+}
+
+#endif // TRANSPORT_H_